@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace messaging {
+
+// Accounts by account ID, split into independent hash maps by a hash of the
+// ID. Each partition can be filled by its own thread, so a bulk load builds
+// the table in parallel without locks. With one partition, the default, a
+// lookup is a plain unordered_map lookup.
+template <typename Value>
+class account_table
+{
+public:
+    using partition_type = std::unordered_map<std::string, Value>;
+
+    explicit account_table(std::size_t partitions = 1)
+        : parts_(partitions ? partitions : 1)
+    {
+    }
+
+    std::size_t partitions() const
+    {
+        return parts_.size();
+    }
+
+    std::size_t partition_of(std::string const & account) const
+    {
+        if (parts_.size() == 1)
+        {
+            return 0;
+        }
+        // Fibonacci hashing of the map's own hash, so partitions differ in
+        // the high bits and each map still sees its full range.
+        std::uint64_t const h = std::hash<std::string>{}(account);
+        return static_cast<std::size_t>(((h * 0x9e3779b97f4a7c15ull) >> 32) % parts_.size());
+    }
+
+    partition_type & partition(std::size_t i)
+    {
+        return parts_[i];
+    }
+
+    partition_type const & partition(std::size_t i) const
+    {
+        return parts_[i];
+    }
+
+    // Inserts a default Value if the account is new.
+    Value & operator[](std::string const & account)
+    {
+        return parts_[partition_of(account)][account];
+    }
+
+    // nullptr if the account is not in the table.
+    Value * find(std::string const & account)
+    {
+        auto & part = parts_[partition_of(account)];
+        auto const i = part.find(account);
+        return i == part.end() ? nullptr : &i->second;
+    }
+
+    Value const * find(std::string const & account) const
+    {
+        auto const & part = parts_[partition_of(account)];
+        auto const i = part.find(account);
+        return i == part.end() ? nullptr : &i->second;
+    }
+
+    std::size_t size() const
+    {
+        std::size_t n = 0;
+        for (auto const & part : parts_)
+        {
+            n += part.size();
+        }
+        return n;
+    }
+
+    // Calls f(account, value) for every account, partition by partition.
+    template <typename Func>
+    void for_each(Func && f) const
+    {
+        for (auto const & part : parts_)
+        {
+            for (auto const & a : part)
+            {
+                f(a.first, a.second);
+            }
+        }
+    }
+
+private:
+    std::vector<partition_type> parts_;
+};
+
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace messaging {
+
+// A token bucket kept as one atomic timestamp, the time at which the bucket
+// would be full again (the generic cell rate algorithm). Taking a token moves
+// it on by one token's worth of time and is refused if that would put it
+// more than a full bucket ahead of now. Refill is implied by the clock, so
+// no timer runs, and a take is one compare-and-swap.
+class token_bucket
+{
+public:
+    // `rate` tokens per second, at most `burst` at once; rate 0 never refuses.
+    token_bucket(double rate, unsigned burst)
+        : interval_ns_{rate > 0 ? static_cast<std::int64_t>(1e9 / rate) : 0}
+        , window_ns_{interval_ns_ * std::max(burst, 1u)}
+    {
+    }
+
+    token_bucket(token_bucket const &) = delete;
+    token_bucket & operator=(token_bucket const &) = delete;
+
+    bool try_take(std::int64_t now_ns)
+    {
+        if (interval_ns_ == 0)
+        {
+            return true;
+        }
+        std::int64_t full_at = full_at_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            std::int64_t const next = std::max(full_at, now_ns) + interval_ns_;
+            if (next - now_ns > window_ns_)
+            {
+                return false;
+            }
+            if (full_at_.compare_exchange_weak(full_at, next, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+    }
+
+    // Returns a token try_take() gave out.
+    void give_back()
+    {
+        full_at_.fetch_sub(interval_ns_, std::memory_order_relaxed);
+    }
+
+private:
+    std::int64_t const interval_ns_;
+    std::int64_t const window_ns_;
+    std::atomic<std::int64_t> full_at_{0};
+    // Each terminal's bucket is taken from by its own atm thread.
+    char pad_[64 - 3 * sizeof(std::int64_t)];
+};
+
+
+// Admission control in front of the banks. A request gets in only if its
+// terminal's bucket and the global bucket both have a token, so a runaway
+// terminal exhausts its own bucket long before the global one. The sender
+// checks before queueing, and a request turned away never reaches a bank
+// queue, which keeps the queues, and the latency of everyone else, short.
+class admission_control
+{
+public:
+    // Rates are requests per second; 0 means unlimited.
+    admission_control(std::size_t terminals, double terminal_rate, unsigned terminal_burst, double global_rate, unsigned global_burst)
+        : global_{global_rate, global_burst}
+    {
+        for (std::size_t i = 0; i < std::max<std::size_t>(terminals, 1); ++i)
+        {
+            terminals_.emplace_back(new token_bucket{terminal_rate, terminal_burst});
+        }
+    }
+
+    admission_control(admission_control const &) = delete;
+    admission_control & operator=(admission_control const &) = delete;
+
+    bool admit(std::uint32_t terminal)
+    {
+        std::int64_t const now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        auto & own = *terminals_[terminal % terminals_.size()];
+        if (not own.try_take(now))
+        {
+            rejected_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (not global_.try_take(now))
+        {
+            own.give_back();
+            rejected_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    std::uint64_t rejected() const
+    {
+        return rejected_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::vector<std::unique_ptr<token_bucket> > terminals_;
+    token_bucket global_;
+    std::atomic<std::uint64_t> rejected_{0};
+};
+
+}
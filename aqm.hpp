@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace messaging {
+
+// CoDel-style active queue management for one receiver. Its queue reports
+// the sojourn time of every message it pops, i.e. how long the message
+// waited. If no message has waited less than `target` for a whole
+// `interval`, so that even the shortest wait in that time was too long, the
+// queue is standing rather than absorbing a burst, and until a message gets
+// through in less than target again the receiver sheds every low-priority
+// request that waited longer than target. That empties a standing queue of
+// its cheapest-to-refuse work quickly, while a burst that clears within the
+// interval loses nothing. Messages differ in cost, so the time they wait
+// says more about overload than the depth of the queue does.
+//
+// Both sides run on the receiver's thread: the queue calls dequeued() as
+// the receiver pops, and the receiver asks shed() about each low-priority
+// request it is about to serve.
+class sojourn_controller
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    sojourn_controller(clock::duration target, clock::duration interval)
+        : target_{target}
+        , interval_{interval}
+        , below_at_{clock::now()}
+    {
+    }
+
+    sojourn_controller(sojourn_controller const &) = delete;
+    sojourn_controller & operator=(sojourn_controller const &) = delete;
+
+    // `emptied`: nothing is left behind the message, so nothing is standing.
+    void dequeued(clock::duration sojourn, clock::time_point now, bool emptied)
+    {
+        last_ = sojourn;
+        if (sojourn < target_ or emptied)
+        {
+            below_at_ = now;
+            overloaded_ = false;
+        }
+        else if (now - below_at_ >= interval_)
+        {
+            overloaded_ = true;
+        }
+    }
+
+    // True if the low-priority request popped last is to be turned away.
+    bool shed()
+    {
+        if (not overloaded_ or last_ < target_)
+        {
+            return false;
+        }
+        shed_total_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Requests shed so far; safe from any thread.
+    std::uint64_t shed_total() const
+    {
+        return shed_total_.load(std::memory_order_relaxed);
+    }
+
+private:
+    clock::duration const target_;
+    clock::duration const interval_;
+    // Last time a message waited less than target, or the queue emptied.
+    clock::time_point below_at_;
+    bool overloaded_ = false;
+    // Sojourn of the message popped last.
+    clock::duration last_{};
+    std::atomic<std::uint64_t> shed_total_{0};
+};
+
+}
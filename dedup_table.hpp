@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace messaging {
+
+// Outcomes of recent requests by request ID, so that a retried request gets
+// the original answer instead of being applied twice.
+//
+// Owned by a single actor (e.g. one bank shard), so it needs no locking. The
+// table is bounded: IDs hash to a bucket of `ways` entries, and an insert
+// into a full bucket reuses an expired entry or else evicts the oldest one.
+// Lookups and inserts touch one bucket, i.e. one or two cache lines, and
+// never allocate. Under sustained overload an entry can be evicted before
+// its TTL; capacity should cover the request rate times the TTL.
+template <typename Outcome>
+class dedup_table
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    static std::size_t constexpr ways = 4;
+
+    explicit dedup_table(std::size_t capacity = 1 << 14, clock::duration ttl = std::chrono::minutes{5})
+        : ttl_{ttl}
+    {
+        std::size_t buckets = 1;
+        while (buckets * ways < capacity)
+        {
+            buckets *= 2;
+        }
+        mask_ = buckets - 1;
+        entries_.resize(buckets * ways);
+    }
+
+    // Outcome recorded for `id` within the TTL, or nullptr. ID 0 is never
+    // recorded.
+    Outcome const * find(std::uint64_t id, clock::time_point now) const
+    {
+        entry const * bucket = &entries_[index(id)];
+        for (std::size_t i = 0; i < ways; ++i)
+        {
+            if (bucket[i].id == id and id != 0 and live(bucket[i], now))
+            {
+                return &bucket[i].outcome;
+            }
+        }
+        return nullptr;
+    }
+
+    void insert(std::uint64_t id, Outcome const & outcome, clock::time_point now)
+    {
+        if (id == 0)
+        {
+            return;
+        }
+        entry * bucket = &entries_[index(id)];
+        entry * victim = &bucket[0];
+        for (std::size_t i = 0; i < ways; ++i)
+        {
+            entry & e = bucket[i];
+            if (e.id == id or e.id == 0 or not live(e, now))
+            {
+                victim = &e;
+                break;
+            }
+            if (e.at < victim->at)
+            {
+                victim = &e;
+            }
+        }
+        if (victim->id != 0 and live(*victim, now))
+        {
+            ++evicted_;
+        }
+        victim->id = id;
+        victim->at = now;
+        victim->outcome = outcome;
+    }
+
+    // Unexpired entries displaced by newer ones; non-zero means the table is
+    // too small for the request rate.
+    std::uint64_t evicted() const
+    {
+        return evicted_;
+    }
+
+private:
+    struct entry
+    {
+        std::uint64_t id = 0;
+        clock::time_point at;
+        Outcome outcome{};
+    };
+
+    bool live(entry const & e, clock::time_point now) const
+    {
+        return now - e.at < ttl_;
+    }
+
+    std::size_t index(std::uint64_t id) const
+    {
+        // Fibonacci hashing spreads sequential IDs over the buckets.
+        return static_cast<std::size_t>(((id * 0x9e3779b97f4a7c15ull) >> 32) & mask_) * ways;
+    }
+
+    clock::duration ttl_;
+    std::size_t mask_ = 0;
+    std::vector<entry> entries_;
+    std::uint64_t evicted_ = 0;
+};
+
+}
@@ -0,0 +1,329 @@
+#pragma once
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if not defined(__x86_64__)
+#error "fiber.hpp implements context switching for x86-64 only"
+#endif
+
+// Saves the callee-saved registers, MXCSR and x87 control word on the current
+// stack, stores the stack pointer in *from_sp and resumes the context saved at
+// to_sp. Symbols are weak so the header may be included in several units.
+extern "C" void messaging_fiber_switch(void ** from_sp, void * to_sp);
+extern "C" void messaging_fiber_trampoline();
+
+asm(R"(
+    .pushsection .text
+    .weak messaging_fiber_switch
+    .type messaging_fiber_switch, @function
+messaging_fiber_switch:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size messaging_fiber_switch, .-messaging_fiber_switch
+
+    # First activation of a fiber: "returned" into by messaging_fiber_switch
+    # with the entry function in r13 and its argument in r12.
+    .weak messaging_fiber_trampoline
+    .type messaging_fiber_trampoline, @function
+messaging_fiber_trampoline:
+    movq %r12, %rdi
+    callq *%r13
+    ud2
+    .size messaging_fiber_trampoline, .-messaging_fiber_trampoline
+    .popsection
+)");
+
+namespace messaging {
+
+// mmap'd fiber stack with an inaccessible guard page below it, so an overflow
+// faults instead of corrupting a neighbouring stack. Each stack takes two
+// kernel mappings, so beyond about 30,000 fibers vm.max_map_count (65530 by
+// default) must be raised.
+class fiber_stack
+{
+public:
+    explicit fiber_stack(std::size_t size)
+    {
+        std::size_t const page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        size_ = (size + page - 1) / page * page + page;
+        base_ = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (base_ == MAP_FAILED)
+        {
+            throw std::system_error{errno, std::generic_category(), "mmap fiber stack"};
+        }
+        if (::mprotect(base_, page, PROT_NONE) != 0)
+        {
+            int const err = errno;
+            ::munmap(base_, size_);
+            throw std::system_error{err, std::generic_category(), "mprotect guard page"};
+        }
+    }
+
+    ~fiber_stack()
+    {
+        ::munmap(base_, size_);
+    }
+
+    fiber_stack(fiber_stack const &) = delete;
+    fiber_stack & operator=(fiber_stack const &) = delete;
+
+    // Highest address; stacks grow down from here.
+    void * top() const
+    {
+        return static_cast<char *>(base_) + size_;
+    }
+
+private:
+    void * base_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+
+class fiber_scheduler;
+
+// A user-space thread. Blocking in queue::wait_and_pop parks the fiber and
+// frees its worker thread to run others.
+class fiber
+    : public parker
+{
+public:
+    fiber(fiber_scheduler & scheduler, std::function<void()> f, std::size_t stack_size)
+        : scheduler_{scheduler}
+        , f_{std::move(f)}
+        , stack_{stack_size}
+    {
+        // Initial frame consumed by messaging_fiber_switch: control words,
+        // r15, r14, r13, r12, rbx, rbp and the return address. The stack is
+        // 16-byte aligned again once the trampoline has been "returned" into.
+        auto top = reinterpret_cast<std::uintptr_t>(stack_.top()) & ~std::uintptr_t{15};
+        auto frame = reinterpret_cast<std::uint64_t *>(top - 80);
+        frame[0] = (std::uint64_t{0x037f} << 32) | 0x1f80;
+        frame[1] = 0;
+        frame[2] = 0;
+        frame[3] = reinterpret_cast<std::uint64_t>(&fiber::entry);
+        frame[4] = reinterpret_cast<std::uint64_t>(this);
+        frame[5] = 0;
+        frame[6] = 0;
+        frame[7] = reinterpret_cast<std::uint64_t>(&messaging_fiber_trampoline);
+        sp_ = frame;
+    }
+
+    fiber(fiber const &) = delete;
+    fiber & operator=(fiber const &) = delete;
+
+    void park(std::unique_lock<futex_mutex> & lock) override
+    {
+        // The worker releases the lock after switching away, so an unpark()
+        // can never resume this fiber while it is still running.
+        unlock_after_switch_ = &lock;
+        suspend();
+    }
+
+    void unpark() override;
+
+private:
+    friend class fiber_scheduler;
+
+    static void entry(fiber * self) noexcept
+    {
+        try
+        {
+            self->f_();
+        }
+        catch (...)
+        {
+            std::terminate();
+        }
+        self->done_ = true;
+        self->suspend();
+    }
+
+    void suspend()
+    {
+        messaging_fiber_switch(&sp_, *worker_sp_);
+    }
+
+    // Runs the fiber on the calling worker until it parks or finishes.
+    void resume(void ** worker_sp)
+    {
+        worker_sp_ = worker_sp;
+        messaging_fiber_switch(worker_sp, sp_);
+    }
+
+    fiber_scheduler & scheduler_;
+    std::function<void()> f_;
+    fiber_stack stack_;
+    void * sp_ = nullptr;
+    void ** worker_sp_ = nullptr;
+    std::unique_lock<futex_mutex> * unlock_after_switch_ = nullptr;
+    bool done_ = false;
+};
+
+
+// Runs fibers on a fixed set of worker threads.
+//
+// Existing actor code runs unchanged, e.g.
+//   fiber_scheduler fibers{2};
+//   fibers.spawn([&]() { machine.run(); });
+// Each fiber costs one small stack rather than an OS thread.
+class fiber_scheduler
+{
+public:
+    static std::size_t constexpr default_stack_size = 64 * 1024;
+
+    // `on_start`, if given, runs first on each worker thread with its index,
+    // e.g. to pin the thread to a CPU.
+    explicit fiber_scheduler(
+          unsigned workers = std::thread::hardware_concurrency()
+        , std::function<void(unsigned)> on_start = nullptr)
+        : on_start_{std::move(on_start)}
+    {
+        for (unsigned i = 0; i < std::max(workers, 1u); ++i)
+        {
+            workers_.emplace_back(&fiber_scheduler::work, this, i);
+        }
+    }
+
+    // Waits for all fibers to finish.
+    ~fiber_scheduler()
+    {
+        join();
+    }
+
+    fiber_scheduler(fiber_scheduler const &) = delete;
+    fiber_scheduler & operator=(fiber_scheduler const &) = delete;
+
+    void spawn(std::function<void()> f, std::size_t stack_size = default_stack_size)
+    {
+        auto fb = new fiber{*this, std::move(f), stack_size};
+        std::lock_guard<std::mutex> lock{m_};
+        ++live_;
+        ready_.push_back(fb);
+        c_.notify_one();
+    }
+
+    // Waits for all fibers to finish, then stops the workers.
+    void join()
+    {
+        {
+            std::unique_lock<std::mutex> lock{m_};
+            finished_.wait(lock, [this]() { return live_ == 0; });
+            stopping_ = true;
+            c_.notify_all();
+        }
+        for (auto & w : workers_)
+        {
+            if (w.joinable())
+            {
+                w.join();
+            }
+        }
+    }
+
+private:
+    friend class fiber;
+
+    void make_ready(fiber * fb)
+    {
+        std::lock_guard<std::mutex> lock{m_};
+        ready_.push_back(fb);
+        c_.notify_one();
+    }
+
+    void work(unsigned index)
+    {
+        if (on_start_)
+        {
+            on_start_(index);
+        }
+        void * worker_sp = nullptr;
+        while (true)
+        {
+            fiber * fb = nullptr;
+            {
+                std::unique_lock<std::mutex> lock{m_};
+                c_.wait(lock, [this]() { return stopping_ or not ready_.empty(); });
+                if (ready_.empty())
+                {
+                    return;
+                }
+                fb = ready_.front();
+                ready_.pop_front();
+            }
+
+            parker::current() = fb;
+            fb->resume(&worker_sp);
+            parker::current() = nullptr;
+
+            if (fb->unlock_after_switch_)
+            {
+                // Parked: from here on another thread may resume it.
+                auto lock = fb->unlock_after_switch_;
+                fb->unlock_after_switch_ = nullptr;
+                lock->unlock();
+            }
+            else if (fb->done_)
+            {
+                delete fb;
+                std::lock_guard<std::mutex> lock{m_};
+                if (--live_ == 0)
+                {
+                    finished_.notify_all();
+                }
+            }
+        }
+    }
+
+    std::function<void(unsigned)> on_start_;
+    std::mutex m_;
+    std::condition_variable c_;
+    std::condition_variable finished_;
+    std::deque<fiber *> ready_;
+    std::size_t live_ = 0;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+
+inline void fiber::unpark()
+{
+    scheduler_.make_ready(this);
+}
+
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "inplace_function.hpp"
+#include "queue.hpp"
+
+#include <memory>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+namespace messaging {
+
+// Persistent counterpart of the dispatcher chain returned by receiver::wait().
+//
+// A chain is rebuilt on every wait() call and holds its lambdas by their own
+// types. A handler_table is built once and reused, e.g. one table per state,
+// so its handlers are type-erased into inplace_function, which keeps captures
+// inline instead of on the heap. `Handler` is the type-erased callable;
+// std::function<void(message_base &)> works too, which --bench-dispatch
+// uses for comparison.
+//
+//   handler_table table;
+//   table.handle<digit_pressed>([&](digit_pressed const & msg) { ... })
+//        .handle<cancel_pressed>([&](cancel_pressed const &) { ... });
+//   table.wait_and_dispatch(incoming.get_queue());
+template <typename Handler>
+class basic_handler_table
+{
+public:
+    using handler = Handler;
+
+    basic_handler_table() = default;
+
+    basic_handler_table(basic_handler_table &&) = default;
+    basic_handler_table & operator=(basic_handler_table &&) = default;
+
+    basic_handler_table(basic_handler_table const &) = delete;
+    basic_handler_table & operator=(basic_handler_table const &) = delete;
+
+    // Adds a handler for Msg_T. A later handler for the same type is ignored.
+    template <typename Msg_T, typename Func>
+    basic_handler_table & handle(Func && f)
+    {
+        entries_.push_back(entry{
+              &typeid(wrapped_message<Msg_T>)
+            , &typeid(Msg_T)
+            , handler{
+                [f = std::forward<Func>(f)](message_base & msg) mutable
+                {
+                    f(static_cast<wrapped_message<Msg_T> &>(msg).contents);
+                }}
+            });
+        return *this;
+    }
+
+    // Calls the matching handler. Throws close_queue for a close_queue
+    // message, like the dispatcher chain; other unmatched messages are
+    // dropped and false is returned.
+    bool dispatch(queue & q, std::shared_ptr<message_base> const & msg) const
+    {
+        std::type_info const & type = typeid(*msg);
+        for (auto const & e : entries_)
+        {
+            if (*e.wrapped_type == type)
+            {
+                active_handler_guard active{&q, *e.msg_type};
+                e.f(*msg);
+                return true;
+            }
+        }
+        if (type == typeid(wrapped_message<close_queue>))
+        {
+            throw close_queue{};
+        }
+        return false;
+    }
+
+    // Same contract as the destructor of a dispatcher chain: waits until a
+    // message is handled, or handles at most one for scheduled queues.
+    void wait_and_dispatch(queue & q) const
+    {
+        if (q.scheduled())
+        {
+            if (auto msg = q.try_pop())
+            {
+                dispatch(q, msg);
+            }
+            return;
+        }
+
+        while (not dispatch(q, q.wait_and_pop()))
+        {
+        }
+    }
+
+private:
+    struct entry
+    {
+        std::type_info const * wrapped_type;
+        std::type_info const * msg_type;
+        handler f;
+    };
+
+    std::vector<entry> entries_;
+};
+
+using handler_table = basic_handler_table<inplace_function<void(message_base &)> >;
+
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+namespace messaging {
+
+// One committed transaction as returned by account_history::read.
+struct history_entry
+{
+    // Milliseconds since the Unix epoch.
+    std::int64_t time_ms;
+    // Negative for debits.
+    std::int32_t amount;
+    // Terminal the transaction was made at; unknown_terminal if not known.
+    std::uint32_t terminal;
+};
+
+// Append-only transaction history of one account, stored by column.
+//
+// Each column is a contiguous array, so reading the last N entries is a range
+// scan over three arrays. Timestamps are 32-bit millisecond offsets from the
+// base time of their block, a new block starting every block_size entries or
+// when an offset would overflow. Terminals are 16-bit indexes into a
+// per-account dictionary of terminal IDs. An entry takes 10 bytes instead of
+// the 16 of a history_entry. The columns are allocated on the first append,
+// so an account with no history costs one pointer.
+class account_history
+{
+public:
+    static std::size_t constexpr block_size = 256;
+    static std::uint32_t constexpr unknown_terminal = std::numeric_limits<std::uint32_t>::max();
+
+    account_history() = default;
+
+    account_history(account_history const & other)
+        : c_{other.c_ ? new columns(*other.c_) : nullptr}
+    {
+    }
+
+    account_history(account_history &&) = default;
+
+    account_history & operator=(account_history other)
+    {
+        c_ = std::move(other.c_);
+        return *this;
+    }
+
+    void append(std::int64_t time_ms, std::int32_t amount, std::uint32_t terminal)
+    {
+        if (not c_)
+        {
+            c_.reset(new columns);
+        }
+        columns & c = *c_;
+        // Keeps offsets non-negative if the clock steps back.
+        time_ms = std::max(time_ms, c.last_time_ms);
+        std::size_t const n = c.amounts.size();
+        if (c.blocks.empty()
+            or n - c.blocks.back().first == block_size
+            or time_ms - c.blocks.back().base_ms > std::numeric_limits<std::uint32_t>::max())
+        {
+            c.blocks.push_back(block{n, time_ms});
+        }
+        c.offsets.push_back(static_cast<std::uint32_t>(time_ms - c.blocks.back().base_ms));
+        c.amounts.push_back(amount);
+        c.terminals.push_back(terminal_index(terminal));
+        c.last_time_ms = time_ms;
+    }
+
+    std::size_t size() const
+    {
+        return c_ ? c_->amounts.size() : 0;
+    }
+
+    // Copies entries [first, last) into out, oldest first.
+    void read(std::size_t first, std::size_t last, history_entry * out) const
+    {
+        scan(first, last, [&out](history_entry const & e) { *out++ = e; });
+    }
+
+    // Calls f(history_entry const &) for entries [first, last), oldest first.
+    template <typename Func>
+    void scan(std::size_t first, std::size_t last, Func && f) const
+    {
+        if (first >= last)
+        {
+            return;
+        }
+        columns const & c = *c_;
+        // Last block starting at or before `first`.
+        auto b = std::upper_bound(
+              c.blocks.begin(), c.blocks.end(), first
+            , [](std::size_t i, block const & blk) { return i < blk.first; }) - 1;
+        for (std::size_t i = first; i < last; ++i)
+        {
+            if (b + 1 != c.blocks.end() and (b + 1)->first == i)
+            {
+                ++b;
+            }
+            f(history_entry{b->base_ms + c.offsets[i], c.amounts[i], c.terminal_ids[c.terminals[i]]});
+        }
+    }
+
+private:
+    struct block
+    {
+        std::size_t first;
+        std::int64_t base_ms;
+    };
+
+    struct columns
+    {
+        std::vector<block> blocks;
+        std::vector<std::uint32_t> offsets;
+        std::vector<std::int32_t> amounts;
+        std::vector<std::uint16_t> terminals;
+        std::vector<std::uint32_t> terminal_ids;
+        std::int64_t last_time_ms = std::numeric_limits<std::int64_t>::min();
+    };
+
+    std::uint16_t terminal_index(std::uint32_t terminal)
+    {
+        auto & ids = c_->terminal_ids;
+        // Recent terminals are the likeliest, so search from the back.
+        for (std::size_t i = ids.size(); i-- != 0;)
+        {
+            if (ids[i] == terminal)
+            {
+                return static_cast<std::uint16_t>(i);
+            }
+        }
+        std::size_t constexpr max_terminals = std::size_t{std::numeric_limits<std::uint16_t>::max()} + 1;
+        if (ids.size() + 1 >= max_terminals and terminal != unknown_terminal)
+        {
+            // Full but for the last slot, which is kept for unknown_terminal.
+            return terminal_index(unknown_terminal);
+        }
+        ids.push_back(terminal);
+        return static_cast<std::uint16_t>(ids.size() - 1);
+    }
+
+    std::unique_ptr<columns> c_;
+};
+
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace messaging {
+
+template <typename Signature, std::size_t Capacity = 48>
+class inplace_function;
+
+// Move-only type-erased callable that stores its target inline.
+//
+// Unlike std::function it never allocates: a target larger than Capacity
+// bytes is a compile error. It cannot be copied, so move-only captures work
+// and no copy machinery is generated. With the default capacity the whole
+// object is one 64-byte cache line, and a call is a null check and one
+// indirect call.
+template <typename R, typename... Args, std::size_t Capacity>
+class inplace_function<R(Args...), Capacity>
+{
+public:
+    inplace_function() = default;
+
+    inplace_function(std::nullptr_t)
+    {
+    }
+
+    template <
+          typename F
+        , typename T = typename std::decay<F>::type
+        , typename = typename std::enable_if<not std::is_same<T, inplace_function>::value>::type
+        >
+    inplace_function(F && f)
+    {
+        static_assert(sizeof(T) <= Capacity, "callable too large for inplace_function; increase Capacity");
+        static_assert(alignof(T) <= alignof(storage_type), "callable over-aligned for inplace_function");
+        static_assert(std::is_nothrow_move_constructible<T>::value, "callable must be nothrow move constructible");
+
+        ::new (static_cast<void *>(&storage_)) T(std::forward<F>(f));
+        invoke_ = &invoke<T>;
+        manage_ = &manage<T>;
+    }
+
+    inplace_function(inplace_function && other) noexcept
+    {
+        take(other);
+    }
+
+    inplace_function & operator=(inplace_function && other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    inplace_function & operator=(std::nullptr_t) noexcept
+    {
+        reset();
+        return *this;
+    }
+
+    inplace_function(inplace_function const &) = delete;
+    inplace_function & operator=(inplace_function const &) = delete;
+
+    ~inplace_function()
+    {
+        reset();
+    }
+
+    // Throws std::bad_function_call if empty, as std::function does.
+    R operator()(Args... args) const
+    {
+        if (not invoke_)
+        {
+            throw std::bad_function_call{};
+        }
+        return invoke_(&storage_, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return invoke_ != nullptr;
+    }
+
+private:
+    using storage_type = typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type;
+
+    // Moves the target from src to dst if dst is given, then destroys src.
+    using manage_fn = void (*)(void * dst, void * src);
+    using invoke_fn = R (*)(void *, Args &&...);
+
+    template <typename T>
+    static R invoke(void * target, Args &&... args)
+    {
+        return (*static_cast<T *>(target))(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    static void manage(void * dst, void * src)
+    {
+        if (dst)
+        {
+            ::new (dst) T(std::move(*static_cast<T *>(src)));
+        }
+        static_cast<T *>(src)->~T();
+    }
+
+    void take(inplace_function & other) noexcept
+    {
+        if (other.manage_)
+        {
+            other.manage_(&storage_, &other.storage_);
+            invoke_ = other.invoke_;
+            manage_ = other.manage_;
+            other.invoke_ = nullptr;
+            other.manage_ = nullptr;
+        }
+    }
+
+    void reset() noexcept
+    {
+        if (manage_)
+        {
+            manage_(nullptr, &storage_);
+            invoke_ = nullptr;
+            manage_ = nullptr;
+        }
+    }
+
+    // Targets are invoked through a const call operator, like std::function.
+    mutable storage_type storage_;
+    invoke_fn invoke_ = nullptr;
+    manage_fn manage_ = nullptr;
+};
+
+}
@@ -0,0 +1,343 @@
+#pragma once
+
+#include "queue.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace messaging {
+
+// Feeds keystrokes from many terminals into their atm actors from one thread.
+//
+// Each terminal is a file descriptor (stdin, a named FIFO or a pseudo-terminal
+// master) bound to one atm. Readable terminals are found with epoll and read
+// in chunks of up to chunk_size bytes; the keys of one chunk are translated
+// into atm messages and sent with a single sender::send_batch.
+//
+//   input_multiplexer input;
+//   input.add(STDIN_FILENO, machine.get_sender());
+//   input.add_fifo("/tmp/atm2", other_machine.get_sender());
+//   input.run();
+//
+// Keys are those of the original console: 0-9, i (insert card), b (balance),
+// w (withdraw 50), s (mini-statement), c (cancel) and q, which makes run()
+// return.
+class input_multiplexer
+{
+public:
+    static std::size_t constexpr chunk_size = 4096;
+
+    input_multiplexer()
+        : epoll_fd_{::epoll_create1(EPOLL_CLOEXEC)}
+    {
+        if (epoll_fd_ < 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "epoll_create1"};
+        }
+        wake_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wake_fd_ < 0)
+        {
+            int const err = errno;
+            ::close(epoll_fd_);
+            throw std::system_error{err, std::generic_category(), "eventfd"};
+        }
+        if (int const err = watch(wake_fd_, wake_id))
+        {
+            ::close(wake_fd_);
+            ::close(epoll_fd_);
+            throw std::system_error{err, std::generic_category(), "epoll_ctl add eventfd"};
+        }
+    }
+
+    ~input_multiplexer()
+    {
+        for (auto & t : terminals_)
+        {
+            if (t.owned and t.fd >= 0)
+            {
+                ::close(t.fd);
+            }
+            if (t.peer >= 0)
+            {
+                ::close(t.peer);
+            }
+        }
+        ::close(wake_fd_);
+        ::close(epoll_fd_);
+    }
+
+    input_multiplexer(input_multiplexer const &) = delete;
+    input_multiplexer & operator=(input_multiplexer const &) = delete;
+
+    // Binds an open descriptor to an atm; it is closed on destruction only if
+    // `owned`. Regular files cannot be polled and are read to the end when
+    // run() starts.
+    void add(int fd, sender atm, std::string account = "acc1234", bool owned = false)
+    {
+        std::size_t const id = terminals_.size();
+        terminals_.push_back(terminal{fd, -1, owned, false, atm, std::move(account), {}});
+        if (int const err = watch(fd, id))
+        {
+            if (err != EPERM)
+            {
+                terminals_.pop_back();
+                throw std::system_error{err, std::generic_category(), "epoll_ctl add terminal"};
+            }
+            terminals_.back().file = true;
+            return;
+        }
+        ++open_;
+    }
+
+    // Creates the FIFO if needed and binds it to an atm. It is opened for
+    // writing too, so the terminal stays open while writers come and go.
+    void add_fifo(std::string const & path, sender atm, std::string account = "acc1234")
+    {
+        if (::mkfifo(path.c_str(), 0600) != 0 and errno != EEXIST)
+        {
+            throw std::system_error{errno, std::generic_category(), "mkfifo " + path};
+        }
+        int const fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "open " + path};
+        }
+        add(fd, atm, std::move(account), true);
+    }
+
+    // Opens a pseudo-terminal bound to an atm and returns the path of its
+    // slave side, for a user or a load generator to attach to.
+    std::string add_pty(sender atm, std::string account = "acc1234")
+    {
+        int const fd = ::posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "posix_openpt"};
+        }
+        char const * name = nullptr;
+        if (::grantpt(fd) != 0 or ::unlockpt(fd) != 0 or (name = ::ptsname(fd)) == nullptr)
+        {
+            int const err = errno;
+            ::close(fd);
+            throw std::system_error{err, std::generic_category(), "pseudo-terminal setup"};
+        }
+        std::string path{name};
+        // Holding the slave open keeps the master from reporting hang-up
+        // before, or between, clients attaching.
+        int const peer = ::open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (peer < 0)
+        {
+            int const err = errno;
+            ::close(fd);
+            throw std::system_error{err, std::generic_category(), "open " + path};
+        }
+        try
+        {
+            add(fd, atm, std::move(account), true);
+        }
+        catch (...)
+        {
+            ::close(peer);
+            throw;
+        }
+        terminals_.back().peer = peer;
+        return path;
+    }
+
+    // Reads terminals until one sends q, stop() is called or every terminal
+    // has reached end of file.
+    void run()
+    {
+        for (std::size_t id = 0; id < terminals_.size(); ++id)
+        {
+            if (terminals_[id].file)
+            {
+                while (terminals_[id].fd >= 0)
+                {
+                    if (not read_terminal(id))
+                    {
+                        return;
+                    }
+                }
+            }
+        }
+
+        epoll_event events[64];
+        while (open_ != 0)
+        {
+            int const n = ::epoll_wait(epoll_fd_, events, 64, -1);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::system_error{errno, std::generic_category(), "epoll_wait"};
+            }
+            for (int i = 0; i < n; ++i)
+            {
+                if (events[i].data.u64 == wake_id)
+                {
+                    return;
+                }
+                if (not read_terminal(static_cast<std::size_t>(events[i].data.u64)))
+                {
+                    return;
+                }
+            }
+        }
+    }
+
+    // Makes run() return; callable from any thread.
+    void stop()
+    {
+        std::uint64_t const one = 1;
+        ssize_t const written = ::write(wake_fd_, &one, sizeof(one));
+        (void)written;
+    }
+
+private:
+    static std::uint64_t constexpr wake_id = ~std::uint64_t{0};
+
+    struct terminal
+    {
+        int fd;
+        // Descriptor held open on the terminal's behalf, or -1.
+        int peer;
+        bool owned;
+        // Regular file: read to the end up front instead of polled.
+        bool file;
+        sender atm;
+        std::string account;
+        message_batch batch;
+    };
+
+    // Returns 0 or an errno value.
+    int watch(int fd, std::uint64_t id)
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = id;
+        return ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == 0 ? 0 : errno;
+    }
+
+    // One read per readiness event, so a descriptor shared with the parent,
+    // like stdin, never has to be switched to non-blocking mode. Returns
+    // false once q has been read.
+    bool read_terminal(std::size_t id)
+    {
+        auto & t = terminals_[id];
+        char buf[chunk_size];
+        ssize_t const n = ::read(t.fd, buf, sizeof(buf));
+        if (n < 0)
+        {
+            if (errno == EINTR or errno == EAGAIN)
+            {
+                return true;
+            }
+            // Any other error, e.g. EIO from a pseudo-terminal, ends the terminal.
+            close_terminal(t);
+            return true;
+        }
+        if (n == 0)
+        {
+            close_terminal(t);
+            return true;
+        }
+
+        bool quit = false;
+        for (ssize_t i = 0; i < n and not quit; ++i)
+        {
+            quit = not translate(buf[i], t);
+        }
+        t.atm.send_batch(t.batch);
+        return not quit;
+    }
+
+    // Returns false for q.
+    static bool translate(char c, terminal & t)
+    {
+        switch (c)
+        {
+            case '0':
+            case '1':
+            case '2':
+            case '3':
+            case '4':
+            case '5':
+            case '6':
+            case '7':
+            case '8':
+            case '9':
+                t.batch.add(digit_pressed{c});
+                break;
+
+            case 'b':
+            case 'B':
+                t.batch.add(balance_pressed{});
+                break;
+
+            case 'w':
+            case 'W':
+                t.batch.add(withdraw_pressed{50});
+                break;
+
+            case 'c':
+            case 'C':
+                t.batch.add(cancel_pressed{});
+                break;
+
+            case 's':
+            case 'S':
+                t.batch.add(statement_pressed{});
+                break;
+
+            case 'q':
+            case 'Q':
+                return false;
+
+            case 'i':
+            case 'I':
+                t.batch.add(card_inserted{t.account});
+                break;
+        }
+        return true;
+    }
+
+    void close_terminal(terminal & t)
+    {
+        if (t.file)
+        {
+            t.file = false;
+        }
+        else
+        {
+            ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, t.fd, nullptr);
+            --open_;
+        }
+        if (t.owned)
+        {
+            ::close(t.fd);
+        }
+        t.fd = -1;
+    }
+
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    std::vector<terminal> terminals_;
+    // Polled terminals not yet at end of file.
+    std::size_t open_ = 0;
+};
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "queue.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace messaging {
+
+// One line per registered actor:
+// <name> state=<state> depth=<n> oldest_ms=<age> handler=<type|-> processed=<n>
+inline std::string introspection_report()
+{
+    auto const now = queue::clock::now();
+    std::ostringstream out;
+    probe_registry::instance().for_each(
+        [&](actor_probe const & probe)
+        {
+            auto const depth = probe.q->size();
+            auto const oldest = probe.q->oldest();
+            auto const handler = probe.q->active_handler();
+
+            long long age_ms = 0;
+            if (depth != 0 and oldest.time_since_epoch().count() != 0)
+            {
+                age_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - oldest).count();
+            }
+
+            out << probe.name
+                << " state=" << probe.state.load(std::memory_order_relaxed)
+                << " depth=" << depth
+                << " oldest_ms=" << age_ms
+                << " handler=" << (handler ? type_name(*handler) : "-")
+                << " processed=" << probe.q->dequeued()
+                << '\n';
+        });
+    return out.str();
+}
+
+
+// Serves introspection_report() on a Unix domain socket.
+// Each connection receives one report and is then closed, e.g.:
+//   socat - UNIX-CONNECT:/tmp/atm.sock
+class introspection_server
+{
+public:
+    explicit introspection_server(std::string path)
+        : path_{std::move(path)}
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path_.size() >= sizeof(addr.sun_path))
+        {
+            throw std::system_error{ENAMETOOLONG, std::generic_category(), "introspection socket path"};
+        }
+        std::strcpy(addr.sun_path, path_.c_str());
+
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "socket"};
+        }
+
+        // Remove a stale socket left behind by a previous run.
+        ::unlink(path_.c_str());
+        if (::bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+            or ::listen(fd_, 8) < 0)
+        {
+            int const err = errno;
+            ::close(fd_);
+            throw std::system_error{err, std::generic_category(), "bind " + path_};
+        }
+
+        thread_ = std::thread{&introspection_server::serve, this};
+    }
+
+    ~introspection_server()
+    {
+        stop_.store(true);
+        thread_.join();
+        ::close(fd_);
+        ::unlink(path_.c_str());
+    }
+
+    introspection_server(introspection_server const &) = delete;
+    introspection_server & operator=(introspection_server const &) = delete;
+
+private:
+    void serve()
+    {
+        while (not stop_.load())
+        {
+            // Wake periodically to notice stop_.
+            pollfd pfd{fd_, POLLIN, 0};
+            if (::poll(&pfd, 1, 200) <= 0)
+            {
+                continue;
+            }
+
+            int const client = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0)
+            {
+                continue;
+            }
+
+            std::string const report = introspection_report();
+            char const * data = report.data();
+            std::size_t remaining = report.size();
+            while (remaining != 0)
+            {
+                ssize_t const n = ::send(client, data, remaining, MSG_NOSIGNAL);
+                if (n <= 0)
+                {
+                    break;
+                }
+                data += n;
+                remaining -= static_cast<std::size_t>(n);
+            }
+            ::close(client);
+        }
+    }
+
+    std::string path_;
+    int fd_ = -1;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+}
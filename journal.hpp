@@ -0,0 +1,855 @@
+#pragma once
+
+#include "mpsc_ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace messaging {
+
+// Human-readable name of a message type, e.g. "messaging::digit_pressed".
+inline std::string type_name(std::type_info const & type)
+{
+    int status = 0;
+    char * demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+    std::string name = (status == 0 and demangled) ? demangled : type.name();
+    std::free(demangled);
+    return name;
+}
+
+
+// Process-wide numbering of journaled message types. Segments store their
+// own dictionary of the names, so the numbers never reach the disk.
+class journal_types
+{
+public:
+    static journal_types & instance()
+    {
+        static journal_types types;
+        return types;
+    }
+
+    std::uint16_t add(std::type_info const & type)
+    {
+        std::lock_guard<std::mutex> lock{m_};
+        types_.push_back(&type);
+        return static_cast<std::uint16_t>(types_.size() - 1);
+    }
+
+    std::string name(std::uint16_t id) const
+    {
+        std::lock_guard<std::mutex> lock{m_};
+        return type_name(*types_[id]);
+    }
+
+private:
+    mutable std::mutex m_;
+    std::vector<std::type_info const *> types_;
+};
+
+template <typename Msg_T>
+std::uint16_t journal_type_id()
+{
+    static std::uint16_t const id = journal_types::instance().add(typeid(Msg_T));
+    return id;
+}
+
+
+// Messages with `account` and `amount` members have them journaled; others
+// are journaled with no account and an amount of 0.
+template <typename Msg_T>
+auto journal_account(Msg_T const & msg, int) -> decltype(std::string{msg.account}, static_cast<std::string const *>(nullptr))
+{
+    return &msg.account;
+}
+
+template <typename Msg_T>
+std::string const * journal_account(Msg_T const &, long)
+{
+    return nullptr;
+}
+
+template <typename Msg_T>
+auto journal_amount(Msg_T const & msg, int) -> decltype(static_cast<std::int64_t>(msg.amount))
+{
+    return static_cast<std::int64_t>(msg.amount);
+}
+
+template <typename Msg_T>
+std::int64_t journal_amount(Msg_T const &, long)
+{
+    return 0;
+}
+
+// Likewise `terminal` and `request_id`, which are journaled only by the
+// messages that have them.
+template <typename Msg_T>
+auto journal_terminal(Msg_T const & msg, std::uint32_t & terminal, int) -> decltype(terminal = msg.terminal, true)
+{
+    terminal = msg.terminal;
+    return true;
+}
+
+template <typename Msg_T>
+bool journal_terminal(Msg_T const &, std::uint32_t &, long)
+{
+    return false;
+}
+
+template <typename Msg_T>
+auto journal_request(Msg_T const & msg, std::uint64_t & request, int) -> decltype(request = msg.request_id, true)
+{
+    request = msg.request_id;
+    return true;
+}
+
+template <typename Msg_T>
+bool journal_request(Msg_T const &, std::uint64_t &, long)
+{
+    return false;
+}
+
+
+// Paths of the existing segments <prefix>.<n>, by segment number.
+inline std::vector<std::string> journal_segments(std::string const & prefix)
+{
+    std::string::size_type const slash = prefix.rfind('/');
+    std::string const dir = slash == std::string::npos ? "." : prefix.substr(0, slash + 1);
+    std::string const base = (slash == std::string::npos ? prefix : prefix.substr(slash + 1)) + ".";
+
+    std::vector<std::pair<unsigned long, std::string> > found;
+    if (DIR * d = ::opendir(dir.c_str()))
+    {
+        while (dirent const * e = ::readdir(d))
+        {
+            std::string const name = e->d_name;
+            if (name.size() > base.size() and name.compare(0, base.size(), base) == 0
+                and name.find_first_not_of("0123456789", base.size()) == std::string::npos)
+            {
+                found.emplace_back(std::stoul(name.substr(base.size())), prefix + name.substr(base.size() - 1));
+            }
+        }
+        ::closedir(d);
+    }
+    std::sort(found.begin(), found.end());
+    std::vector<std::string> paths;
+    for (auto & f : found)
+    {
+        paths.push_back(std::move(f.second));
+    }
+    return paths;
+}
+
+
+// Writes the messages pushed to the queues attached to it (queue::journal_to)
+// as a series of segment files <prefix>.<n>, on a background thread.
+//
+// Recording a message copies a fixed-size entry into a lock-free ring and
+// never blocks: if the writer has fallen so far behind that the ring is
+// full, the record is dropped and counted instead. The writer thread drains
+// the ring in batches and encodes each entry into the current segment:
+//
+//   header   "MQJ1", version, base time (ns since the Unix epoch)
+//   records  varint time delta from the previous record (ns), varint queue,
+//            varint type * 4 + flags, varint terminal if flags & 1,
+//            varint request ID if flags & 2, varint account + 1 (0: none),
+//            zigzag varint amount
+//   footer   queue names, type names, accounts, then an index entry for
+//            every index_interval-th record (offset, record number, time of
+//            the record before it), then the number of records dropped
+//            while the segment was current
+//   trailer  footer offset, record count, "MQJE"
+//
+// Type and account numbers are indexes into the segment's own footer
+// dictionaries, so a segment can be read on its own. Numbering continues
+// after the prefix's existing segments, which are never overwritten.
+//
+// A customer session's mix of messages takes about 7.5 bytes a record.
+// Accounts are stored whole; ones too long for the entry are copied to the
+// heap. A segment is only readable once its footer is written, i.e. after
+// it has rolled over or the writer has been closed.
+class journal_writer
+{
+public:
+    static std::size_t constexpr ring_capacity = 1 << 14;
+    static std::size_t constexpr index_interval = 1024;
+
+    explicit journal_writer(std::string prefix, std::size_t segment_bytes = std::size_t{64} << 20)
+        : prefix_{std::move(prefix)}
+        , segment_bytes_{segment_bytes}
+    {
+        auto const existing = journal_segments(prefix_);
+        if (not existing.empty())
+        {
+            segment_ = static_cast<unsigned>(std::stoul(existing.back().substr(prefix_.size() + 1))) + 1;
+        }
+        first_segment_ = segment_;
+        open_segment();
+        thread_ = std::thread{&journal_writer::work, this};
+    }
+
+    ~journal_writer()
+    {
+        try
+        {
+            close();
+        }
+        catch (std::exception const &)
+        {
+        }
+    }
+
+    journal_writer(journal_writer const &) = delete;
+    journal_writer & operator=(journal_writer const &) = delete;
+
+    // Names the next queue and returns its number. Call before recording.
+    std::uint32_t add_queue(std::string name)
+    {
+        queues_.push_back(std::move(name));
+        return static_cast<std::uint32_t>(queues_.size() - 1);
+    }
+
+    // Any thread. Returns false if the record was dropped because the ring
+    // was full.
+    template <typename Msg_T>
+    bool record(std::uint32_t queue, Msg_T const & msg)
+    {
+        journal_entry e;
+        e.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        e.amount = journal_amount(msg, 0);
+        e.queue = queue;
+        e.type = journal_type_id<Msg_T>();
+        e.flags = 0;
+        if (journal_terminal(msg, e.terminal, 0))
+        {
+            e.flags |= journal_entry::has_terminal;
+        }
+        if (journal_request(msg, e.request, 0))
+        {
+            e.flags |= journal_entry::has_request;
+        }
+        e.account_size = journal_entry::no_account;
+        e.spilled = nullptr;
+        if (std::string const * account = journal_account(msg, 0))
+        {
+            e.account_size = static_cast<std::uint32_t>(account->size());
+            char * to = e.account;
+            if (account->size() > journal_entry::account_capacity)
+            {
+                to = e.spilled = new char[account->size()];
+            }
+            std::memcpy(to, account->data(), account->size());
+        }
+        if (not ring_.try_push(e))
+        {
+            delete[] e.spilled;
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    // Writes out everything recorded and the last segment's footer. Call once
+    // nothing records any more. Rethrows a write error from the writer thread.
+    void close()
+    {
+        if (thread_.joinable())
+        {
+            closing_.store(true, std::memory_order_release);
+            thread_.join();
+        }
+        if (error_)
+        {
+            auto error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Valid after close().
+    std::uint64_t records() const
+    {
+        return records_;
+    }
+
+    // Segments written by this writer.
+    unsigned segments() const
+    {
+        return segment_ - first_segment_;
+    }
+
+    // Records dropped because the ring was full. Any thread.
+    std::uint64_t dropped() const
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    // One cache line.
+    struct journal_entry
+    {
+        static std::size_t constexpr account_capacity = 17;
+        static std::uint32_t constexpr no_account = std::numeric_limits<std::uint32_t>::max();
+        static std::uint8_t constexpr has_terminal = 1;
+        static std::uint8_t constexpr has_request = 2;
+
+        std::int64_t time_ns;
+        std::int64_t amount;
+        std::uint64_t request;
+        // Owned copy of an account longer than account_capacity, freed by
+        // the writer thread; otherwise the account is in `account`.
+        char * spilled;
+        std::uint32_t queue;
+        std::uint32_t terminal;
+        std::uint32_t account_size;
+        std::uint16_t type;
+        std::uint8_t flags;
+        char account[account_capacity];
+    };
+
+    struct index_entry
+    {
+        std::uint64_t offset;
+        std::uint64_t record;
+        std::int64_t previous_ns;
+    };
+
+    static std::size_t constexpr batch_size = 256;
+    static std::size_t constexpr write_chunk = std::size_t{1} << 20;
+
+    void work()
+    {
+        journal_entry batch[batch_size];
+        while (true)
+        {
+            // Read before popping, so that an empty ring after a close
+            // really is the end.
+            bool const closing = closing_.load(std::memory_order_acquire);
+            std::size_t const n = ring_.try_pop(batch, batch_size);
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                encode(batch[i]);
+                delete[] batch[i].spilled;
+            }
+            if (n == 0)
+            {
+                if (closing)
+                {
+                    break;
+                }
+                flush();
+                std::this_thread::sleep_for(std::chrono::milliseconds{1});
+            }
+        }
+        finish_segment();
+    }
+
+    void encode(journal_entry const & e)
+    {
+        if (error_)
+        {
+            // Keep draining so that producers never block on a dead writer.
+            return;
+        }
+        try
+        {
+            if (segment_records_ % index_interval == 0)
+            {
+                index_.push_back(index_entry{segment_offset_ + out_.size(), segment_records_, last_ns_});
+            }
+            // Keeps deltas non-negative if the clock steps back.
+            std::int64_t const time_ns = std::max(e.time_ns, last_ns_);
+            put_varint(static_cast<std::uint64_t>(time_ns - last_ns_));
+            put_varint(e.queue);
+            put_varint(std::uint64_t{local_type(e.type)} << 2 | e.flags);
+            if (e.flags & journal_entry::has_terminal)
+            {
+                put_varint(e.terminal);
+            }
+            if (e.flags & journal_entry::has_request)
+            {
+                put_varint(e.request);
+            }
+            put_varint(e.account_size == journal_entry::no_account ? 0 : local_account(e) + 1);
+            put_varint(zigzag(e.amount));
+            last_ns_ = time_ns;
+            ++segment_records_;
+            ++records_;
+
+            if (out_.size() >= write_chunk)
+            {
+                flush();
+            }
+            if (segment_offset_ + out_.size() >= segment_bytes_)
+            {
+                finish_segment();
+                open_segment();
+            }
+        }
+        catch (std::exception const &)
+        {
+            error_ = std::current_exception();
+        }
+    }
+
+    std::uint32_t local_type(std::uint16_t type)
+    {
+        if (type >= local_types_.size())
+        {
+            local_types_.resize(type + 1, -1);
+        }
+        if (local_types_[type] < 0)
+        {
+            local_types_[type] = static_cast<std::int32_t>(type_names_.size());
+            type_names_.push_back(journal_types::instance().name(type));
+        }
+        return static_cast<std::uint32_t>(local_types_[type]);
+    }
+
+    std::uint32_t local_account(journal_entry const & e)
+    {
+        auto const inserted = accounts_.emplace(
+              std::string{e.spilled ? e.spilled : e.account, e.account_size}
+            , static_cast<std::uint32_t>(account_names_.size()));
+        if (inserted.second)
+        {
+            account_names_.push_back(inserted.first->first);
+        }
+        return inserted.first->second;
+    }
+
+    void open_segment()
+    {
+        std::string const path = prefix_ + "." + std::to_string(segment_++);
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd_ < 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "open " + path};
+        }
+        segment_offset_ = 0;
+        segment_records_ = 0;
+        index_.clear();
+        local_types_.clear();
+        type_names_.clear();
+        accounts_.clear();
+        account_names_.clear();
+        dropped_at_open_ = dropped_.load(std::memory_order_relaxed);
+        last_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+
+        out_.append("MQJ1", 4);
+        put_fixed(2, 4);
+        put_fixed(static_cast<std::uint64_t>(last_ns_), 8);
+    }
+
+    void finish_segment()
+    {
+        if (fd_ < 0)
+        {
+            return;
+        }
+        try
+        {
+            std::uint64_t const footer = segment_offset_ + out_.size();
+            put_strings(queues_);
+            put_strings(type_names_);
+            put_strings(account_names_);
+            put_varint(index_.size());
+            for (auto const & i : index_)
+            {
+                put_varint(i.offset);
+                put_varint(i.record);
+                put_varint(zigzag(i.previous_ns));
+            }
+            put_varint(dropped_.load(std::memory_order_relaxed) - dropped_at_open_);
+            put_fixed(footer, 8);
+            put_fixed(segment_records_, 8);
+            out_.append("MQJE", 4);
+            flush();
+        }
+        catch (std::exception const &)
+        {
+            if (not error_)
+            {
+                error_ = std::current_exception();
+            }
+        }
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    // Records a write error rather than throwing, since it runs on the
+    // writer thread; close() rethrows it.
+    void flush()
+    {
+        char const * p = out_.data();
+        std::size_t left = out_.size();
+        while (left != 0 and not error_)
+        {
+            ssize_t const n = ::write(fd_, p, left);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                error_ = std::make_exception_ptr(std::system_error{errno, std::generic_category(), "write journal"});
+                break;
+            }
+            p += n;
+            left -= static_cast<std::size_t>(n);
+        }
+        segment_offset_ += out_.size();
+        out_.clear();
+    }
+
+    static std::uint64_t zigzag(std::int64_t v)
+    {
+        return (static_cast<std::uint64_t>(v) << 1) ^ static_cast<std::uint64_t>(v >> 63);
+    }
+
+    void put_varint(std::uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            out_ += static_cast<char>(v | 0x80);
+            v >>= 7;
+        }
+        out_ += static_cast<char>(v);
+    }
+
+    // Little-endian.
+    void put_fixed(std::uint64_t v, unsigned bytes)
+    {
+        for (unsigned i = 0; i < bytes; ++i)
+        {
+            out_ += static_cast<char>(v >> (8 * i));
+        }
+    }
+
+    void put_strings(std::vector<std::string> const & strings)
+    {
+        put_varint(strings.size());
+        for (auto const & s : strings)
+        {
+            put_varint(s.size());
+            out_ += s;
+        }
+    }
+
+    std::string const prefix_;
+    std::size_t const segment_bytes_;
+    std::vector<std::string> queues_;
+    mpsc_ring<journal_entry, ring_capacity> ring_;
+    std::atomic<bool> closing_{false};
+    std::atomic<std::uint64_t> dropped_{0};
+    std::thread thread_;
+
+    // Writer thread only, until close() joins it.
+    unsigned segment_ = 0;
+    unsigned first_segment_ = 0;
+    int fd_ = -1;
+    std::string out_;
+    std::uint64_t segment_offset_ = 0;
+    std::uint64_t segment_records_ = 0;
+    std::uint64_t records_ = 0;
+    std::uint64_t dropped_at_open_ = 0;
+    std::int64_t last_ns_ = 0;
+    std::vector<index_entry> index_;
+    // Segment type number by process type number, or -1.
+    std::vector<std::int32_t> local_types_;
+    std::vector<std::string> type_names_;
+    std::unordered_map<std::string, std::uint32_t> accounts_;
+    std::vector<std::string> account_names_;
+    std::exception_ptr error_;
+};
+
+
+// One decoded journal record. Numbers index the reader's dictionaries.
+struct journal_record
+{
+    static std::uint32_t constexpr no_account = std::numeric_limits<std::uint32_t>::max();
+    static std::uint8_t constexpr has_terminal = 1;
+    static std::uint8_t constexpr has_request = 2;
+
+    // Nanoseconds since the Unix epoch.
+    std::int64_t time_ns;
+    std::uint32_t queue;
+    std::uint32_t type;
+    // Which of terminal and request the message had; zero when absent.
+    std::uint8_t flags;
+    std::uint32_t terminal;
+    std::uint64_t request;
+    std::uint32_t account;
+    std::int64_t amount;
+};
+
+// Read-only view of one finished segment, mapped into memory. Decoding is a
+// single pass over the mapping with no copies; the index lets a reader start
+// near a point in time instead of at the first record.
+//
+// Throws std::runtime_error if the file is not a complete segment.
+class journal_reader
+{
+public:
+    explicit journal_reader(std::string const & path)
+        : path_{path}
+    {
+        int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "open " + path};
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            int const error = errno;
+            ::close(fd);
+            throw std::system_error{error, std::generic_category(), "stat " + path};
+        }
+        size_ = static_cast<std::size_t>(st.st_size);
+        if (size_ < header_size + trailer_size)
+        {
+            ::close(fd);
+            throw std::runtime_error{path + ": not a journal segment"};
+        }
+        void * data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED)
+        {
+            throw std::system_error{errno, std::generic_category(), "mmap " + path};
+        }
+        data_ = static_cast<unsigned char const *>(data);
+        // Replay reads front to back.
+        ::madvise(data, size_, MADV_SEQUENTIAL);
+
+        try
+        {
+            open();
+        }
+        catch (...)
+        {
+            ::munmap(const_cast<unsigned char *>(data_), size_);
+            throw;
+        }
+    }
+
+    ~journal_reader()
+    {
+        ::munmap(const_cast<unsigned char *>(data_), size_);
+    }
+
+    journal_reader(journal_reader const &) = delete;
+    journal_reader & operator=(journal_reader const &) = delete;
+
+    std::uint64_t size() const
+    {
+        return records_;
+    }
+
+    std::int64_t base_ns() const
+    {
+        return base_ns_;
+    }
+
+    // Records the writer dropped, with its ring full, while this segment
+    // was current; they are missing from it.
+    std::uint64_t dropped() const
+    {
+        return dropped_;
+    }
+
+    std::vector<std::string> const & queues() const
+    {
+        return queues_;
+    }
+
+    std::vector<std::string> const & types() const
+    {
+        return types_;
+    }
+
+    std::vector<std::string> const & accounts() const
+    {
+        return accounts_;
+    }
+
+    // Calls f(journal_record const &) for every record, oldest first.
+    template <typename Func>
+    void scan(Func && f) const
+    {
+        scan_from(std::numeric_limits<std::int64_t>::min(), f);
+    }
+
+    // Calls f for every record at or after `time_ns`, starting from the last
+    // index entry before it.
+    template <typename Func>
+    void scan_from(std::int64_t time_ns, Func && f) const
+    {
+        std::size_t offset = header_size;
+        std::uint64_t record = 0;
+        std::int64_t previous = base_ns_;
+        auto const i = std::upper_bound(
+              index_.begin(), index_.end(), time_ns
+            , [](std::int64_t t, index_entry const & e) { return t <= e.previous_ns; });
+        if (i != index_.begin())
+        {
+            offset = static_cast<std::size_t>((i - 1)->offset);
+            record = (i - 1)->record;
+            previous = (i - 1)->previous_ns;
+        }
+
+        for (; record < records_; ++record)
+        {
+            journal_record r;
+            r.time_ns = previous + static_cast<std::int64_t>(varint(offset, footer_));
+            r.queue = static_cast<std::uint32_t>(varint(offset, footer_));
+            std::uint64_t const type = varint(offset, footer_);
+            r.type = static_cast<std::uint32_t>(type >> 2);
+            r.flags = static_cast<std::uint8_t>(type & 3);
+            r.terminal = r.flags & journal_record::has_terminal ? static_cast<std::uint32_t>(varint(offset, footer_)) : 0;
+            r.request = r.flags & journal_record::has_request ? varint(offset, footer_) : 0;
+            r.account = static_cast<std::uint32_t>(varint(offset, footer_)) - 1;
+            r.amount = unzigzag(varint(offset, footer_));
+            previous = r.time_ns;
+            if (r.time_ns >= time_ns)
+            {
+                f(r);
+            }
+        }
+    }
+
+private:
+    static std::size_t constexpr header_size = 16;
+    static std::size_t constexpr trailer_size = 20;
+
+    struct index_entry
+    {
+        std::uint64_t offset;
+        std::uint64_t record;
+        std::int64_t previous_ns;
+    };
+
+    void open()
+    {
+        if (std::memcmp(data_, "MQJ1", 4) != 0 or fixed(4, 4) != 2
+            or std::memcmp(data_ + size_ - 4, "MQJE", 4) != 0)
+        {
+            throw std::runtime_error{path_ + ": not a finished journal segment"};
+        }
+        base_ns_ = static_cast<std::int64_t>(fixed(8, 8));
+        footer_ = static_cast<std::size_t>(fixed(size_ - trailer_size, 8));
+        records_ = fixed(size_ - trailer_size + 8, 8);
+        std::size_t const end = size_ - trailer_size;
+        if (footer_ < header_size or footer_ > end)
+        {
+            throw std::runtime_error{path_ + ": bad footer offset"};
+        }
+
+        std::size_t offset = footer_;
+        strings(offset, end, queues_);
+        strings(offset, end, types_);
+        strings(offset, end, accounts_);
+        index_.resize(static_cast<std::size_t>(varint(offset, end)));
+        for (auto & i : index_)
+        {
+            i.offset = varint(offset, end);
+            i.record = varint(offset, end);
+            i.previous_ns = unzigzag(varint(offset, end));
+            if (i.offset < header_size or i.offset >= footer_ or i.record >= records_)
+            {
+                throw std::runtime_error{path_ + ": bad index entry"};
+            }
+        }
+        dropped_ = varint(offset, end);
+    }
+
+    std::uint64_t fixed(std::size_t offset, unsigned bytes) const
+    {
+        std::uint64_t v = 0;
+        for (unsigned i = 0; i < bytes; ++i)
+        {
+            v |= std::uint64_t{data_[offset + i]} << (8 * i);
+        }
+        return v;
+    }
+
+    std::uint64_t varint(std::size_t & offset, std::size_t end) const
+    {
+        std::uint64_t v = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            if (offset == end)
+            {
+                throw std::runtime_error{path_ + ": truncated record"};
+            }
+            unsigned char const b = data_[offset++];
+            v |= std::uint64_t{b & 0x7fu} << shift;
+            if (not (b & 0x80))
+            {
+                return v;
+            }
+        }
+        throw std::runtime_error{path_ + ": bad varint"};
+    }
+
+    void strings(std::size_t & offset, std::size_t end, std::vector<std::string> & out) const
+    {
+        out.resize(static_cast<std::size_t>(varint(offset, end)));
+        for (auto & s : out)
+        {
+            std::size_t const n = static_cast<std::size_t>(varint(offset, end));
+            if (n > end - offset)
+            {
+                throw std::runtime_error{path_ + ": truncated footer"};
+            }
+            s.assign(reinterpret_cast<char const *>(data_ + offset), n);
+            offset += n;
+        }
+    }
+
+    static std::int64_t unzigzag(std::uint64_t v)
+    {
+        return static_cast<std::int64_t>(v >> 1) ^ -static_cast<std::int64_t>(v & 1);
+    }
+
+    std::string const path_;
+    unsigned char const * data_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t footer_ = 0;
+    std::uint64_t records_ = 0;
+    std::uint64_t dropped_ = 0;
+    std::int64_t base_ns_ = 0;
+    std::vector<std::string> queues_;
+    std::vector<std::string> types_;
+    std::vector<std::string> accounts_;
+    std::vector<index_entry> index_;
+};
+
+}
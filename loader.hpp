@@ -0,0 +1,447 @@
+#pragma once
+
+#include "account_table.hpp"
+#include "queue.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace messaging {
+
+// Finds the ',' and '\n' bytes of a buffer in order. Each 64-byte block is
+// compared 16 bytes at a time into a bitmask, and delimiters are then taken
+// off the mask one bit at a time, so the bytes of a field are never looked at
+// one by one.
+class delimiter_scanner
+{
+public:
+    delimiter_scanner(char const * begin, char const * end)
+        : block_{begin}
+        , end_{end}
+    {
+        load();
+    }
+
+    // Next delimiter, or end once there are none left.
+    char const * next()
+    {
+        while (mask_ == 0)
+        {
+            if (end_ - block_ <= 64)
+            {
+                return end_;
+            }
+            block_ += 64;
+            load();
+        }
+        unsigned const bit = static_cast<unsigned>(__builtin_ctzll(mask_));
+        mask_ &= mask_ - 1;
+        return block_ + bit;
+    }
+
+private:
+    void load()
+    {
+        mask_ = 0;
+        std::size_t const n = static_cast<std::size_t>(std::min<std::ptrdiff_t>(end_ - block_, 64));
+        std::size_t i = 0;
+#if defined(__SSE2__)
+        __m128i const comma = _mm_set1_epi8(',');
+        __m128i const newline = _mm_set1_epi8('\n');
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(block_ + i));
+            unsigned const bits = static_cast<unsigned>(_mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, newline))));
+            mask_ |= std::uint64_t{bits} << i;
+        }
+#endif
+        for (; i < n; ++i)
+        {
+            if (block_[i] == ',' or block_[i] == '\n')
+            {
+                mask_ |= std::uint64_t{1} << i;
+            }
+        }
+    }
+
+    char const * block_;
+    char const * const end_;
+    std::uint64_t mask_ = 0;
+};
+
+
+// Builds a table from a CSV file of `account,pin,balance` lines, e.g. an
+// export of the real accounts, calling set(value, pin, balance) for each
+// line. A first line starting with "account," is taken as a header; blank
+// lines and CR-LF endings are accepted. Later lines for the same account
+// replace earlier ones.
+//
+// The file is mapped and split at line boundaries into chunks that are
+// parsed on the pool. Each chunk sorts its accounts by table partition, and
+// each partition's map is then built on the pool from the chunks' parts in
+// file order, so no two threads ever touch the same map.
+//
+// The table has one partition per pool worker. Throws std::runtime_error
+// naming the file and line of the first malformed line.
+template <typename Value, typename Set>
+account_table<Value> load_csv(std::string const & path, thread_pool & pool, Set set)
+{
+    struct record
+    {
+        std::string account;
+        std::string pin;
+        unsigned balance;
+    };
+
+    struct chunk
+    {
+        char const * begin;
+        char const * end;
+        // Records by table partition.
+        std::vector<std::vector<record> > parts;
+        // First malformed line, if any.
+        char const * error_at = nullptr;
+        char const * error = nullptr;
+    };
+
+    int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::system_error{errno, std::generic_category(), "open " + path};
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+        int const error = errno;
+        ::close(fd);
+        throw std::system_error{error, std::generic_category(), "stat " + path};
+    }
+    std::size_t const size = static_cast<std::size_t>(st.st_size);
+    account_table<Value> table{pool.size()};
+    if (size == 0)
+    {
+        ::close(fd);
+        return table;
+    }
+    void * const mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        throw std::system_error{errno, std::generic_category(), "mmap " + path};
+    }
+    // Chunks are read in parallel, each front to back.
+    ::madvise(mapped, size, MADV_WILLNEED);
+    char const * const data = static_cast<char const *>(mapped);
+    char const * const data_end = data + size;
+
+    // Several chunks per worker even out lines of uneven length.
+    std::size_t const wanted = pool.size() * 4;
+    std::vector<chunk> chunks;
+    for (char const * p = data; p != data_end;)
+    {
+        char const * end = p + std::min<std::size_t>(data_end - p, std::max<std::size_t>(size / wanted, 1));
+        end = std::find(end, data_end, '\n');
+        if (end != data_end)
+        {
+            ++end;
+        }
+        chunks.push_back(chunk{p, end, {}});
+        p = end;
+    }
+    if (size >= 8 and std::equal(data, data + 8, "account,"))
+    {
+        chunks.front().begin = std::min(std::find(data, data_end, '\n') + 1, data_end);
+    }
+
+    pool.parallel_for(
+          chunks.size()
+        , [&](std::size_t i)
+        {
+            chunk & c = chunks[i];
+            c.parts.resize(table.partitions());
+            delimiter_scanner scan{c.begin, c.end};
+            char const * line = c.begin;
+            while (line != c.end)
+            {
+                char const * const d1 = scan.next();
+                if (d1 == c.end or *d1 == '\n')
+                {
+                    // Only blank lines may have no comma.
+                    if (d1 != line and not (d1 == line + 1 and *line == '\r'))
+                    {
+                        c.error_at = line;
+                        c.error = "expected account,pin,balance";
+                        return;
+                    }
+                    line = d1 == c.end ? d1 : d1 + 1;
+                    continue;
+                }
+                char const * const d2 = scan.next();
+                char const * const d3 = d2 == c.end ? d2 : scan.next();
+                if (d2 == c.end or *d2 != ',' or (d3 != c.end and *d3 != '\n'))
+                {
+                    c.error_at = line;
+                    c.error = "expected account,pin,balance";
+                    return;
+                }
+                char const * field_end = d3;
+                if (field_end != d2 + 1 and field_end[-1] == '\r')
+                {
+                    --field_end;
+                }
+                std::uint64_t balance = 0;
+                for (char const * p = d2 + 1; p != field_end; ++p)
+                {
+                    if (*p < '0' or *p > '9' or balance > std::numeric_limits<unsigned>::max() / 10)
+                    {
+                        balance = std::uint64_t{std::numeric_limits<unsigned>::max()} + 1;
+                        break;
+                    }
+                    balance = balance * 10 + static_cast<unsigned>(*p - '0');
+                }
+                if (d1 == line or field_end == d2 + 1 or balance > std::numeric_limits<unsigned>::max())
+                {
+                    c.error_at = line;
+                    c.error = "bad account or balance";
+                    return;
+                }
+                std::string account{line, d1};
+                std::size_t const part = table.partition_of(account);
+                c.parts[part].push_back(record{std::move(account), std::string{d1 + 1, d2}, static_cast<unsigned>(balance)});
+                line = d3 == c.end ? d3 : d3 + 1;
+            }
+        });
+
+    for (auto const & c : chunks)
+    {
+        if (c.error)
+        {
+            std::size_t const line = std::count(data, c.error_at, '\n') + 1;
+            ::munmap(mapped, size);
+            throw std::runtime_error{path + ":" + std::to_string(line) + ": " + c.error};
+        }
+    }
+    ::munmap(mapped, size);
+
+    pool.parallel_for(
+          table.partitions()
+        , [&](std::size_t part)
+        {
+            auto & accounts = table.partition(part);
+            std::size_t n = 0;
+            for (auto const & c : chunks)
+            {
+                n += c.parts[part].size();
+            }
+            accounts.reserve(n);
+            for (auto & c : chunks)
+            {
+                for (auto & r : c.parts[part])
+                {
+                    set(accounts[std::move(r.account)], std::move(r.pin), r.balance);
+                }
+                // Frees each chunk's records as soon as they are in the map.
+                std::vector<record>{}.swap(c.parts[part]);
+            }
+        });
+    return table;
+}
+
+// Balances and PINs, for a bank to start from.
+inline account_table<bank_machine::account> load_accounts(std::string const & path, thread_pool & pool)
+{
+    return load_csv<bank_machine::account>(
+          path, pool
+        , [](bank_machine::account & a, std::string && pin, unsigned balance)
+        {
+            a.pin = std::move(pin);
+            a.balance = balance;
+        });
+}
+
+// PINs only, for publishing to running banks; balances are ignored.
+inline std::unique_ptr<pin_table const> load_pins(std::string const & path, thread_pool & pool)
+{
+    return std::unique_ptr<pin_table const>{new pin_table{load_csv<std::string>(
+          path, pool
+        , [](std::string & p, std::string && pin, unsigned)
+        {
+            p = std::move(pin);
+        })}};
+}
+
+// Loads the accounts of a snapshot written by a bank (see snapshot_writer)
+// over those of `table` and returns the WAL offset to replay from. Accounts
+// only in `table`, e.g. ones added to an account export since, are kept.
+// Throws std::runtime_error if the file is not a complete snapshot.
+inline std::uint64_t load_snapshot(std::string const & path, account_table<bank_machine::account> & table)
+{
+    int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::system_error{errno, std::generic_category(), "open " + path};
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+        int const error = errno;
+        ::close(fd);
+        throw std::system_error{error, std::generic_category(), "stat " + path};
+    }
+    std::size_t const size = static_cast<std::size_t>(st.st_size);
+    if (size < 24)
+    {
+        ::close(fd);
+        throw std::runtime_error{path + ": not a snapshot"};
+    }
+    void * const mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        throw std::system_error{errno, std::generic_category(), "mmap " + path};
+    }
+    ::madvise(mapped, size, MADV_SEQUENTIAL);
+    unsigned char const * const data = static_cast<unsigned char const *>(mapped);
+    std::size_t const end = size - 12;
+
+    auto fixed = [data](std::size_t offset)
+    {
+        std::uint64_t v = 0;
+        for (unsigned i = 0; i < 8; ++i)
+        {
+            v |= std::uint64_t{data[offset + i]} << (8 * i);
+        }
+        return v;
+    };
+    char const * error = nullptr;
+    std::size_t offset = 12;
+    auto varint = [&]()
+    {
+        std::uint64_t v = 0;
+        for (unsigned shift = 0; shift < 64 and offset != end; shift += 7)
+        {
+            unsigned char const b = data[offset++];
+            v |= std::uint64_t{b & 0x7fu} << shift;
+            if (not (b & 0x80))
+            {
+                return v;
+            }
+        }
+        error = "truncated record";
+        return std::uint64_t{0};
+    };
+    auto string = [&]()
+    {
+        std::size_t const n = static_cast<std::size_t>(varint());
+        if (n > end - offset)
+        {
+            error = "truncated record";
+            return std::string{};
+        }
+        std::string s{reinterpret_cast<char const *>(data + offset), n};
+        offset += n;
+        return s;
+    };
+
+    std::uint64_t wal_offset = 0;
+    if (std::memcmp(data, "MQS1", 4) != 0 or std::memcmp(data + size - 4, "MQSE", 4) != 0)
+    {
+        error = "not a snapshot";
+    }
+    else
+    {
+        wal_offset = fixed(4);
+        std::uint64_t const count = fixed(end);
+        for (std::uint64_t i = 0; i < count and not error; ++i)
+        {
+            std::string account = string();
+            std::string pin = string();
+            std::uint64_t const balance = varint();
+            auto & a = table[std::move(account)];
+            a.pin = std::move(pin);
+            a.balance = static_cast<unsigned>(balance);
+        }
+        if (not error and offset != end)
+        {
+            error = "trailing data";
+        }
+    }
+    ::munmap(mapped, size);
+    if (error)
+    {
+        throw std::runtime_error{path + ": " + error};
+    }
+    return wal_offset;
+}
+
+// Applies the commits of a bank WAL from byte `offset` on and returns how
+// many there were. A line cut short by a crash ends the log.
+inline std::size_t replay_wal(std::string const & path, std::uint64_t offset, account_table<bank_machine::account> & table)
+{
+    std::ifstream in{path};
+    if (not in)
+    {
+        throw std::runtime_error{"cannot open WAL " + path};
+    }
+    in.seekg(static_cast<std::streamoff>(offset));
+    std::size_t replayed = 0;
+    std::string line;
+    while (std::getline(in, line) and not in.eof())
+    {
+        std::istringstream fields{line};
+        std::string kind;
+        std::uint64_t id;
+        std::string account;
+        unsigned amount;
+        unsigned balance;
+        if (not (fields >> kind >> id >> account >> amount))
+        {
+            throw std::runtime_error{path + ": bad WAL line: " + line};
+        }
+        if (kind == "hold" or kind == "release")
+        {
+            // For replicas; holds do not outlive the bank.
+            continue;
+        }
+        if (kind != "commit")
+        {
+            throw std::runtime_error{path + ": bad WAL line: " + line};
+        }
+        auto & a = table[account];
+        if (fields >> balance)
+        {
+            a.balance = balance;
+        }
+        else
+        {
+            // Logged before lines carried the balance.
+            a.balance -= amount;
+        }
+        ++replayed;
+    }
+    return replayed;
+}
+
+}
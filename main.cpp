@@ -1,80 +1,318 @@
+#include "handler_table.hpp"
 #include "queue.hpp"
+#include "runloop.hpp"
+#include "sim.hpp"
+#include "topology.hpp"
 
+#include <chrono>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
 #include <thread>
 #include <utility>
+#include <vector>
 
-int main()
+namespace {
+
+using namespace messaging;
+
+// Schedules one customer session on an ATM starting at t, then the next one.
+void schedule_session(simulation & sim, sender atm_queue, sim_time t, sim_time end)
 {
-    using namespace messaging;
+    auto & rng = sim.random();
+    t += latency_model::exponential(30 * sim_s, 5 * 60 * sim_s).sample(rng);
+    if (t >= end)
+    {
+        return;
+    }
+
+    sim.at(t, [atm_queue]() mutable { atm_queue.send(card_inserted{"acc1234"}); });
+    sim_time key = t + 2 * sim_s;
+    for (char digit : std::string{"1937"})
+    {
+        key += latency_model::uniform(300 * sim_ms, 900 * sim_ms).sample(rng);
+        sim.at(key, [atm_queue, digit]() mutable { atm_queue.send(digit_pressed{digit}); });
+    }
+
+    key += latency_model::uniform(1 * sim_s, 4 * sim_s).sample(rng);
+    if (rng.uniform(0, 99) < 70)
+    {
+        sim.at(key, [atm_queue]() mutable { atm_queue.send(withdraw_pressed{50}); });
+    }
+    else
+    {
+        sim.at(key, [atm_queue]() mutable { atm_queue.send(balance_pressed{}); });
+        key += latency_model::uniform(2 * sim_s, 6 * sim_s).sample(rng);
+        sim.at(key, [atm_queue]() mutable { atm_queue.send(cancel_pressed{}); });
+    }
 
+    sim.at(key, [&sim, atm_queue, key, end]() { schedule_session(sim, atm_queue, key, end); });
+}
+
+// Simulates `atms` terminals, each with its own interface, sharing one bank.
+int simulate(unsigned atms, unsigned hours, std::uint64_t seed)
+{
+    std::ostream null_display{nullptr};
+
+    simulation sim{seed};
     bank_machine bank{};
-    interface_machine interface_hardware{};
-    atm machine{bank.get_sender(), interface_hardware.get_sender()};
+    std::vector<std::unique_ptr<interface_machine> > interfaces;
+    std::vector<std::unique_ptr<atm> > machines;
 
-    std::thread bank_thread{&bank_machine::run, &bank};
-    std::thread if_thread{&interface_machine::run, &interface_hardware};
-    std::thread atm_thread{&atm::run, &machine};
+    auto const bank_id = sim.add("bank", bank);
+    sim.set_service_time(bank_id, latency_model::exponential(20 * sim_us, 30 * sim_us));
+
+    sim_time const end = hours * 3600 * sim_s;
+    for (unsigned i = 0; i < atms; ++i)
+    {
+        interfaces.emplace_back(new interface_machine{null_display});
+        machines.emplace_back(new atm{bank.get_sender(), interfaces.back()->get_sender(), i});
+
+        auto const if_id = sim.add("interface", *interfaces.back());
+        auto const atm_id = sim.add("atm", *machines.back());
+        sim.set_service_time(if_id, latency_model::fixed(200 * sim_us));
+        sim.set_service_time(atm_id, latency_model::fixed(5 * sim_us));
+        sim.set_latency(atm_id, bank_id, latency_model::uniform(1 * sim_ms, 5 * sim_ms));
+        sim.set_latency(bank_id, atm_id, latency_model::uniform(1 * sim_ms, 5 * sim_ms));
+        sim.set_latency(atm_id, if_id, latency_model::fixed(100 * sim_us));
+
+        schedule_session(sim, machines.back()->get_sender(), 0, end);
+    }
+
+    auto const start = std::chrono::steady_clock::now();
+    sim.run_until(end);
+    auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    auto const & b = sim.stats(bank_id);
+    std::cout << "simulated " << atms << " ATMs for " << hours << " h in " << elapsed << " s\n"
+              << "bank processed=" << b.processed
+              << " max_depth=" << b.max_depth
+              << " utilisation=" << 100.0 * static_cast<double>(b.busy) / static_cast<double>(end) << '%'
+              << " mean_wait_us=" << (b.processed ? static_cast<double>(b.queued) / static_cast<double>(b.processed) / sim_us : 0.0)
+              << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Measures the cost of the ATM, bank and interface logic alone by running
+// `sessions` customer sessions through a single-threaded run loop.
+int bench(unsigned sessions)
+{
+    std::ostream null_display{nullptr};
+
+    run_loop loop;
+    bank_machine bank{};
+    interface_machine interface_hardware{null_display};
+    atm machine{bank.get_sender(), interface_hardware.get_sender(), 0};
+    loop.add(bank);
+    loop.add(interface_hardware);
+    loop.add(machine);
 
     sender atm_queue{machine.get_sender()};
+    // Each keypress is handled to completion before the next, as at a real terminal.
+    auto press = [&](auto const & msg)
+    {
+        atm_queue.send(msg);
+        return loop.run();
+    };
 
-    bool quit_pressed = false;
-    while (not quit_pressed)
+    std::uint64_t steps = loop.run();
+    auto const start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < sessions; ++i)
     {
-        char c = getchar();
-        switch (c)
+        steps += press(card_inserted{"acc1234"});
+        for (char digit : {'1', '9', '3', '7'})
         {
-            case '0':
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-            case '5':
-            case '6':
-            case '7':
-            case '8':
-            case '9':
-                atm_queue.send(digit_pressed{c});
-                break;
-
-            case 'b':
-            case 'B':
-                atm_queue.send(balance_pressed{});
-                break;
-
-            case 'w':
-            case 'W':
-                atm_queue.send(withdraw_pressed{50});
-                break;
-
-            case 'c':
-            case 'C':
-                atm_queue.send(cancel_pressed{});
-                break;
-
-            case 'q':
-            case 'Q':
-                quit_pressed = true;
-                break;
-
-            case 'i':
-            case 'I':
-                atm_queue.send(card_inserted{"acc1234"});
-                break;
+            steps += press(digit_pressed{digit});
         }
+        steps += press(balance_pressed{});
+        steps += press(withdraw_pressed{50});
     }
+    auto const elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
 
-    bank.done();
-    machine.done();
-    interface_hardware.done();
+    std::cout << sessions << " sessions, " << steps << " handler steps, "
+              << elapsed / sessions << " ns/session, "
+              << elapsed / static_cast<double>(steps) << " ns/step" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+// Dispatches `rounds` rounds of nine message types, one of each, through a
+// handler_table whose handlers are held in Handler; returns ns per message.
+template <typename Handler>
+double time_dispatch(unsigned rounds, std::uint64_t & handled)
+{
+    receiver incoming;
+    basic_handler_table<Handler> table;
+    table.template handle<card_inserted>([&handled](card_inserted const &) { ++handled; })
+         .template handle<digit_pressed>([&handled](digit_pressed const & msg) { handled += msg.digit; })
+         .template handle<clear_last_pressed>([&handled](clear_last_pressed const &) { ++handled; })
+         .template handle<withdraw_pressed>([&handled](withdraw_pressed const & msg) { handled += msg.amount; })
+         .template handle<balance_pressed>([&handled](balance_pressed const &) { ++handled; })
+         .template handle<statement_pressed>([&handled](statement_pressed const &) { ++handled; })
+         .template handle<pin_verified>([&handled](pin_verified const &) { ++handled; })
+         .template handle<pin_incorrect>([&handled](pin_incorrect const &) { ++handled; })
+         .template handle<cancel_pressed>([&handled](cancel_pressed const &) { ++handled; });
 
-    atm_thread.join();
-    bank_thread.join();
-    if_thread.join();
+    std::vector<std::shared_ptr<message_base> > const messages{
+          std::make_shared<wrapped_message<card_inserted> >(card_inserted{"acc1234"})
+        , std::make_shared<wrapped_message<digit_pressed> >(digit_pressed{'1'})
+        , std::make_shared<wrapped_message<clear_last_pressed> >(clear_last_pressed{})
+        , std::make_shared<wrapped_message<withdraw_pressed> >(withdraw_pressed{50})
+        , std::make_shared<wrapped_message<balance_pressed> >(balance_pressed{})
+        , std::make_shared<wrapped_message<statement_pressed> >(statement_pressed{})
+        , std::make_shared<wrapped_message<pin_verified> >(pin_verified{})
+        , std::make_shared<wrapped_message<pin_incorrect> >(pin_incorrect{})
+        , std::make_shared<wrapped_message<cancel_pressed> >(cancel_pressed{})
+        };
 
+    auto const start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < rounds; ++i)
+    {
+        for (auto const & msg : messages)
+        {
+            table.dispatch(incoming.get_queue(), msg);
+        }
+    }
+    auto const elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    return elapsed / (static_cast<double>(rounds) * static_cast<double>(messages.size()));
+}
+
+// Compares handler_table dispatch with handlers held in inplace_function
+// and in std::function, alternating so that both see the same conditions.
+int bench_dispatch(unsigned rounds)
+{
+    std::uint64_t handled = 0;
+    double inplace = 0;
+    double function = 0;
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        inplace += time_dispatch<inplace_function<void(message_base &)> >(rounds, handled);
+        function += time_dispatch<std::function<void(message_base &)> >(rounds, handled);
+    }
+    std::cout << rounds * 9 << " messages over 9 handlers: inplace_function "
+              << inplace / 3 << " ns/message, std::function "
+              << function / 3 << " ns/message (checksum " << handled << ")" << std::endl;
     return EXIT_SUCCESS;
 }
 
+// Prints the records of a finished journal segment, one per line:
+// <time_ns> <queue> <type> <account|-> <amount> [terminal=<n>] [request=<n>]
+int dump_journal(char const * path)
+{
+    journal_reader reader{path};
+    reader.scan(
+        [&reader](journal_record const & r)
+        {
+            std::cout << r.time_ns << ' ' << reader.queues()[r.queue] << ' ' << reader.types()[r.type] << ' '
+                      << (r.account == journal_record::no_account ? std::string{"-"} : reader.accounts()[r.account])
+                      << ' ' << r.amount;
+            if (r.flags & journal_record::has_terminal)
+            {
+                std::cout << " terminal=" << r.terminal;
+            }
+            if (r.flags & journal_record::has_request)
+            {
+                std::cout << " request=" << r.request;
+            }
+            std::cout << '\n';
+        });
+    std::cout << std::flush;
+    return EXIT_SUCCESS;
+}
+
+// Reconciles the journal segments <prefix>.<n> over [from_s, to_s), in
+// seconds since the Unix epoch. Fails if any terminal does not balance or
+// the journal is incomplete.
+int reconcile_journal(char const * prefix, std::int64_t from_s, std::int64_t to_s)
+{
+    auto const to_ns = [](std::int64_t s)
+    {
+        std::int64_t const limit = std::numeric_limits<std::int64_t>::max() / 1000000000;
+        return s >= limit ? std::numeric_limits<std::int64_t>::max() : s * 1000000000;
+    };
+    thread_pool pool{std::thread::hardware_concurrency()};
+    reconciliation const result = reconcile(prefix, to_ns(from_s), to_ns(to_s), pool);
+    std::cout << result << std::flush;
+    return result.mismatches.empty() and result.skipped.empty() and result.dropped == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}
+
+int main(int argc, char * argv[])
+{
+    using namespace messaging;
+
+    try
+    {
+        // --topology <file> describes the actors and threads; the options
+        // below override it. The default is one atm, one bank shard and a
+        // thread per actor.
+        topology_config config;
+        for (int i = 1; i + 1 < argc; ++i)
+        {
+            if (std::strcmp(argv[i], "--topology") == 0)
+            {
+                config = topology_config::load(argv[i + 1]);
+            }
+        }
+
+        for (int i = 1; i < argc; ++i)
+        {
+            if (std::strcmp(argv[i], "--topology") == 0 and i + 1 < argc)
+            {
+                ++i;
+            }
+            else if (std::strcmp(argv[i], "--introspect") == 0 and i + 1 < argc)
+            {
+                // Serves live actor state on a Unix socket.
+                config.introspect = argv[++i];
+            }
+            else if (std::strcmp(argv[i], "--fibers") == 0 and i + 1 < argc)
+            {
+                // Runs the actors as fibers on that many threads.
+                config.fibers = std::strtoul(argv[++i], nullptr, 10);
+            }
+            else if (std::strcmp(argv[i], "--simulate") == 0 and i + 2 < argc)
+            {
+                // --simulate <atms> <hours> [seed]
+                unsigned const atms = std::strtoul(argv[i + 1], nullptr, 10);
+                unsigned const hours = std::strtoul(argv[i + 2], nullptr, 10);
+                std::uint64_t const seed = i + 3 < argc ? std::strtoull(argv[i + 3], nullptr, 10) : 1;
+                return simulate(atms, hours, seed);
+            }
+            else if (std::strcmp(argv[i], "--bench") == 0 and i + 1 < argc)
+            {
+                return bench(std::strtoul(argv[i + 1], nullptr, 10));
+            }
+            else if (std::strcmp(argv[i], "--bench-dispatch") == 0 and i + 1 < argc)
+            {
+                return bench_dispatch(std::strtoul(argv[i + 1], nullptr, 10));
+            }
+            else if (std::strcmp(argv[i], "--dump-journal") == 0 and i + 1 < argc)
+            {
+                return dump_journal(argv[i + 1]);
+            }
+            else if (std::strcmp(argv[i], "--reconcile") == 0 and i + 1 < argc)
+            {
+                // --reconcile <journal prefix> [<from_s> <to_s>]
+                bool const window = i + 3 < argc;
+                return reconcile_journal(
+                      argv[i + 1]
+                    , window ? std::strtoll(argv[i + 2], nullptr, 10) : 0
+                    , window ? std::strtoll(argv[i + 3], nullptr, 10) : std::numeric_limits<std::int64_t>::max());
+            }
+        }
+
+        return launch_topology(config);
+    }
+    catch (std::exception const & e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+namespace messaging {
+
+// Bounded lock-free ring for any number of producer threads and one consumer
+// thread (Vyukov's bounded queue). Each slot carries a sequence number that
+// says whose turn it is, so producers only contend on the tail index and the
+// consumer never touches it.
+template <typename T, std::size_t Capacity>
+class mpsc_ring
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    static_assert(std::is_trivially_copyable<T>::value, "mpsc_ring elements must be trivially copyable");
+
+public:
+    mpsc_ring()
+    {
+        for (std::size_t i = 0; i < Capacity; ++i)
+        {
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    mpsc_ring(mpsc_ring const &) = delete;
+    mpsc_ring & operator=(mpsc_ring const &) = delete;
+
+    // Any thread. Returns false if the ring is full.
+    bool try_push(T const & value)
+    {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            slot & s = slots_[tail & mask];
+            std::size_t const seq = s.seq.load(std::memory_order_acquire);
+            if (seq == tail)
+            {
+                if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+                {
+                    s.value = value;
+                    s.seq.store(tail + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (seq < tail)
+            {
+                // The consumer has not freed this slot yet.
+                return false;
+            }
+            else
+            {
+                tail = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer only. Pops up to `max` elements into `out`; returns the count.
+    // Stops early at a slot whose producer has claimed it but not yet written.
+    std::size_t try_pop(T * out, std::size_t max)
+    {
+        std::size_t n = 0;
+        for (; n < max; ++n)
+        {
+            slot & s = slots_[(head_ + n) & mask];
+            if (s.seq.load(std::memory_order_acquire) != head_ + n + 1)
+            {
+                break;
+            }
+            out[n] = s.value;
+        }
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            slots_[(head_ + i) & mask].seq.store(head_ + i + Capacity, std::memory_order_release);
+        }
+        head_ += n;
+        return n;
+    }
+
+private:
+    static std::size_t constexpr mask = Capacity - 1;
+    static std::size_t constexpr cache_line = 64;
+
+    struct slot
+    {
+        std::atomic<std::size_t> seq;
+        T value;
+    };
+
+    // Padding rather than alignas, since over-aligned new needs C++17.
+    char pad0_[cache_line];
+    std::atomic<std::size_t> tail_{0};
+    char pad1_[cache_line - sizeof(std::size_t)];
+    std::size_t head_ = 0;
+    char pad2_[cache_line - sizeof(std::size_t)];
+    slot slots_[Capacity];
+};
+
+}
@@ -1,10 +1,44 @@
 #pragma once
 
-#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#else
+#include <condition_variable>
+#endif
+
+#include "account_table.hpp"
+#include "admission.hpp"
+#include "aqm.hpp"
+#include "dedup_table.hpp"
+#include "history.hpp"
+#include "journal.hpp"
+#include "rcu.hpp"
+#include "snapshot.hpp"
+#include "spsc_ring.hpp"
 
 namespace messaging {
 
@@ -14,6 +48,12 @@ struct message_base
     virtual ~message_base()
     {
     }
+
+    // Records the contents; wrapped_message knows their type.
+    virtual void journal(journal_writer & writer, std::uint32_t queue) const = 0;
+
+    // Set by queue::push; used to report the age of pending messages.
+    std::chrono::steady_clock::time_point enqueued_at;
 };
 
 
@@ -29,755 +69,3822 @@ struct wrapped_message
         : contents{msg}
     {
     }
+
+    void journal(journal_writer & writer, std::uint32_t queue) const override
+    {
+        writer.record(queue, contents);
+    }
 };
 
 
-class queue
+// Message to close queue.
+struct close_queue
+{
+};
+
+
+// How an actor is stopped.
+enum class stop_mode
+{
+    // Drop everything queued and handle close_queue next.
+      immediate
+    // Handle what is already queued, up to a deadline, then close.
+    , drain
+};
+
+// Outcome of stopping an actor, complete once its run() has returned.
+struct stop_report
+{
+    // Messages handled after the stop was requested.
+    std::uint64_t processed = 0;
+    // Messages dropped unhandled: queued ones dropped by an immediate stop or
+    // an expired drain deadline, and any sent after the stop.
+    std::uint64_t discarded = 0;
+};
+
+
+class queue;
+inline std::uint64_t next_request_id();
+
+
+// Takes over delivery for queues attached to it, so that actors can be driven
+// by non-blocking step() calls instead of a thread per actor.
+class scheduler
 {
 public:
-    template <typename Msg_T>
-    void push(Msg_T const & msg)
+    virtual ~scheduler()
     {
-        std::lock_guard<std::mutex> lock{m};
-        q.push(std::make_shared<wrapped_message<Msg_T> >(msg));
-        c.notify_all();
     }
 
-    std::shared_ptr<message_base> wait_and_pop()
+    // Called by queue::push instead of enqueueing; the scheduler later hands
+    // the message back through queue::deliver.
+    virtual void schedule(queue & q, std::shared_ptr<message_base> msg) = 0;
+
+    // Clocks of the actors it runs, for timeouts and timestamps; a simulated
+    // scheduler returns virtual time. Default to the real clocks.
+    virtual std::chrono::steady_clock::time_point steady_now() const
     {
-        std::unique_lock<std::mutex> lock{m};
-        c.wait(lock,
-            [this]()
-            {
-                // Block until queue is not empty.
-                return not q.empty();
-            });
-        auto msg = q.front();
-        q.pop();
-        return msg;
+        return std::chrono::steady_clock::now();
     }
 
-private:
+    // Wall-clock milliseconds since the epoch.
+    virtual std::int64_t wall_ms() const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Request IDs for the actors it runs; defaults to the process-wide
+    // next_request_id().
+    virtual std::uint64_t next_request_id();
+};
+
+
+// Sleeps while `word` holds `expected`; may return spuriously.
+// futex_wake(word) wakes sleepers on that word.
+#if defined(__linux__)
+inline void futex_wait(std::atomic<std::uint32_t> & word, std::uint32_t expected)
+{
+    ::syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<std::uint32_t> & word, int count = 1)
+{
+    ::syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+#else
+// Without futexes, sleepers wait on a condition variable picked by the
+// word's address, so the words themselves stay four bytes.
+struct futex_bucket
+{
     std::mutex m;
     std::condition_variable c;
-    std::queue< std::shared_ptr<message_base> > q;
 };
 
+inline futex_bucket & futex_bucket_for(std::atomic<std::uint32_t> const & word)
+{
+    static futex_bucket buckets[64];
+    return buckets[(reinterpret_cast<std::uintptr_t>(&word) >> 2) % 64];
+}
 
-// Interface through which to send a message.
-class sender
+inline void futex_wait(std::atomic<std::uint32_t> & word, std::uint32_t expected)
+{
+    auto & bucket = futex_bucket_for(word);
+    std::unique_lock<std::mutex> lock{bucket.m};
+    // The waker changes the word before taking the bucket's lock, so it is
+    // either seen here or wakes this wait.
+    if (word.load(std::memory_order_seq_cst) == expected)
+    {
+        bucket.c.wait(lock);
+    }
+}
+
+inline void futex_wake(std::atomic<std::uint32_t> & word, int = 1)
+{
+    auto & bucket = futex_bucket_for(word);
+    {
+        std::lock_guard<std::mutex> lock{bucket.m};
+    }
+    // Other words may share the bucket, so wake everyone; they re-check.
+    bucket.c.notify_all();
+}
+#endif
+
+
+// Spin-wait hint for polling loops; lets a sibling hardware thread run.
+inline void cpu_relax()
+{
+#if defined(__x86_64__) or defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    // At least make the compiler reload what the loop polls.
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+
+// Four-byte mutex (Drepper's three-state futex lock). Satisfies Lockable, so
+// it works with std::lock_guard and std::unique_lock, and may be unlocked by
+// a thread other than the one that locked it.
+class futex_mutex
 {
 public:
-    sender() = default;
+    futex_mutex() = default;
 
-    explicit sender(queue * q)
-        : q_{q}
+    futex_mutex(futex_mutex const &) = delete;
+    futex_mutex & operator=(futex_mutex const &) = delete;
+
+    void lock()
+    {
+        std::uint32_t c = unlocked;
+        if (state_.compare_exchange_strong(c, locked, std::memory_order_acquire))
+        {
+            return;
+        }
+        // Spin briefly: queue critical sections are a handful of instructions.
+        for (int i = 0; i < 64 and c != contended; ++i)
+        {
+            c = unlocked;
+            if (state_.compare_exchange_weak(c, locked, std::memory_order_acquire))
+            {
+                return;
+            }
+        }
+        if (c != contended)
+        {
+            c = state_.exchange(contended, std::memory_order_acquire);
+        }
+        while (c != unlocked)
+        {
+            futex_wait(state_, contended);
+            c = state_.exchange(contended, std::memory_order_acquire);
+        }
+    }
+
+    bool try_lock()
     {
+        std::uint32_t c = unlocked;
+        return state_.compare_exchange_strong(c, locked, std::memory_order_acquire);
     }
 
-    template <typename Msg_T>
-    void send(Msg_T const & msg)
+    void unlock()
     {
-        if (q_)
+        if (state_.exchange(unlocked, std::memory_order_release) == contended)
         {
-            q_->push(msg);
+            futex_wake(state_);
         }
     }
 
 private:
-    queue * q_ = nullptr;
+    static std::uint32_t constexpr unlocked = 0;
+    static std::uint32_t constexpr locked = 1;
+    static std::uint32_t constexpr contended = 2;
+
+    std::atomic<std::uint32_t> state_{unlocked};
 };
 
 
-template<
-      typename PreviousDispatcher
-    , typename Msg
-    , typename Func
-    >
-class TemplateDispatcher
+// Execution context that can suspend itself instead of blocking its thread,
+// such as a fiber. queue::wait_and_pop parks the current context while the
+// queue is empty.
+class parker
 {
 public:
-
-    TemplateDispatcher(TemplateDispatcher && other)
-        : q_{other.q_}
-        , prev_{other.prev_}
-        , f_{std::move(other.f_)}
-        , chained_{other.chained_}
+    virtual ~parker()
     {
-        other.chained_ = true;
     }
 
-    TemplateDispatcher(
-          queue * q
-        , PreviousDispatcher * prev
-        , Func && f
-        )
-        : q_{q}
-        , prev_{prev}
-        , f_{std::forward<Func>(f)}
-        , chained_{false}
+    // Suspends the caller. `lock` is held on entry and is released only once
+    // the caller is fully suspended; it is not held on return.
+    virtual void park(std::unique_lock<futex_mutex> & lock) = 0;
+
+    // Makes a parked context runnable again.
+    virtual void unpark() = 0;
+
+    // Parker for the code running on this thread, or nullptr for plain threads.
+    // Not inlined so that a fiber resumed on another thread re-reads it.
+    __attribute__((noinline)) static parker *& current()
     {
-        prev_->chained_ = true;
+        static thread_local parker * p = nullptr;
+        return p;
     }
+};
 
-    // Additional handlers can be chained.
-    template <typename OtherMsg, typename OtherFunc>
-    TemplateDispatcher<
-          TemplateDispatcher
-        , OtherMsg
-        , OtherFunc
-        >
-    handle(OtherFunc && f)
+
+// Messages for one queue collected so that queue::push_batch can enqueue
+// them under a single lock acquisition and wake-up.
+class message_batch
+{
+public:
+    template <typename Msg_T>
+    void add(Msg_T const & msg)
     {
-        return TemplateDispatcher<TemplateDispatcher, OtherMsg, OtherFunc>{q_, this, std::forward<OtherFunc>(f)};
+        auto wrapped = std::make_shared<wrapped_message<Msg_T> >(msg);
+        wrapped->enqueued_at = std::chrono::steady_clock::now();
+        msgs_.push_back(std::move(wrapped));
     }
 
-    ~TemplateDispatcher() noexcept(false)
+    bool empty() const
     {
-        if (not chained_)
-        {
-            wait_and_dispatch();
-        }
+        return msgs_.empty();
     }
 
-protected:
-    // Not copyable.
-    TemplateDispatcher(TemplateDispatcher const &) = delete;
-    TemplateDispatcher & operator=(TemplateDispatcher const &) = delete;
-
-    // TemplateDispatcher instantiations are friends of each other.
-    template<
-          typename OtherDispatcher
-        , typename OtherMsg
-        , typename OtherFunc
-        >
-    friend class TemplateDispatcher;
-
-    void wait_and_dispatch()
+    std::size_t size() const
     {
-        while (true)
-        {
-            auto msg = q_->wait_and_pop();
-            if (dispatch(msg))
-            {
-                // Stop if this dispatcher handled the message.
-                break;
-            }
-        }
+        return msgs_.size();
     }
 
-    bool dispatch(std::shared_ptr<message_base> const & msg)
+    void clear()
     {
-        // Check the message type and call the function.
-        if (wrapped_message<Msg> * wrapper = dynamic_cast<wrapped_message<Msg> *>(msg.get()))
-        {
-            f_(wrapper->contents);
-            return true;
-        }
-        else
-        {
-            // Not our message, so chain to the previous dispatcher.
-            return prev_->dispatch(msg);
-        }
+        msgs_.clear();
     }
 
 private:
-    queue * q_ = nullptr;
-    PreviousDispatcher * prev_ = nullptr;
-    Func f_;
-    bool chained_ = false;
-};
+    friend class queue;
 
-
-// Message to close queue.
-struct close_queue
-{
+    std::vector<std::shared_ptr<message_base> > msgs_;
 };
 
-class dispatcher
+
+class queue
 {
 public:
-    explicit dispatcher(queue * q)
-        : q_{q}
+    using clock = std::chrono::steady_clock;
+
+    queue() = default;
+
+    queue(queue const &) = delete;
+    queue & operator=(queue const &) = delete;
+
+    template <typename Msg_T>
+    void push(Msg_T const & msg)
     {
+        push(msg, generation());
     }
 
-    dispatcher(dispatcher && other)
-        : q_{other.q_}
-        , chained_{other.chained_}
+    // Pushes only if the queue still belongs to the receiver of the given
+    // generation; returns false if that receiver has been destroyed.
+    template <typename Msg_T>
+    bool push(Msg_T const & msg, std::uint32_t generation)
     {
-        // Source dispatcher must not now wait for messages.
-        other.chained_ = false;
-    }
+        // Fast rejection of dead actors: one load and compare.
+        if (generation_.load(std::memory_order_acquire) != generation)
+        {
+            return false;
+        }
 
-    // Not copyable
-    dispatcher(dispatcher const &) = delete;
-    dispatcher & operator=(dispatcher const &) = delete;
+        auto wrapped = std::make_shared<wrapped_message<Msg_T> >(msg);
+        wrapped->enqueued_at = clock::now();
+        // retire() clears both under the lock while senders may be here.
+        if (journal_writer * const journal = journal_.load(std::memory_order_acquire))
+        {
+            journal->record(journal_queue_, msg);
+        }
 
-    // The destructor does the work of waiting for a message dispatching it.
-    ~dispatcher() noexcept(false)
-    {
-        if (not chained_)
+        if (scheduler * const s = scheduler_.load(std::memory_order_acquire))
         {
-            wait_and_dispatch();
+            if (stop_)
+            {
+                ++stop_->discarded;
+                return false;
+            }
+            s->schedule(*this, std::move(wrapped));
+            return true;
+        }
+
+        std::unique_lock<futex_mutex> lock{m};
+        // retire() bumps the generation under the lock, so this check is exact.
+        if (generation_.load(std::memory_order_relaxed) != generation)
+        {
+            return false;
+        }
+        if (stop_)
+        {
+            // Stopped queues accept nothing further.
+            ++stop_->discarded;
+            return false;
         }
+        append(std::move(wrapped));
+        wake(lock);
+        return true;
     }
 
-    // Handle a specific type of message with a TemplateDispatcher.
-    template <typename Msg_T, typename Func>
-    TemplateDispatcher<dispatcher, Msg_T, Func>
-    handle(Func && f)
+    // Pushes every message in the batch, in order, and empties it. Returns
+    // false, dropping the batch, if the receiver of `generation` is gone.
+    bool push_batch(message_batch & batch, std::uint32_t generation)
     {
-        return TemplateDispatcher<dispatcher, Msg_T, Func>{q_, this, std::forward<Func>(f)};
+        bool const pushed = push_all(batch.msgs_, generation);
+        // Keeps the batch's capacity for reuse.
+        batch.msgs_.clear();
+        return pushed;
     }
 
-protected:
-    // TemplateDispatcher can access internals.
-    template<
-          typename Dispatcher
-        , typename Msg
-        , typename Func
-        >
-    friend class TemplateDispatcher;
-
-    // Infinitely loop and dispatch messages.
-    void wait_and_dispatch()
+    // Stops accepting messages and queues close_queue for the consumer.
+    // immediate: pending messages are dropped in bulk and close_queue is next.
+    // drain: pending messages are handled until `deadline`; whatever is still
+    // queued then is dropped.
+    void stop(stop_mode mode, clock::time_point deadline = clock::time_point::max())
     {
-        while (true)
+        auto close = std::make_shared<wrapped_message<close_queue> >(close_queue{});
+        close->enqueued_at = clock::now();
+
+        std::unique_ptr<std::shared_ptr<message_base>[]> pending;
+        std::unique_lock<futex_mutex> lock{m};
+        if (stop_)
         {
-            auto msg = q_->wait_and_pop();
-            dispatch(msg);
+            return;
+        }
+        stop_.reset(new stop_state{deadline, dequeued(), 0});
+        if (mode == stop_mode::immediate)
+        {
+            stop_->discarded = depth_.load(std::memory_order_relaxed);
+            pending = release_storage();
+        }
+
+        if (scheduler * const s = scheduler_.load(std::memory_order_relaxed))
+        {
+            // Scheduled queues are single-threaded; the scheduler delivers
+            // the close and deliver() drops anything arriving after it.
+            lock.unlock();
+            s->schedule(*this, std::move(close));
+            return;
         }
+        append(std::move(close));
+        wake(lock);
+        // Dropped messages are freed outside the lock.
     }
 
-    // Checks for close_queue message and throws if so.
-    bool dispatch(std::shared_ptr<message_base> const & msg)
+    // Counts for the last stop(); zero if the queue was never stopped.
+    stop_report get_stop_report() const
     {
-        if (dynamic_cast<wrapped_message<close_queue> *>(msg.get()))
+        std::lock_guard<futex_mutex> lock{m};
+        stop_report report;
+        if (stop_)
         {
-            throw close_queue{};
+            // The consumer's final pop is the close_queue itself.
+            auto const popped = dequeued() - stop_->dequeued_at_stop;
+            report.processed = popped ? popped - 1 : 0;
+            report.discarded = stop_->discarded;
         }
-        return false;
+        return report;
     }
 
-private:
-    queue * q_ = nullptr;
-    bool chained_ = false;
-};
+    std::shared_ptr<message_base> wait_and_pop()
+    {
+        std::unique_lock<futex_mutex> lock{m};
+        // Block until queue is not empty.
+        while (empty())
+        {
+            if (parker * p = parker::current())
+            {
+                // Suspend the fiber rather than the thread running it.
+                parked_ = p;
+                p->park(lock);
+            }
+            else
+            {
+                std::uint32_t const seq = seq_.load(std::memory_order_relaxed) | sleeping;
+                seq_.store(seq, std::memory_order_relaxed);
+                lock.unlock();
+                futex_wait(seq_, seq);
+            }
+            lock.lock();
+        }
+        return take();
+    }
 
+    // Attach before any messages are pushed. Pushes are then routed through
+    // the scheduler and dispatchers poll instead of blocking. `slot` is an
+    // opaque index the scheduler uses to find the owning actor.
+    void attach(scheduler * s, std::size_t slot = 0)
+    {
+        slot_ = static_cast<std::uint32_t>(slot);
+        scheduler_.store(s, std::memory_order_release);
+    }
 
-class receiver
-{
-public:
-    // Implicit conversion to a sender with pointer to queue.
-    operator sender()
+    bool scheduled() const
     {
-        return sender(&q_);
+        return scheduler_.load(std::memory_order_relaxed) != nullptr;
     }
 
-    // Waiting for queue creates dispatcher.
-    // ~dispatcher does the work of waiting for a message dispatching it.
-    dispatcher wait()
+    // The owner's clocks and request IDs: the scheduler's if attached.
+    clock::time_point now() const
     {
-        return dispatcher{&q_};
+        scheduler const * const s = scheduler_.load(std::memory_order_relaxed);
+        return s ? s->steady_now() : clock::now();
+    }
+
+    std::int64_t now_ms() const
+    {
+        scheduler const * const s = scheduler_.load(std::memory_order_relaxed);
+        return s ? s->wall_ms() : std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    std::uint64_t next_request_id() const
+    {
+        scheduler * const s = scheduler_.load(std::memory_order_relaxed);
+        return s ? s->next_request_id() : messaging::next_request_id();
+    }
+
+    // Attach before any messages are pushed. Every message offered to a live
+    // queue is then recorded as queue number `id`, including ones a stopping
+    // queue goes on to discard, unless the journal has to drop it (see
+    // journal_writer::dropped).
+    void journal_to(journal_writer * writer, std::uint32_t id)
+    {
+        journal_queue_ = id;
+        journal_.store(writer, std::memory_order_release);
+    }
+
+    // Reports the sojourn time of every message popped from now on to
+    // `aqm`, which must outlive the queue's use. Call from the receiver's
+    // thread, before it pops.
+    void manage(sojourn_controller * aqm)
+    {
+        aqm_ = aqm;
+    }
+
+    std::size_t slot() const
+    {
+        return slot_;
+    }
+
+    // Enqueue a message handed back by the scheduler. Scheduled queues are
+    // only touched from the scheduler's thread, so no lock is taken.
+    void deliver(std::shared_ptr<message_base> msg)
+    {
+        if (stop_ and not dynamic_cast<wrapped_message<close_queue> *>(msg.get()))
+        {
+            // Accepted before the stop but still in flight.
+            ++stop_->discarded;
+            return;
+        }
+        append(std::move(msg));
+    }
+
+    // Invalidates every sender to this queue and drops pending messages, so
+    // the queue can be handed to a new receiver.
+    void retire()
+    {
+        std::unique_ptr<std::shared_ptr<message_base>[]> pending;
+        {
+            std::lock_guard<futex_mutex> lock{m};
+            generation_.store(generation_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            pending = release_storage();
+            stop_.reset();
+            dequeued_.store(0, std::memory_order_relaxed);
+            active_.store(nullptr, std::memory_order_relaxed);
+            scheduler_.store(nullptr, std::memory_order_relaxed);
+            slot_ = 0;
+            parked_ = nullptr;
+            journal_.store(nullptr, std::memory_order_relaxed);
+            aqm_ = nullptr;
+        }
+        // Pending messages are freed outside the lock.
+    }
+
+    std::uint32_t generation() const
+    {
+        return generation_.load(std::memory_order_acquire);
+    }
+
+    // Returns nullptr if no message is waiting.
+    std::shared_ptr<message_base> try_pop()
+    {
+        if (scheduled())
+        {
+            return empty() ? nullptr : take();
+        }
+        std::lock_guard<futex_mutex> lock{m};
+        return empty() ? nullptr : take();
+    }
+
+    // The accessors below are safe to call from any thread without taking the
+    // queue lock, so inspecting a queue never stalls its owner.
+
+    // Number of messages waiting to be popped.
+    std::size_t size() const
+    {
+        return depth_.load(std::memory_order_relaxed);
+    }
+
+    // Enqueue time of the message at the front, or a default time point if empty.
+    clock::time_point oldest() const
+    {
+        return clock::time_point{clock::duration{oldest_.load(std::memory_order_relaxed)}};
+    }
+
+    // Total number of messages popped so far.
+    std::uint64_t dequeued() const
+    {
+        return dequeued_.load(std::memory_order_relaxed);
+    }
+
+    // Message type whose handler is currently running, or nullptr if idle.
+    std::type_info const * active_handler() const
+    {
+        return active_.load(std::memory_order_relaxed);
+    }
+
+    void set_active_handler(std::type_info const * type)
+    {
+        active_.store(type, std::memory_order_relaxed);
     }
 
 private:
-    // Receive owns the queue.
-    queue q_;
-};
+    // Bookkeeping for a stop; allocated only once the queue is stopped.
+    struct stop_state
+    {
+        clock::time_point deadline;
+        std::uint64_t dequeued_at_stop;
+        std::uint64_t discarded;
+    };
 
+    // Low bit of seq_: the consumer is (about to be) asleep in futex_wait.
+    static std::uint32_t constexpr sleeping = 1;
+    static std::uint32_t constexpr initial_capacity = 4;
 
-// ATM-specific message types.
+    bool empty() const
+    {
+        return depth_.load(std::memory_order_relaxed) == 0;
+    }
 
-struct withdraw
-{
-    std::string account = "";
-    unsigned amount = 0;
-    mutable sender atm_queue;
-};
+    // Ring storage is allocated on the first message and grown by doubling.
+    void append(std::shared_ptr<message_base> msg)
+    {
+        std::uint32_t const depth = depth_.load(std::memory_order_relaxed);
+        if (depth == 0)
+        {
+            oldest_.store(msg->enqueued_at.time_since_epoch().count(), std::memory_order_relaxed);
+        }
+        if (depth == capacity_)
+        {
+            std::uint32_t const capacity = capacity_ ? 2 * capacity_ : initial_capacity;
+            std::unique_ptr<std::shared_ptr<message_base>[]> buf{new std::shared_ptr<message_base>[capacity]};
+            for (std::uint32_t i = 0; i < depth; ++i)
+            {
+                buf[i] = std::move(buf_[(head_ + i) & (capacity_ - 1)]);
+            }
+            buf_ = std::move(buf);
+            capacity_ = capacity;
+            head_ = 0;
+        }
+        buf_[(head_ + depth) & (capacity_ - 1)] = std::move(msg);
+        depth_.store(depth + 1, std::memory_order_relaxed);
+    }
 
-struct withdraw_ok
-{
-};
+    // Wakes the consumer after a message was appended; may release the lock.
+    void wake(std::unique_lock<futex_mutex> & lock)
+    {
+        if (parked_)
+        {
+            parker * p = parked_;
+            parked_ = nullptr;
+            lock.unlock();
+            p->unpark();
+        }
+        else if (seq_.load(std::memory_order_relaxed) & sleeping)
+        {
+            // Bump the sequence so the sleeping consumer's futex_wait fails or wakes.
+            seq_.store((seq_.load(std::memory_order_relaxed) + 2) & ~sleeping, std::memory_order_relaxed);
+            lock.unlock();
+            futex_wake(seq_);
+        }
+    }
 
-struct withdraw_denied
-{
-};
+    bool push_all(std::vector<std::shared_ptr<message_base> > & msgs, std::uint32_t generation)
+    {
+        if (msgs.empty())
+        {
+            return true;
+        }
+        if (generation_.load(std::memory_order_acquire) != generation)
+        {
+            return false;
+        }
+        if (journal_writer * const journal = journal_.load(std::memory_order_acquire))
+        {
+            for (auto const & msg : msgs)
+            {
+                msg->journal(*journal, journal_queue_);
+            }
+        }
 
-struct cancel_withdrawal
-{
-    std::string account = "";
-    unsigned amount = 0;
-};
+        if (scheduler * const s = scheduler_.load(std::memory_order_acquire))
+        {
+            for (auto & msg : msgs)
+            {
+                if (stop_)
+                {
+                    ++stop_->discarded;
+                    continue;
+                }
+                s->schedule(*this, std::move(msg));
+            }
+            return true;
+        }
 
-struct withdrawal_processed
-{
-    std::string account = "";
-    unsigned amount = 0;
-};
+        std::unique_lock<futex_mutex> lock{m};
+        if (generation_.load(std::memory_order_relaxed) != generation)
+        {
+            return false;
+        }
+        if (stop_)
+        {
+            stop_->discarded += msgs.size();
+            return false;
+        }
+        for (auto & msg : msgs)
+        {
+            append(std::move(msg));
+        }
+        wake(lock);
+        return true;
+    }
 
-struct card_inserted
-{
-    std::string account = "";
-};
+    // Empties the queue, handing the storage to the caller to free.
+    std::unique_ptr<std::shared_ptr<message_base>[]> release_storage()
+    {
+        head_ = 0;
+        capacity_ = 0;
+        depth_.store(0, std::memory_order_relaxed);
+        oldest_.store(0, std::memory_order_relaxed);
+        return std::move(buf_);
+    }
 
-struct digit_pressed
-{
-    char digit;
-};
+    // Storage is released once the queue drains, so an idle queue owns no heap memory.
+    std::shared_ptr<message_base> take()
+    {
+        if (stop_ and stop_->deadline != clock::time_point::max() and clock::now() > stop_->deadline)
+        {
+            // Drain deadline passed: drop the backlog and close now.
+            return expire_drain();
+        }
 
-struct clear_last_pressed
-{
-};
+        auto msg = std::move(buf_[head_]);
+        std::uint32_t const depth = depth_.load(std::memory_order_relaxed) - 1;
+        depth_.store(depth, std::memory_order_relaxed);
+        if (depth == 0)
+        {
+            buf_.reset();
+            capacity_ = 0;
+            head_ = 0;
+            oldest_.store(0, std::memory_order_relaxed);
+        }
+        else
+        {
+            head_ = (head_ + 1) & (capacity_ - 1);
+            oldest_.store(buf_[head_]->enqueued_at.time_since_epoch().count(), std::memory_order_relaxed);
+        }
+        dequeued_.fetch_add(1, std::memory_order_relaxed);
+        if (aqm_)
+        {
+            auto const now = clock::now();
+            aqm_->dequeued(now - msg->enqueued_at, now, depth == 0);
+        }
+        return msg;
+    }
 
-struct eject_card
-{
-};
+    std::shared_ptr<message_base> expire_drain()
+    {
+        std::uint32_t const depth = depth_.load(std::memory_order_relaxed);
+        for (std::uint32_t i = 0; i < depth; ++i)
+        {
+            if (not dynamic_cast<wrapped_message<close_queue> *>(buf_[(head_ + i) & (capacity_ - 1)].get()))
+            {
+                ++stop_->discarded;
+            }
+        }
+        release_storage();
+        stop_->deadline = clock::time_point::max();
+        dequeued_.fetch_add(1, std::memory_order_relaxed);
+        return std::make_shared<wrapped_message<close_queue> >(close_queue{});
+    }
 
-struct withdraw_pressed
-{
-    unsigned amount;
+    // Layout kept to about one cache line while idle.
+    mutable futex_mutex m;
+    std::atomic<std::uint32_t> seq_{0};
+    std::unique_ptr<std::shared_ptr<message_base>[]> buf_;
+    std::uint32_t head_ = 0;
+    std::uint32_t capacity_ = 0;
+    std::atomic<std::uint32_t> depth_{0};
+    std::uint32_t slot_ = 0;
+    // Bumped by retire(); senders holding an older value are stale.
+    std::atomic<std::uint32_t> generation_{0};
+    // Atomic since senders read them without the lock.
+    std::atomic<scheduler *> scheduler_{nullptr};
+    // Consumer suspended in wait_and_pop, if it is not a plain thread.
+    parker * parked_ = nullptr;
+    std::unique_ptr<stop_state> stop_;
+    std::atomic<journal_writer *> journal_{nullptr};
+    std::uint32_t journal_queue_ = 0;
+    sojourn_controller * aqm_ = nullptr;
+
+    std::atomic<clock::rep> oldest_{0};
+    std::atomic<std::uint64_t> dequeued_{0};
+    std::atomic<std::type_info const *> active_{nullptr};
 };
 
-struct cancel_pressed
-{
-};
 
-struct issue_money
+// Deadline `timeout` from now; duration::max() means no deadline.
+inline queue::clock::time_point deadline_after(queue::clock::duration timeout)
 {
-    unsigned amount;
-};
+    if (timeout == queue::clock::duration::max())
+    {
+        return queue::clock::time_point::max();
+    }
+    return queue::clock::now() + timeout;
+}
 
-struct verify_pin
-{
-    std::string account;
-    std::string pin;
-    mutable sender atm_queue;
-};
 
-struct pin_verified
+// Identifies a receiver: its queue's slot in the actor_registry plus the
+// slot's generation when the receiver was created.
+struct actor_handle
 {
+    std::uint32_t index = 0;
+    std::uint32_t generation = 0;
 };
 
-struct pin_incorrect
-{
-};
 
-struct display_enter_pin
+// Owns the queues of all receivers in stable, reusable slots.
+//
+// Queue memory is never freed while the process runs, so a sender that
+// outlives its receiver still points at a valid queue; the generation check
+// in queue::push makes it fail cleanly instead of touching a dead actor.
+// Lookups are lock-free; only acquire and release take the registry lock.
+class actor_registry
 {
+public:
+    static actor_registry & instance()
+    {
+        static actor_registry registry;
+        return registry;
+    }
+
+    ~actor_registry()
+    {
+        for (auto & chunk : chunks_)
+        {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    actor_registry(actor_registry const &) = delete;
+    actor_registry & operator=(actor_registry const &) = delete;
+
+    actor_handle acquire()
+    {
+        std::lock_guard<std::mutex> lock{m_};
+        std::uint32_t index = next_;
+        if (not free_.empty())
+        {
+            index = free_.back();
+            free_.pop_back();
+        }
+        else
+        {
+            if ((index >> chunk_bits) >= max_chunks)
+            {
+                throw std::length_error{"actor_registry full"};
+            }
+            if ((index & chunk_mask) == 0)
+            {
+                chunks_[index >> chunk_bits].store(new queue[chunk_size], std::memory_order_release);
+            }
+            ++next_;
+        }
+        return actor_handle{index, at(index).generation()};
+    }
+
+    void release(std::uint32_t index)
+    {
+        at(index).retire();
+        std::lock_guard<std::mutex> lock{m_};
+        free_.push_back(index);
+    }
+
+    queue & at(std::uint32_t index) const
+    {
+        return chunks_[index >> chunk_bits].load(std::memory_order_acquire)[index & chunk_mask];
+    }
+
+private:
+    actor_registry() = default;
+
+    static std::uint32_t constexpr chunk_bits = 12;
+    static std::uint32_t constexpr chunk_size = 1u << chunk_bits;
+    static std::uint32_t constexpr chunk_mask = chunk_size - 1;
+    static std::uint32_t constexpr max_chunks = 4096;
+
+    std::mutex m_;
+    std::vector<std::uint32_t> free_;
+    std::uint32_t next_ = 0;
+    std::atomic<queue *> chunks_[max_chunks] = {};
 };
 
-struct display_enter_card
+
+// Marks a message type as being handled on a queue for the guard's lifetime.
+class active_handler_guard
 {
+public:
+    active_handler_guard(queue * q, std::type_info const & type)
+        : q_{q}
+    {
+        q_->set_active_handler(&type);
+    }
+
+    ~active_handler_guard()
+    {
+        q_->set_active_handler(nullptr);
+    }
+
+    active_handler_guard(active_handler_guard const &) = delete;
+    active_handler_guard & operator=(active_handler_guard const &) = delete;
+
+private:
+    queue * q_;
 };
 
-struct display_insufficient_funds
+
+struct actor_probe;
+
+// Process-wide list of actors that can be inspected while running.
+
+class probe_registry
 {
+public:
+    static probe_registry & instance()
+    {
+        static probe_registry registry;
+        return registry;
+    }
+
+    // Constant time, so hosting very many actors stays cheap.
+    void add(actor_probe * probe);
+    void remove(actor_probe * probe);
+
+    // Calls f for each live probe. Only actor construction and destruction
+    // contend for the registry lock, so this never blocks message handling.
+    template <typename Func>
+    void for_each(Func && f)
+    {
+        std::lock_guard<std::mutex> lock{m_};
+        for (auto probe : probes_)
+        {
+            f(*probe);
+        }
+    }
+
+private:
+    std::mutex m_;
+    std::vector<actor_probe *> probes_;
 };
 
-struct display_withdrawal_cancelled
+// Live view of an actor, published for introspection.
+// The owning actor updates `state`; readers only load atomics and never lock
+// the actor's queue.
+struct actor_probe
 {
+    actor_probe(std::string name, queue const * q)
+        : name{std::move(name)}
+        , q{q}
+    {
+        probe_registry::instance().add(this);
+    }
+
+    ~actor_probe()
+    {
+        probe_registry::instance().remove(this);
+    }
+
+    actor_probe(actor_probe const &) = delete;
+    actor_probe & operator=(actor_probe const &) = delete;
+
+    std::string const name;
+    queue const * const q;
+    std::atomic<char const *> state{"idle"};
+
+private:
+    friend class probe_registry;
+
+    // Position in the registry.
+    std::size_t index_ = 0;
 };
 
-struct display_pin_incorrect_message
+inline void probe_registry::add(actor_probe * probe)
 {
-};
+    std::lock_guard<std::mutex> lock{m_};
+    probe->index_ = probes_.size();
+    probes_.push_back(probe);
+}
 
-struct display_withdrawal_options
+inline void probe_registry::remove(actor_probe * probe)
 {
-};
+    std::lock_guard<std::mutex> lock{m_};
+    probes_[probe->index_] = probes_.back();
+    probes_[probe->index_]->index_ = probe->index_;
+    probes_.pop_back();
+}
 
-struct get_balance
+
+// Interface through which to send a message.
+// Holds the target queue's stable address and generation; sending to a
+// receiver that has since been destroyed returns false.
+class sender
 {
-    std::string account;
-    mutable sender atm_queue;
-};
+public:
+    sender() = default;
+
+    explicit sender(queue * q)
+        : q_{q}
+        , generation_{q ? q->generation() : 0}
+    {
+    }
+
+    sender(queue * q, std::uint32_t generation)
+        : q_{q}
+        , generation_{generation}
+    {
+    }
+
+    explicit sender(actor_handle handle)
+        : sender{&actor_registry::instance().at(handle.index), handle.generation}
+    {
+    }
+
+    template <typename Msg_T>
+    bool send(Msg_T const & msg)
+    {
+        return q_ and q_->push(msg, generation_);
+    }
+
+    // Sends and empties the batch with one lock acquisition on the target.
+    bool send_batch(message_batch & batch)
+    {
+        if (not q_)
+        {
+            batch.clear();
+            return false;
+        }
+        return q_->push_batch(batch, generation_);
+    }
+
+private:
+    queue * q_ = nullptr;
+    std::uint32_t generation_ = 0;
+};
+
+
+#ifdef MESSAGING_ADAPTIVE_DISPATCH
+// Hit counts for one handler chain, used to try its hottest handlers first.
+// A handler that becomes hotter than the one tested before it swaps places
+// with it, so the order converges on the observed frequencies at O(1) cost
+// per message; counts are halved periodically to follow shifts in traffic.
+template <std::size_t N>
+struct dispatch_profile
+{
+    static std::uint32_t constexpr decay_interval = 4096;
+
+    dispatch_profile()
+    {
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            order[i] = static_cast<std::uint8_t>(i);
+        }
+    }
+
+    // Handler order[position] matched a message.
+    void record(std::size_t position)
+    {
+        std::uint8_t const handler = order[position];
+        ++hits[handler];
+        if (position != 0 and hits[handler] > hits[order[position - 1]])
+        {
+            std::swap(order[position], order[position - 1]);
+        }
+        if (++dispatches == decay_interval)
+        {
+            dispatches = 0;
+            for (auto & h : hits)
+            {
+                h /= 2;
+            }
+        }
+    }
+
+    // Handler indices in the order to test them; 0 is the last .handle<>().
+    std::uint8_t order[N];
+    std::uint32_t hits[N] = {};
+    std::uint32_t dispatches = 0;
+};
+#endif
+
+
+template<
+      typename PreviousDispatcher
+    , typename Msg
+    , typename Func
+    >
+class TemplateDispatcher
+{
+public:
+    // Number of handlers in the chain up to and including this one.
+    static std::size_t constexpr depth = PreviousDispatcher::depth + 1;
+
+    TemplateDispatcher(TemplateDispatcher && other)
+        : q_{other.q_}
+        , prev_{other.prev_}
+        , f_{std::move(other.f_)}
+        , chained_{other.chained_}
+    {
+        other.chained_ = true;
+    }
+
+    TemplateDispatcher(
+          queue * q
+        , PreviousDispatcher * prev
+        , Func && f
+        )
+        : q_{q}
+        , prev_{prev}
+        , f_{std::forward<Func>(f)}
+        , chained_{false}
+    {
+        prev_->chained_ = true;
+    }
+
+    // Additional handlers can be chained.
+    template <typename OtherMsg, typename OtherFunc>
+    TemplateDispatcher<
+          TemplateDispatcher
+        , OtherMsg
+        , OtherFunc
+        >
+    handle(OtherFunc && f)
+    {
+        return TemplateDispatcher<TemplateDispatcher, OtherMsg, OtherFunc>{q_, this, std::forward<OtherFunc>(f)};
+    }
+
+    ~TemplateDispatcher() noexcept(false)
+    {
+        if (not chained_)
+        {
+            wait_and_dispatch();
+        }
+    }
+
+protected:
+    // Not copyable.
+    TemplateDispatcher(TemplateDispatcher const &) = delete;
+    TemplateDispatcher & operator=(TemplateDispatcher const &) = delete;
+
+    // TemplateDispatcher instantiations are friends of each other.
+    template<
+          typename OtherDispatcher
+        , typename OtherMsg
+        , typename OtherFunc
+        >
+    friend class TemplateDispatcher;
+
+    void wait_and_dispatch()
+    {
+        if (q_->scheduled())
+        {
+            // Never block a scheduled queue: dispatch at most one message.
+            if (auto msg = q_->try_pop())
+            {
+                dispatch_chain(msg);
+            }
+            return;
+        }
+
+        while (true)
+        {
+            auto msg = q_->wait_and_pop();
+            if (dispatch_chain(msg))
+            {
+                // Stop if this dispatcher handled the message.
+                break;
+            }
+        }
+    }
+
+    // Dispatch from the outermost dispatcher of a chain.
+    bool dispatch_chain(std::shared_ptr<message_base> const & msg)
+    {
+#ifdef MESSAGING_ADAPTIVE_DISPATCH
+        // One profile per chain (i.e. per call site) and thread.
+        static thread_local dispatch_profile<depth> profile;
+        for (std::size_t position = 0; position < depth; ++position)
+        {
+            if (handle_at(profile.order[position], msg))
+            {
+                profile.record(position);
+                return true;
+            }
+        }
+        // Only the base dispatcher's close_queue check is left.
+        return handle_at(depth, msg);
+#else
+        return dispatch(msg);
+#endif
+    }
+
+    bool dispatch(std::shared_ptr<message_base> const & msg)
+    {
+        if (handle(msg))
+        {
+            return true;
+        }
+        // Not our message, so chain to the previous dispatcher.
+        return prev_->dispatch(msg);
+    }
+
+    // Tries only the handler `index` links down the chain (0 is this one).
+    bool handle_at(std::size_t index, std::shared_ptr<message_base> const & msg)
+    {
+        return index == 0 ? handle(msg) : prev_->handle_at(index - 1, msg);
+    }
+
+    // Check the message type and call the function.
+    bool handle(std::shared_ptr<message_base> const & msg)
+    {
+        if (wrapped_message<Msg> * wrapper = dynamic_cast<wrapped_message<Msg> *>(msg.get()))
+        {
+            active_handler_guard active{q_, typeid(Msg)};
+            f_(wrapper->contents);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    queue * q_ = nullptr;
+    PreviousDispatcher * prev_ = nullptr;
+    Func f_;
+    bool chained_ = false;
+};
+
+
+class dispatcher
+{
+public:
+    // No handlers of its own.
+    static std::size_t constexpr depth = 0;
+
+    explicit dispatcher(queue * q)
+        : q_{q}
+    {
+    }
+
+    dispatcher(dispatcher && other)
+        : q_{other.q_}
+        , chained_{other.chained_}
+    {
+        // Source dispatcher must not now wait for messages.
+        other.chained_ = false;
+    }
+
+    // Not copyable
+    dispatcher(dispatcher const &) = delete;
+    dispatcher & operator=(dispatcher const &) = delete;
+
+    // The destructor does the work of waiting for a message dispatching it.
+    ~dispatcher() noexcept(false)
+    {
+        if (not chained_)
+        {
+            wait_and_dispatch();
+        }
+    }
+
+    // Handle a specific type of message with a TemplateDispatcher.
+    template <typename Msg_T, typename Func>
+    TemplateDispatcher<dispatcher, Msg_T, Func>
+    handle(Func && f)
+    {
+        return TemplateDispatcher<dispatcher, Msg_T, Func>{q_, this, std::forward<Func>(f)};
+    }
+
+protected:
+    // TemplateDispatcher can access internals.
+    template<
+          typename Dispatcher
+        , typename Msg
+        , typename Func
+        >
+    friend class TemplateDispatcher;
+
+    // Infinitely loop and dispatch messages.
+    void wait_and_dispatch()
+    {
+        if (q_->scheduled())
+        {
+            if (auto msg = q_->try_pop())
+            {
+                dispatch(msg);
+            }
+            return;
+        }
+
+        while (true)
+        {
+            auto msg = q_->wait_and_pop();
+            dispatch(msg);
+        }
+    }
+
+    // Checks for close_queue message and throws if so.
+    bool dispatch(std::shared_ptr<message_base> const & msg)
+    {
+        if (dynamic_cast<wrapped_message<close_queue> *>(msg.get()))
+        {
+            throw close_queue{};
+        }
+        return false;
+    }
+
+    // The end of every chain is this close_queue check.
+    bool handle_at(std::size_t, std::shared_ptr<message_base> const & msg)
+    {
+        return dispatch(msg);
+    }
+
+private:
+    queue * q_ = nullptr;
+    bool chained_ = false;
+};
+
+
+class receiver
+{
+public:
+    receiver()
+        : handle_{actor_registry::instance().acquire()}
+        , q_{&actor_registry::instance().at(handle_.index)}
+    {
+    }
+
+    // Senders still referring to this receiver fail from now on.
+    ~receiver()
+    {
+        actor_registry::instance().release(handle_.index);
+    }
+
+    receiver(receiver const &) = delete;
+    receiver & operator=(receiver const &) = delete;
+
+    // Implicit conversion to a sender with pointer to queue.
+    operator sender()
+    {
+        return sender(q_, handle_.generation);
+    }
+
+    // Waiting for queue creates dispatcher.
+    // ~dispatcher does the work of waiting for a message dispatching it.
+    dispatcher wait()
+    {
+        return dispatcher{q_};
+    }
+
+    actor_handle get_handle() const
+    {
+        return handle_;
+    }
+
+    queue & get_queue()
+    {
+        return *q_;
+    }
+
+    queue const & get_queue() const
+    {
+        return *q_;
+    }
+
+private:
+    // Receiver owns a queue slot in the actor registry.
+    actor_handle handle_;
+    queue * q_;
+};
+
+
+// ATM-specific message types.
+
+struct withdraw
+{
+    std::string account = "";
+    unsigned amount = 0;
+    mutable sender atm_queue;
+    // Same ID on a retry, so the bank answers it without debiting again;
+    // 0 opts out of deduplication.
+    std::uint64_t request_id = 0;
+    // Recorded in the account history.
+    std::uint32_t terminal = account_history::unknown_terminal;
+    // Version of the routing table the sender chose a bank shard by; 0 if
+    // it sent to a bank directly. See bank_link.
+    std::uint32_t route_version = 0;
+};
+
+// Process-wide unique, non-zero request ID. Starting from the time in
+// nanoseconds keeps IDs unique across restarts too, since the journal and
+// the banks outlive a process.
+inline std::uint64_t next_request_id()
+{
+    static std::atomic<std::uint64_t> next{static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count())};
+    return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline std::uint64_t scheduler::next_request_id()
+{
+    return messaging::next_request_id();
+}
+
+struct withdraw_ok
+{
+};
+
+struct withdraw_denied
+{
+};
+
+// Answers a request that admission control turned away before it reached
+// the bank (see admission_control), or a balance or statement query the
+// bank shed after it waited too long in a standing queue (see
+// bank_machine::manage_queue).
+struct bank_busy
+{
+};
+
+// Releases the hold placed by the withdraw with the same request_id.
+struct cancel_withdrawal
+{
+    std::string account = "";
+    unsigned amount = 0;
+    std::uint64_t request_id = 0;
+    std::uint32_t route_version = 0;
+};
+
+// Commits the hold placed by the withdraw with the same request_id.
+struct withdrawal_processed
+{
+    std::string account = "";
+    unsigned amount = 0;
+    std::uint64_t request_id = 0;
+    // Where the cash was dispensed; journaled for reconciliation.
+    std::uint32_t terminal = account_history::unknown_terminal;
+    std::uint32_t route_version = 0;
+};
+
+struct card_inserted
+{
+    std::string account = "";
+};
+
+struct digit_pressed
+{
+    char digit;
+};
+
+struct clear_last_pressed
+{
+};
+
+struct eject_card
+{
+};
+
+struct withdraw_pressed
+{
+    unsigned amount;
+};
+
+struct cancel_pressed
+{
+};
+
+struct issue_money
+{
+    unsigned amount;
+    // Dispensing terminal, for reconciliation against the bank's debits.
+    std::uint32_t terminal = account_history::unknown_terminal;
+};
+
+struct verify_pin
+{
+    std::string account;
+    std::string pin;
+    mutable sender atm_queue;
+    std::uint32_t route_version = 0;
+};
+
+struct pin_verified
+{
+};
+
+struct pin_incorrect
+{
+};
+
+struct display_enter_pin
+{
+};
+
+struct display_enter_card
+{
+};
+
+struct display_insufficient_funds
+{
+};
+
+struct display_withdrawal_cancelled
+{
+};
+
+struct display_pin_incorrect_message
+{
+};
+
+struct display_bank_busy
+{
+};
+
+struct display_withdrawal_options
+{
+};
+
+struct get_balance
+{
+    std::string account;
+    mutable sender atm_queue;
+    std::uint32_t route_version = 0;
+};
+
+struct balance
+{
+    unsigned amount;
+};
+
+struct display_balance
+{
+    unsigned amount;
+};
+
+struct balance_pressed
+{
+};
+
+struct statement_pressed
+{
+};
+
+// Asks a bank to write a snapshot of its committed balances to `path` in
+// the background; see snapshot_writer.
+struct take_snapshot
+{
+    std::string path;
+};
+
+// Asks for the last `entries` transactions; the bank answers with one or
+// more statement_chunks, the final one marked last.
+struct get_statement
+{
+    std::string account;
+    unsigned entries;
+    mutable sender atm_queue;
+    std::uint32_t route_version = 0;
+};
+
+struct statement_chunk
+{
+    static std::size_t constexpr capacity = 8;
+
+    history_entry entries[capacity];
+    unsigned count = 0;
+    bool last = false;
+};
+
+struct display_statement_entry
+{
+    std::int32_t amount;
+    std::uint32_t terminal;
+};
+
+
+// Compact form of the atm -> interface_machine messages: one opcode plus an
+// argument, so the whole link carries a single trivially copyable type.
+enum class display_op : std::uint32_t
+{
+      enter_card
+    , enter_pin
+    , withdrawal_options
+    , balance
+    , insufficient_funds
+    , withdrawal_cancelled
+    , pin_incorrect
+    , issue_money
+    , eject_card
+    , statement_entry
+    , bank_busy
+};
+
+std::size_t constexpr display_op_count = 11;
+
+struct display_command
+{
+    display_op op;
+    std::uint32_t reserved;
+    // Amount for balance and issue_money; amount and terminal, high and low
+    // 32 bits, for statement_entry; zero otherwise.
+    std::uint64_t argument;
+};
+
+static_assert(sizeof(display_command) == 16, "display_command must stay 16 bytes");
+static_assert(std::is_trivially_copyable<display_command>::value, "display_command must be trivially copyable");
+
+inline display_command encode(display_enter_card const &) { return {display_op::enter_card, 0, 0}; }
+inline display_command encode(display_enter_pin const &) { return {display_op::enter_pin, 0, 0}; }
+inline display_command encode(display_withdrawal_options const &) { return {display_op::withdrawal_options, 0, 0}; }
+inline display_command encode(display_balance const & msg) { return {display_op::balance, 0, msg.amount}; }
+inline display_command encode(display_insufficient_funds const &) { return {display_op::insufficient_funds, 0, 0}; }
+inline display_command encode(display_withdrawal_cancelled const &) { return {display_op::withdrawal_cancelled, 0, 0}; }
+inline display_command encode(display_pin_incorrect_message const &) { return {display_op::pin_incorrect, 0, 0}; }
+inline display_command encode(issue_money const & msg) { return {display_op::issue_money, 0, msg.amount}; }
+inline display_command encode(eject_card const &) { return {display_op::eject_card, 0, 0}; }
+inline display_command encode(display_bank_busy const &) { return {display_op::bank_busy, 0, 0}; }
+inline display_command encode(display_statement_entry const & msg)
+{
+    return {display_op::statement_entry, 0, std::uint64_t{static_cast<std::uint32_t>(msg.amount)} << 32 | msg.terminal};
+}
+
+
+// Single-producer, single-consumer link carrying display_commands without
+// allocation or type dispatch. The consumer sleeps on a futex when the ring
+// is empty; the producer only makes a system call when it sees it asleep.
+class display_channel
+{
+public:
+    static std::size_t constexpr capacity = 1024;
+
+    display_channel() = default;
+
+    display_channel(display_channel const &) = delete;
+    display_channel & operator=(display_channel const &) = delete;
+
+    // Producer only. Yields while the ring is full.
+    void push(display_command const & cmd)
+    {
+        while (not ring_.try_push(cmd))
+        {
+            std::this_thread::yield();
+        }
+        // Pairs with the fence in pop(): either the consumer sees the command
+        // or this sees the consumer asleep.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // Only the first push after the consumer went to sleep pays for the
+        // wake-up; the rest see the flag already cleared.
+        if (sleeping_.load(std::memory_order_relaxed)
+            and sleeping_.exchange(false, std::memory_order_relaxed))
+        {
+            signal();
+        }
+    }
+
+    // Consumer only. Blocks until at least one command is available, then
+    // pops up to max. Returns 0 once the channel is closed and drained.
+    std::size_t pop(display_command * out, std::size_t max)
+    {
+        while (true)
+        {
+            // Spin briefly first: a producer mid-burst is cheaper to wait for
+            // than to have it wake us with a system call per command.
+            for (int i = 0; i < 256; ++i)
+            {
+                if (std::size_t const n = ring_.try_pop(out, max))
+                {
+                    return n;
+                }
+                cpu_relax();
+            }
+            std::uint32_t const seq = seq_.load(std::memory_order_acquire);
+            sleeping_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ring_.empty())
+            {
+                if (closed_.load(std::memory_order_acquire))
+                {
+                    sleeping_.store(false, std::memory_order_relaxed);
+                    return 0;
+                }
+                futex_wait(seq_, seq);
+            }
+            sleeping_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // Any thread. The consumer returns from pop() with 0 once it has drained
+    // what is already in the ring.
+    void close()
+    {
+        closed_.store(true, std::memory_order_release);
+        signal();
+    }
+
+    std::size_t size() const
+    {
+        return ring_.size();
+    }
+
+private:
+    void signal()
+    {
+        seq_.fetch_add(1, std::memory_order_release);
+        futex_wake(seq_);
+    }
+
+    spsc_ring<display_command, capacity> ring_;
+    std::atomic<std::uint32_t> seq_{0};
+    std::atomic<bool> sleeping_{false};
+    std::atomic<bool> closed_{false};
+};
+
+
+// Which bank shard owns which accounts: a consistent-hash ring on which each
+// shard has points_per_shard points, each owning the range of account hashes
+// that ends at it. A new shard's points split ranges off their neighbours,
+// so adding one moves only those ranges. Tables are immutable; every change
+// is a new version published by the shard_router.
+struct routing_table
+{
+    // `from` of a range that is not moving.
+    static std::uint32_t constexpr settled = std::numeric_limits<std::uint32_t>::max();
+
+    struct point
+    {
+        std::uint64_t hash;
+        std::uint32_t owner;
+        // Shard the range is moving away from, or settled.
+        std::uint32_t from;
+    };
+
+    std::uint32_t version = 0;
+    // Some range is moving.
+    bool moving = false;
+    // Sorted by hash.
+    std::vector<point> points;
+    mutable std::vector<sender> shards;
+    // Read replicas of each shard; see replica_machine.
+    mutable std::vector<std::vector<sender> > replicas;
+
+    // The point whose range holds `hash`: the first at or after it,
+    // wrapping round to the first point.
+    point const & at(std::uint64_t hash) const
+    {
+        auto const i = std::lower_bound(
+              points.begin(), points.end(), hash
+            , [](point const & p, std::uint64_t h) { return p.hash < h; });
+        return i == points.end() ? points.front() : *i;
+    }
+
+    point const & find(std::string const & account) const
+    {
+        return at(mix(std::hash<std::string>{}(account)));
+    }
+
+    // splitmix64's finaliser; spreads account hashes and point numbers
+    // evenly over the ring.
+    static std::uint64_t mix(std::uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+};
+
+// Asks a bank to ship every account in the ranges that the routing table of
+// `version` moves away from it, then to answer `coordinator`.
+struct rebalance
+{
+    std::uint32_t version;
+    mutable sender coordinator;
+};
+
+// Sent by the shard taking over a source's ranges once it has applied them,
+// so that the settled table is never published ahead of the accounts.
+struct rebalance_done
+{
+    // The source.
+    std::uint32_t shard;
+    // Accounts shipped.
+    std::uint64_t accounts;
+};
+
+// Owns the routing tables. atms and banks read the current one without
+// locks; add_shard() moves ranges while they keep running:
+//
+//   1. publishes a table giving the ranges to the new shard and marking
+//      them as moving, so senders route to the new shard from then on;
+//   2. sends rebalance to each shard losing ranges, which ships their
+//      accounts to the new one and forwards whatever still reaches it for
+//      them, while the new shard holds such messages back until their
+//      range has arrived;
+//   3. once the new shard has applied every source's last handoff, publishes
+//      the settled table.
+class shard_router
+{
+public:
+    static unsigned constexpr points_per_shard = 64;
+
+    explicit shard_router(std::vector<sender> const & shards)
+    {
+        current_.version = 1;
+        for (auto const & s : shards)
+        {
+            add_points(current_, s);
+        }
+        table_.publish(std::unique_ptr<routing_table const>{new routing_table{current_}});
+    }
+
+    shard_router(shard_router const &) = delete;
+    shard_router & operator=(shard_router const &) = delete;
+
+    rcu_cell<routing_table> & table()
+    {
+        return table_;
+    }
+
+    // A copy of the latest table.
+    routing_table current() const
+    {
+        std::lock_guard<std::mutex> lock{m_};
+        return current_;
+    }
+
+    // Lets get_balance for `shard`'s accounts go to `replica`, which must
+    // already be running.
+    void add_replica(std::uint32_t shard, sender replica)
+    {
+        std::lock_guard<std::mutex> rebalancing{rebalance_m_};
+        routing_table next = current();
+        ++next.version;
+        next.replicas.at(shard).push_back(replica);
+        publish(next);
+    }
+
+    // Adds a shard, whose bank must already be running and have joined as
+    // shard current().shards.size(), and returns once its ranges have
+    // arrived there; returns how many accounts moved. Rebalances run one at
+    // a time, but no message ever waits for one.
+    std::uint64_t add_shard(sender shard)
+    {
+        std::lock_guard<std::mutex> rebalancing{rebalance_m_};
+        routing_table next = current();
+        ++next.version;
+        next.moving = true;
+        auto const index = add_points(next, shard);
+        std::vector<std::uint32_t> sources;
+        for (auto & p : next.points)
+        {
+            if (p.owner == index)
+            {
+                // The range used to belong to whoever owned the hash before.
+                p.from = current_.at(p.hash).owner;
+                if (std::find(sources.begin(), sources.end(), p.from) == sources.end())
+                {
+                    sources.push_back(p.from);
+                }
+            }
+        }
+        publish(next);
+
+        for (auto const s : sources)
+        {
+            next.shards[s].send(rebalance{next.version, done_});
+        }
+        std::uint64_t moved = 0;
+        for (std::size_t n = 0; n < sources.size(); ++n)
+        {
+            done_.wait()
+                .handle<rebalance_done>(
+                    [&](rebalance_done const & msg)
+                    {
+                        moved += msg.accounts;
+                    });
+        }
+
+        ++next.version;
+        next.moving = false;
+        for (auto & p : next.points)
+        {
+            p.from = routing_table::settled;
+        }
+        publish(next);
+        return moved;
+    }
+
+private:
+    // Gives `shard` its points; returns its index.
+    static std::uint32_t add_points(routing_table & table, sender shard)
+    {
+        auto const index = static_cast<std::uint32_t>(table.shards.size());
+        table.shards.push_back(shard);
+        table.replicas.emplace_back();
+        for (unsigned i = 0; i < points_per_shard; ++i)
+        {
+            std::uint64_t const id = std::uint64_t{index} * points_per_shard + i;
+            table.points.push_back(routing_table::point{routing_table::mix(id), index, routing_table::settled});
+        }
+        std::sort(
+              table.points.begin(), table.points.end()
+            , [](routing_table::point const & a, routing_table::point const & b) { return a.hash < b.hash; });
+        return index;
+    }
+
+    void publish(routing_table const & next)
+    {
+        {
+            std::lock_guard<std::mutex> lock{m_};
+            current_ = next;
+        }
+        table_.publish(std::unique_ptr<routing_table const>{new routing_table{next}});
+    }
+
+    rcu_cell<routing_table> table_;
+    mutable std::mutex m_;
+    routing_table current_;
+    std::mutex rebalance_m_;
+    receiver done_;
+};
+
+
+// The atm's end of its link to the interface: a display_channel when one is
+// given, otherwise an ordinary sender, which is what simulated, run-loop and
+// fiber-scheduled actors use.
+class display_link
+{
+public:
+    display_link(sender s)
+        : sender_{s}
+    {
+    }
+
+    display_link(display_channel & channel)
+        : channel_{&channel}
+    {
+    }
+
+    // Channel commands bypass the interface's queue, so a channel link
+    // journals them itself, as queue number `id`. A sender link leaves it to
+    // the queue (queue::journal_to).
+    void journal_to(journal_writer * writer, std::uint32_t id)
+    {
+        journal_ = writer;
+        journal_queue_ = id;
+    }
+
+    template <typename Msg_T>
+    void send(Msg_T const & msg)
+    {
+        if (channel_)
+        {
+            if (journal_)
+            {
+                journal_->record(journal_queue_, msg);
+            }
+            channel_->push(encode(msg));
+        }
+        else
+        {
+            sender_.send(msg);
+        }
+    }
+
+private:
+    sender sender_;
+    display_channel * channel_ = nullptr;
+    journal_writer * journal_ = nullptr;
+    std::uint32_t journal_queue_ = 0;
+};
+
+
+// The atm's end of its link to the banks: a single bank, or else whichever
+// shard the current routing table gives each message's account to. Each
+// message carries the version of the table it was routed by. Balance
+// queries go to the shard's read replicas in turn, if it has any and the
+// account's range is not moving. With admission control, a request that
+// is turned away is answered with bank_busy at once and never sent.
+class bank_link
+{
+public:
+    bank_link(sender bank)
+        : bank_{bank}
+    {
+    }
+
+    bank_link(shard_router & router)
+        : routes_{new rcu_cell<routing_table>::reader{router.table()}}
+    {
+    }
+
+    // Admits requests through `admission` as coming from `terminal`.
+    void limit(admission_control & admission, std::uint32_t terminal)
+    {
+        admission_ = &admission;
+        terminal_ = terminal;
+    }
+
+    template <typename Msg_T>
+    void send(Msg_T msg)
+    {
+        if (not admitted(msg))
+        {
+            return;
+        }
+        if (not routes_)
+        {
+            bank_.send(msg);
+            return;
+        }
+        auto const table = routes_->read();
+        msg.route_version = table->version;
+        table->shards[table->find(msg.account).owner].send(msg);
+    }
+
+    void send(get_balance msg)
+    {
+        if (not admitted(msg))
+        {
+            return;
+        }
+        if (not routes_)
+        {
+            bank_.send(msg);
+            return;
+        }
+        auto const table = routes_->read();
+        msg.route_version = table->version;
+        auto const & range = table->find(msg.account);
+        auto & replicas = table->replicas[range.owner];
+        if (range.from == routing_table::settled and not replicas.empty())
+        {
+            replicas[next_replica_++ % replicas.size()].send(msg);
+        }
+        else
+        {
+            table->shards[range.owner].send(msg);
+        }
+    }
+
+private:
+    template <typename Msg_T>
+    bool admitted(Msg_T const & msg)
+    {
+        if (not admission_ or admission_->admit(terminal_))
+        {
+            return true;
+        }
+        msg.atm_queue.send(bank_busy{});
+        return false;
+    }
+
+    // The commit or cancel that ends a withdrawal always goes through:
+    // the withdrawal was admitted already.
+    bool admitted(withdrawal_processed const &)
+    {
+        return true;
+    }
+
+    bool admitted(cancel_withdrawal const &)
+    {
+        return true;
+    }
+
+    sender bank_;
+    std::unique_ptr<rcu_cell<routing_table>::reader> routes_;
+    unsigned next_replica_ = 0;
+    admission_control * admission_ = nullptr;
+    std::uint32_t terminal_ = 0;
+};
+
+
+// ATM state machine
+class atm
+{
+public:
+    // Transactions shown by a mini-statement.
+    static unsigned constexpr statement_entries = 10;
+
+    // `terminal` identifies the atm in account histories and dispense
+    // records, e.g. its index in the topology.
+    atm(bank_link bank, display_link interface_hardware, std::uint32_t terminal)
+        : bank_{std::move(bank)}
+        , interface_hardware_{interface_hardware}
+        , terminal_{terminal}
+        , probe_{"atm", &incoming_.get_queue()}
+    {
+    }
+
+    void done()
+    {
+        get_sender().send(close_queue{});
+    }
+
+    void stop(stop_mode mode, queue::clock::duration timeout = queue::clock::duration::max())
+    {
+        incoming_.get_queue().stop(mode, deadline_after(timeout));
+    }
+
+    // Valid once run() has returned after stop().
+    stop_report get_stop_report() const
+    {
+        return incoming_.get_queue().get_stop_report();
+    }
+
+    void run()
+    {
+        state_ = &atm::waiting_for_card;
+        try
+        {
+            while (true)
+            {
+                // Call next function to handle state.
+                run_state();
+            }
+        }
+        catch (close_queue const &)
+        {
+        }
+        probe_.state.store("stopped", std::memory_order_relaxed);
+    }
+
+    // Runs the current state once without blocking; requires a scheduled queue.
+    // Returns true if a message was consumed or the state changed, i.e. if
+    // stepping again may make further progress.
+    bool step()
+    {
+        auto const state = state_;
+        auto const dequeued = incoming_.get_queue().dequeued();
+        try
+        {
+            run_state();
+        }
+        catch (close_queue const &)
+        {
+            probe_.state.store("stopped", std::memory_order_relaxed);
+            return false;
+        }
+        return state_ != state or incoming_.get_queue().dequeued() != dequeued;
+    }
+
+    sender get_sender()
+    {
+        // Converts receiver to sender.
+        return incoming_;
+    }
+
+    queue & get_queue()
+    {
+        return incoming_.get_queue();
+    }
+
+protected:
+    void process_withdrawal()
+    {
+        incoming_.wait()
+            .handle<withdraw_ok>(
+                [&](withdraw_ok const & msg)
+                {
+                    interface_hardware_.send(issue_money{withdrawal_amount_, terminal_});
+                    bank_.send(withdrawal_processed{account_, withdrawal_amount_, withdrawal_request_, terminal_});
+                    state_ = &atm::done_processing;
+                })
+            .handle<withdraw_denied>(
+                [&](withdraw_denied const & msg)
+                {
+                    interface_hardware_.send(display_insufficient_funds{});
+                    state_ = &atm::done_processing;
+                })
+            .handle<bank_busy>(
+                [&](bank_busy const &)
+                {
+                    interface_hardware_.send(display_bank_busy{});
+                    state_ = &atm::done_processing;
+                })
+            .handle<cancel_pressed>(
+                [&](cancel_pressed const & msg)
+                {
+                    bank_.send(cancel_withdrawal{account_, withdrawal_amount_, withdrawal_request_});
+                    interface_hardware_.send(display_withdrawal_cancelled{});
+                    state_ = &atm::done_processing;
+                })
+            ;
+    }
+
+    void process_balance()
+    {
+        incoming_.wait()
+            .handle<balance>(
+                [&](balance const & msg)
+                {
+                    interface_hardware_.send(display_balance{msg.amount});
+                    state_ = &atm::wait_for_action;
+                })
+            .handle<bank_busy>(
+                [&](bank_busy const &)
+                {
+                    interface_hardware_.send(display_bank_busy{});
+                    state_ = &atm::wait_for_action;
+                })
+            .handle<cancel_pressed>(
+                [&](cancel_pressed const & msg)
+                {
+                    state_ = &atm::done_processing;
+                })
+            ;
+    }
+
+    // Shows each entry as its chunk arrives; the bank keeps serving other
+    // requests between chunks.
+    void process_statement()
+    {
+        incoming_.wait()
+            .handle<statement_chunk>(
+                [&](statement_chunk const & msg)
+                {
+                    for (unsigned i = 0; i < msg.count; ++i)
+                    {
+                        interface_hardware_.send(display_statement_entry{msg.entries[i].amount, msg.entries[i].terminal});
+                    }
+                    if (msg.last)
+                    {
+                        state_ = &atm::wait_for_action;
+                    }
+                })
+            .handle<bank_busy>(
+                [&](bank_busy const &)
+                {
+                    interface_hardware_.send(display_bank_busy{});
+                    state_ = &atm::wait_for_action;
+                })
+            .handle<cancel_pressed>(
+                [&](cancel_pressed const &)
+                {
+                    state_ = &atm::done_processing;
+                })
+            ;
+    }
+
+    void wait_for_action()
+    {
+        if (entering_)
+        {
+            interface_hardware_.send(display_withdrawal_options{});
+        }
+        incoming_.wait()
+            .handle<withdraw_pressed>(
+                [&](withdraw_pressed const & msg)
+                {
+                    withdrawal_amount_ = msg.amount;
+                    withdrawal_request_ = incoming_.get_queue().next_request_id();
+                    bank_.send(withdraw{account_, msg.amount, incoming_, withdrawal_request_, terminal_});
+                    state_ = &atm::process_withdrawal;
+                })
+            .handle<balance_pressed>(
+                [&](balance_pressed const & msg)
+                {
+                    bank_.send(get_balance{account_, incoming_});
+                    state_ = &atm::process_balance;
+                })
+            .handle<statement_pressed>(
+                [&](statement_pressed const &)
+                {
+                    bank_.send(get_statement{account_, statement_entries, incoming_});
+                    state_ = &atm::process_statement;
+                })
+            .handle<cancel_pressed>(
+                [&](cancel_pressed const & msg)
+                {
+                    state_ = &atm::done_processing;
+                })
+            ;
+    }
+
+    void verifying_pin()
+    {
+        incoming_.wait()
+            .handle<pin_verified>(
+                [&](pin_verified const & msg)
+                {
+                    state_ = &atm::wait_for_action;
+                })
+            .handle<pin_incorrect>(
+                [&](pin_incorrect const & msg)
+                {
+                    interface_hardware_.send(display_pin_incorrect_message{});
+                    state_ = &atm::done_processing;
+                })
+            .handle<bank_busy>(
+                [&](bank_busy const &)
+                {
+                    interface_hardware_.send(display_bank_busy{});
+                    state_ = &atm::done_processing;
+                })
+            .handle<cancel_pressed>(
+                [&](cancel_pressed const & msg)
+                {
+                    state_ = &atm::done_processing;
+                })
+            ;
+    }
+
+    void getting_pin()
+    {
+        incoming_.wait()
+            .handle<digit_pressed>(
+                [&](digit_pressed const & msg)
+                {
+                    unsigned const pin_length = 4;
+                    pin_ += msg.digit;
+                    if (pin_.length() == pin_length)
+                    {
+                        bank_.send(verify_pin{account_, pin_, incoming_});
+                        state_ = &atm::verifying_pin;
+                    }
+                })
+            .handle<clear_last_pressed>(
+                [&](clear_last_pressed const & msg)
+                {
+                    if (not pin_.empty())
+                    {
+                        pin_.pop_back();
+                    }
+                })
+            .handle<cancel_pressed>(
+                [&](cancel_pressed const & msg)
+                {
+                    state_ = &atm::done_processing;
+                })
+            ;
+    }
+
+    void waiting_for_card()
+    {
+        if (entering_)
+        {
+            interface_hardware_.send(display_enter_card{});
+        }
+        incoming_.wait()
+            .handle<card_inserted>(
+                [&](card_inserted const & msg)
+                {
+                    account_ = msg.account;
+                    pin_ = "";
+                    interface_hardware_.send(display_enter_pin{});
+                    state_ = &atm::getting_pin;
+                })
+            ;
+    }
+
+    void done_processing()
+    {
+        interface_hardware_.send(eject_card{});
+        state_ = &atm::waiting_for_card;
+    }
+
+    void run_state()
+    {
+        // Entry actions only run on the first call after a transition, so a
+        // step() that finds no message does not repeat them.
+        entering_ = state_ != previous_state_;
+        previous_state_ = state_;
+        probe_.state.store(state_name(state_), std::memory_order_relaxed);
+        (this->*state_)();
+    }
+
+    static char const * state_name(void (atm::*state)())
+    {
+        if (state == &atm::waiting_for_card) return "waiting_for_card";
+        if (state == &atm::getting_pin) return "getting_pin";
+        if (state == &atm::verifying_pin) return "verifying_pin";
+        if (state == &atm::wait_for_action) return "wait_for_action";
+        if (state == &atm::process_withdrawal) return "process_withdrawal";
+        if (state == &atm::process_balance) return "process_balance";
+        if (state == &atm::process_statement) return "process_statement";
+        if (state == &atm::done_processing) return "done_processing";
+        return "unknown";
+    }
+
+    atm(atm const &) = delete;
+    atm & operator=(atm const &) = delete;
+
+private:
+    receiver incoming_;
+
+    // Bank to send messages as represents authority/backend storage of account data.
+    bank_link bank_;
+
+    // Hardware device that handles the display and mechanical actions.
+    display_link interface_hardware_;
+
+    std::uint32_t const terminal_;
+
+    // Function pointer to track state, called by run() and changed in message handlers.
+    void (atm::*state_)() = &atm::waiting_for_card;
+
+    // State that last ran and whether the current call is its first.
+    void (atm::*previous_state_)() = nullptr;
+    bool entering_ = true;
+
+    std::string account_;
+    unsigned withdrawal_amount_ = 0;
+    // ID of the withdrawal in progress, reused if it is ever resent.
+    std::uint64_t withdrawal_request_ = 0;
+
+    // Currently entered PIN.
+    std::string pin_;
+
+    // Published state for introspection.
+    actor_probe probe_;
+};
+
+
+// Live PINs by account, shared by every bank and replaced as a whole when
+// the card data is reloaded.
+using pin_table = account_table<std::string>;
+
+
+// Withdrawals are two-phase. withdraw places a hold on the funds and answers
+// at once; withdrawal_processed commits the hold and cancel_withdrawal
+// releases it. A hold neither committed nor cancelled within the hold
+// timeout, e.g. because its atm died, is released; a commit arriving after
+// that still goes through if the funds are there. Commits are queued and applied in groups
+// whenever the bank's queue runs dry, or max_commit_batch are pending. Each
+// group is one pass over the account table and, if a write-ahead log is
+// given, one write to it and one fdatasync, made before the bank handles
+// anything else. A bank whose log fails stops.
+//
+// take_snapshot copies snapshot_slice accounts at a time into a
+// snapshot_writer, between other messages, so the bank never pauses for the
+// whole table. A snapshot plus the WAL after it rebuild the committed
+// balances; see load_snapshot() and replay_wal().
+//
+// A bank that has joined a shard_router serves only the accounts the
+// current routing table gives its shard. Anything else is forwarded to the
+// owner, and messages for a range that is still on its way here wait until
+// it arrives, then rejoin the queue in their original order. rebalance
+// ships a range's accounts and holds the same way snapshots are taken, a
+// slice at a time.
+//
+// With a sojourn_controller, balance and statement queries are answered
+// bank_busy while the queue stands too long, so withdrawals keep moving.
+class bank_machine
+{
+public:
+    static std::size_t constexpr max_commit_batch = 256;
+    // Bytes of hold and release lines kept back for a commit group to carry.
+    static std::size_t constexpr max_wal_notes = 1 << 16;
+    static std::size_t constexpr snapshot_slice = 1024;
+    // PIN of accounts that were not loaded.
+    static constexpr char const * default_pin = "1937";
+
+    struct account
+    {
+        // Committed balance.
+        unsigned balance = 199; // Default to random amount.
+        // Sum of uncommitted holds.
+        unsigned held = 0;
+        std::string pin = default_pin;
+        // Committed transactions.
+        account_history history;
+
+        unsigned available() const
+        {
+            return balance - held;
+        }
+    };
+
+    // `wal_fd`, if not -1, receives one line per commit:
+    // "commit <request_id> <account> <amount> <balance after>". For read
+    // replicas it also gets "hold <request_id> <account> <amount>" when
+    // funds are held and "release ..." when a hold is let go uncommitted;
+    // these are not synced and recovery skips them.
+    explicit bank_machine(int wal_fd = -1)
+        : wal_fd_{wal_fd}
+        , expired_{1024}
+        , probe_{"bank", &incoming_.get_queue()}
+    {
+        if (wal_fd_ >= 0)
+        {
+            off_t const end = ::lseek(wal_fd_, 0, SEEK_END);
+            wal_offset_ = end > 0 ? static_cast<std::uint64_t>(end) : 0;
+        }
+    }
+
+    void done()
+    {
+        get_sender().send(close_queue{});
+    }
+
+    void stop(stop_mode mode, queue::clock::duration timeout = queue::clock::duration::max())
+    {
+        incoming_.get_queue().stop(mode, deadline_after(timeout));
+    }
+
+    // Valid once run() has returned after stop().
+    stop_report get_stop_report() const
+    {
+        return incoming_.get_queue().get_stop_report();
+    }
+
+    void run()
+    {
+        probe_.state.store("running", std::memory_order_relaxed);
+        try
+        {
+            try
+            {
+                while (true)
+                {
+                    handle_next();
+                }
+            }
+            catch (close_queue const &)
+            {
+            }
+            commit_pending();
+        }
+        catch (std::system_error const & e)
+        {
+            fail(e);
+            return;
+        }
+        probe_.state.store("stopped", std::memory_order_relaxed);
+    }
+
+    // Handles at most one message without blocking; requires a scheduled queue.
+    // Returns true if a message was consumed.
+    bool step()
+    {
+        auto const dequeued = incoming_.get_queue().dequeued();
+        try
+        {
+            try
+            {
+                handle_next();
+            }
+            catch (close_queue const &)
+            {
+                commit_pending();
+                probe_.state.store("stopped", std::memory_order_relaxed);
+                return false;
+            }
+        }
+        catch (std::system_error const & e)
+        {
+            fail(e);
+            return false;
+        }
+        return incoming_.get_queue().dequeued() != dequeued;
+    }
+
+    // True once the bank has stopped because its WAL could not be written.
+    // Only valid while the bank is not running.
+    bool failed() const
+    {
+        return failed_;
+    }
+
+    sender get_sender()
+    {
+        return incoming_;
+    }
+
+    queue & get_queue()
+    {
+        return incoming_.get_queue();
+    }
+
+    // Replaces the account table, e.g. with one from load_accounts(). Call
+    // before run(). Accounts not in the table still open on first use with
+    // the defaults, unless reject_unknown_accounts() is called.
+    void load(account_table<account> accounts)
+    {
+        accounts_ = std::move(accounts);
+    }
+
+    // Treats the account table as the full list of accounts, e.g. once an
+    // export has been loaded: an unknown account fails PIN checks, is
+    // denied withdrawals and has no balance. Call before run().
+    void reject_unknown_accounts()
+    {
+        known_accounts_only_ = true;
+    }
+
+    // Checks PINs against whatever version of `pins` is current instead of
+    // the PINs in the account table; an account missing from it has no
+    // valid PIN. Call before run().
+    void use_pins(rcu_cell<pin_table> & pins)
+    {
+        pins_.reset(new rcu_cell<pin_table>::reader{pins});
+    }
+
+    // Serves the accounts `router` gives shard `index`. Call before run().
+    void join_shards(shard_router & router, std::uint32_t index)
+    {
+        routes_.reset(new rcu_cell<routing_table>::reader{router.table()});
+        shard_ = index;
+    }
+
+    // Releases holds that are neither committed nor cancelled within
+    // `timeout`. Call before run().
+    void expire_holds_after(std::chrono::steady_clock::duration timeout)
+    {
+        hold_timeout_ = timeout;
+    }
+
+    // Sheds low-priority requests once messages wait longer than `target`
+    // for a whole `interval`; see sojourn_controller. Call before run().
+    void manage_queue(sojourn_controller::clock::duration target, sojourn_controller::clock::duration interval)
+    {
+        aqm_.reset(new sojourn_controller{target, interval});
+        incoming_.get_queue().manage(aqm_.get());
+    }
+
+    // Requests shed so far.
+    std::uint64_t shed() const
+    {
+        return aqm_ ? aqm_->shed_total() : 0;
+    }
+
+    // Messages passed on to the shard that owns their account. Only valid
+    // while the bank is not running.
+    std::uint64_t forwarded() const
+    {
+        return forwarded_;
+    }
+
+private:
+
+    // Position in a statement being streamed; history is append-only, so
+    // the indexes stay valid between chunks.
+    struct statement_cursor
+    {
+        std::string account;
+        std::size_t next;
+        std::size_t end;
+        mutable sender atm_queue;
+        std::uint32_t route_version;
+    };
+
+    // Continuation of a snapshot in progress.
+    struct snapshot_continue
+    {
+    };
+
+    // Continuation of a rebalance in progress.
+    struct migration_continue
+    {
+    };
+
+    struct hold
+    {
+        std::string account;
+        unsigned amount;
+        std::uint32_t terminal;
+        // Queued in commits_; a repeated commit or a late cancel is ignored.
+        bool committing;
+        std::chrono::steady_clock::time_point placed;
+    };
+
+    // Accounts, and holds on them, moving to another shard. The last one
+    // from a source lists the ranges that are then complete, and once it has
+    // been applied the receiver answers `coordinator` for the source.
+    struct shard_handoff
+    {
+        std::uint32_t version;
+        // Shared, so queueing the message copies no accounts.
+        std::shared_ptr<std::vector<std::pair<std::string, account> > > accounts;
+        std::vector<std::pair<std::uint64_t, hold> > holds;
+        std::vector<std::uint64_t> ranges;
+        // Last handoff only.
+        mutable sender coordinator;
+        std::uint32_t source = 0;
+        // Accounts the source shipped to this shard in all.
+        std::uint64_t shipped = 0;
+    };
+
+    // A rebalance this bank is shipping accounts for.
+    struct migration
+    {
+        std::uint32_t version;
+        sender coordinator;
+        std::size_t part;
+        std::size_t buckets;
+        account_table<account>::partition_type::iterator at;
+        // Accounts shipped, by destination shard.
+        std::unordered_map<std::uint32_t, std::uint64_t> shipped;
+        // Not yet sent, by destination shard.
+        std::unordered_map<std::uint32_t, shard_handoff> out;
+    };
+
+    void handle_next()
+    {
+        incoming_.wait()
+            .handle<verify_pin>(
+                [&](verify_pin const & msg)
+                {
+                    if (not owns(msg))
+                    {
+                        return;
+                    }
+                    if (pin_matches(msg.account, msg.pin))
+                    {
+                        msg.atm_queue.send(pin_verified{});
+                    }
+                    else
+                    {
+                        msg.atm_queue.send(pin_incorrect{});
+                    }
+                })
+            .handle<withdraw>(
+                [&](withdraw const & msg)
+                {
+                    if (not owns(msg))
+                    {
+                        return;
+                    }
+                    auto const now = incoming_.get_queue().now();
+                    expire_holds(now);
+                    if (bool const * ok = withdrawals_.find(msg.request_id, now))
+                    {
+                        // A retry: repeat the original answer only.
+                        reply_withdraw(msg, *ok);
+                        return;
+                    }
+                    if (msg.request_id != 0 and holds_.count(msg.request_id) != 0)
+                    {
+                        // A retry that outlived its dedup entry, or one that
+                        // followed the account here: the hold, committing or
+                        // not, is the original answer.
+                        reply_withdraw(msg, true);
+                        return;
+                    }
+                    account * const acc = open_account(msg.account);
+                    bool const ok = acc and acc->available() >= msg.amount;
+                    if (ok)
+                    {
+                        if (msg.request_id != 0)
+                        {
+                            acc->held += msg.amount;
+                            holds_[msg.request_id] = hold{msg.account, msg.amount, msg.terminal, false, now};
+                            note_hold("hold", msg.request_id, holds_[msg.request_id]);
+                        }
+                        else
+                        {
+                            // No ID to commit against: debit at once.
+                            acc->balance -= msg.amount;
+                            acc->history.append(now_ms(), -static_cast<std::int32_t>(msg.amount), msg.terminal);
+                        }
+                    }
+                    withdrawals_.insert(msg.request_id, ok, now);
+                    reply_withdraw(msg, ok);
+                })
+            .handle<get_balance>(
+                [&](get_balance const & msg)
+                {
+                    if (not owns(msg) or shedding(msg))
+                    {
+                        return;
+                    }
+                    expire_holds(incoming_.get_queue().now());
+                    account const * const acc = open_account(msg.account);
+                    msg.atm_queue.send(balance{acc ? acc->available() : 0});
+                })
+            .handle<get_statement>(
+                [&](get_statement const & msg)
+                {
+                    if (not owns(msg) or shedding(msg))
+                    {
+                        return;
+                    }
+                    std::size_t end = 0;
+                    if (account const * a = accounts_.find(msg.account))
+                    {
+                        end = a->history.size();
+                    }
+                    std::size_t const first = end - std::min<std::size_t>(end, msg.entries);
+                    send_statement(statement_cursor{msg.account, first, end, msg.atm_queue, msg.route_version});
+                })
+            .handle<statement_cursor>(
+                [&](statement_cursor const & msg)
+                {
+                    if (not owns(msg))
+                    {
+                        return;
+                    }
+                    send_statement(msg);
+                })
+            .handle<withdrawal_processed>(
+                [&](withdrawal_processed const & msg)
+                {
+                    if (not owns(msg))
+                    {
+                        return;
+                    }
+                    auto const h = holds_.find(msg.request_id);
+                    if (h != holds_.end() and not h->second.committing)
+                    {
+                        h->second.committing = true;
+                        commits_.push_back(msg.request_id);
+                    }
+                    else if (h == holds_.end())
+                    {
+                        commit_expired(msg);
+                    }
+                })
+            .handle<cancel_withdrawal>(
+                [&](cancel_withdrawal const & msg)
+                {
+                    if (not owns(msg))
+                    {
+                        return;
+                    }
+                    auto const h = holds_.find(msg.request_id);
+                    if (h != holds_.end() and not h->second.committing)
+                    {
+                        accounts_[h->second.account].held -= h->second.amount;
+                        note_hold("release", h->first, h->second);
+                        holds_.erase(h);
+                    }
+                })
+            .handle<take_snapshot>(
+                [&](take_snapshot const & msg)
+                {
+                    start_snapshot(msg.path);
+                })
+            .handle<snapshot_continue>(
+                [&](snapshot_continue const &)
+                {
+                    continue_snapshot();
+                })
+            .handle<rebalance>(
+                [&](rebalance const & msg)
+                {
+                    start_migration(msg);
+                })
+            .handle<migration_continue>(
+                [&](migration_continue const &)
+                {
+                    continue_migration();
+                })
+            .handle<shard_handoff>(
+                [&](shard_handoff const & msg)
+                {
+                    accept_handoff(msg);
+                })
+            ;
+
+        if (not commits_.empty()
+            and (commits_.size() >= max_commit_batch or incoming_.get_queue().size() == 0))
+        {
+            commit_pending();
+        }
+        else if (not wal_notes_.empty()
+            and (wal_notes_.size() >= max_wal_notes or incoming_.get_queue().size() == 0))
+        {
+            write_wal(wal_notes_, false);
+            wal_notes_.clear();
+        }
+    }
+
+    // True if this shard is to handle `msg` now. Otherwise it has been
+    // forwarded to the owner of its account, or, if that is this shard but
+    // the account's range has not arrived yet, kept to be requeued when it
+    // does.
+    template <typename Msg_T>
+    bool owns(Msg_T const & msg)
+    {
+        if (not routes_)
+        {
+            return true;
+        }
+        auto const table = routes_->read();
+        if (msg.route_version == table->version and not table->moving)
+        {
+            // Routed by this very table, which moves nothing.
+            return true;
+        }
+        auto const & range = table->find(msg.account);
+        if (range.owner != shard_)
+        {
+            // Routed by an older table, or its range is moving away.
+            Msg_T next = msg;
+            next.route_version = table->version;
+            table->shards[range.owner].send(next);
+            ++forwarded_;
+            return false;
+        }
+        if (range.from != routing_table::settled)
+        {
+            auto const arrived = arrived_.find(range.hash);
+            if (arrived == arrived_.end() or arrived->second != table->version)
+            {
+                inbound_[range.hash].add(msg);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // True if the queue stands too long to serve the low-priority request
+    // `msg`, which has then been answered bank_busy.
+    template <typename Msg_T>
+    bool shedding(Msg_T const & msg)
+    {
+        if (not aqm_ or not aqm_->shed())
+        {
+            return false;
+        }
+        msg.atm_queue.send(bank_busy{});
+        return true;
+    }
+
+    // Releases every hold placed more than hold_timeout_ ago that is not
+    // being committed. Sweeps at most every hold_timeout_ / 8, so holds
+    // last between one and one and an eighth timeouts.
+    void expire_holds(std::chrono::steady_clock::time_point now)
+    {
+        if (holds_.empty() or now < next_expiry_)
+        {
+            return;
+        }
+        next_expiry_ = now + hold_timeout_ / 8;
+        for (auto h = holds_.begin(); h != holds_.end();)
+        {
+            if (h->second.committing or now - h->second.placed < hold_timeout_)
+            {
+                ++h;
+                continue;
+            }
+            std::cerr << "bank: released hold " << h->first << " of " << h->second.amount << " on "
+                      << h->second.account << ", neither committed nor cancelled" << std::endl;
+            accounts_[h->second.account].held -= h->second.amount;
+            note_hold("release", h->first, h->second);
+            expired_.insert(h->first, h->second, now);
+            h = holds_.erase(h);
+        }
+    }
+
+    // A commit whose hold expired: the cash is out, so the debit is made
+    // if the funds are still there, or else reported.
+    void commit_expired(withdrawal_processed const & msg)
+    {
+        auto const now = incoming_.get_queue().now();
+        hold const * expired = expired_.find(msg.request_id, now);
+        if (not expired or expired->committing)
+        {
+            // Committed already, or never held.
+            return;
+        }
+        auto & acc = accounts_[expired->account];
+        if (acc.available() < expired->amount)
+        {
+            std::cerr << "bank: late commit " << msg.request_id << " of " << expired->amount << " on "
+                      << expired->account << " exceeds the available " << acc.available() << std::endl;
+            return;
+        }
+        hold late = *expired;
+        late.committing = true;
+        late.placed = now;
+        acc.held += late.amount;
+        holds_[msg.request_id] = late;
+        commits_.push_back(msg.request_id);
+        expired_.insert(msg.request_id, late, now);
+    }
+
+    // Reports a WAL failure and stops: what the bank applies would no
+    // longer be logged, and a restart would forget it. Queued and later
+    // messages are dropped.
+    void fail(std::system_error const & e)
+    {
+        std::cerr << "bank: " << e.what() << "; stopping" << std::endl;
+        failed_ = true;
+        incoming_.get_queue().stop(stop_mode::immediate);
+        probe_.state.store("failed", std::memory_order_relaxed);
+    }
+
+    bool pin_matches(std::string const & id, std::string const & pin)
+    {
+        if (pins_)
+        {
+            // The version read here stays valid until the guard goes, even
+            // if a reload publishes a new one meanwhile.
+            auto const pins = pins_->read();
+            if (pins.get())
+            {
+                std::string const * live = pins->find(id);
+                return live and pin == *live;
+            }
+        }
+        account const * a = accounts_.find(id);
+        return a ? pin == a->pin : not known_accounts_only_ and pin == default_pin;
+    }
+
+    // Opens an unknown account with the defaults, unless only known
+    // accounts are served; then returns null for it.
+    account * open_account(std::string const & id)
+    {
+        return known_accounts_only_ ? accounts_.find(id) : &accounts_[id];
+    }
+
+    // Logs, then applies, every queued commit.
+    void commit_pending()
+    {
+        if (commits_.empty())
+        {
+            return;
+        }
+
+        // Balances change first, so each line can carry the balance after
+        // its commit, and change back if the WAL write fails; the error then
+        // stops the bank before it answers anything else. Hold lines still
+        // pending go first.
+        wal_buffer_.clear();
+        wal_buffer_.swap(wal_notes_);
+        for (auto const id : commits_)
+        {
+            auto const & h = holds_.at(id);
+            auto & acc = accounts_[h.account];
+            acc.held -= h.amount;
+            acc.balance -= h.amount;
+            if (wal_fd_ >= 0)
+            {
+                wal_buffer_ += "commit ";
+                wal_buffer_ += std::to_string(id);
+                wal_buffer_ += ' ';
+                wal_buffer_ += h.account;
+                wal_buffer_ += ' ';
+                wal_buffer_ += std::to_string(h.amount);
+                wal_buffer_ += ' ';
+                wal_buffer_ += std::to_string(acc.balance);
+                wal_buffer_ += '\n';
+            }
+        }
+        if (wal_fd_ >= 0)
+        {
+            try
+            {
+                write_wal(wal_buffer_);
+            }
+            catch (std::system_error const &)
+            {
+                for (auto const id : commits_)
+                {
+                    auto const & h = holds_.at(id);
+                    auto & acc = accounts_[h.account];
+                    acc.held += h.amount;
+                    acc.balance += h.amount;
+                }
+                throw;
+            }
+        }
+
+        auto const time_ms = now_ms();
+        for (auto const id : commits_)
+        {
+            auto const h = holds_.find(id);
+            accounts_[h->second.account].history.append(
+                time_ms, -static_cast<std::int32_t>(h->second.amount), h->second.terminal);
+            holds_.erase(h);
+        }
+        commits_.clear();
+    }
+
+    void start_snapshot(std::string const & path)
+    {
+        if (snapshot_ and snapshot_part_ < accounts_.partitions())
+        {
+            // One at a time; this one is still being taken.
+            return;
+        }
+        if (migration_)
+        {
+            // Shipping erases accounts, which would invalidate the position
+            // in the table; the next request takes it.
+            return;
+        }
+        // Everything applied so far is in the WAL before the snapshot's
+        // offset. Outside the try: a failed WAL write stops the bank.
+        commit_pending();
+        try
+        {
+            if (snapshot_)
+            {
+                // Usually long done; reports a failure of the previous one.
+                snapshot_->wait();
+            }
+            snapshot_.reset(new snapshot_writer{path, wal_offset_});
+        }
+        catch (std::system_error const & e)
+        {
+            std::cerr << "bank snapshot: " << e.what() << std::endl;
+            snapshot_.reset();
+            return;
+        }
+        snapshot_part_ = 0;
+        begin_snapshot_partition();
+        get_sender().send(snapshot_continue{});
+    }
+
+    void begin_snapshot_partition()
+    {
+        auto & part = accounts_.partition(snapshot_part_);
+        // Room for new accounts, so that none rehashes the partition, which
+        // would invalidate the position in it.
+        part.reserve(part.size() + part.size() / 4 + snapshot_slice);
+        snapshot_buckets_ = part.bucket_count();
+        snapshot_at_ = part.begin();
+    }
+
+    void continue_snapshot()
+    {
+        // Keeps commits flowing while continuations keep the queue busy.
+        commit_pending();
+        auto & part = accounts_.partition(snapshot_part_);
+        if (part.bucket_count() != snapshot_buckets_)
+        {
+            std::cerr << "bank snapshot: abandoned, too many new accounts" << std::endl;
+            snapshot_->abort();
+            snapshot_part_ = accounts_.partitions();
+            return;
+        }
+        for (std::size_t n = 0; n < snapshot_slice and snapshot_at_ != part.end(); ++n, ++snapshot_at_)
+        {
+            snapshot_->add(snapshot_at_->first, snapshot_at_->second.pin, snapshot_at_->second.balance);
+        }
+        if (snapshot_at_ == part.end())
+        {
+            if (++snapshot_part_ == accounts_.partitions())
+            {
+                snapshot_->finish();
+                return;
+            }
+            begin_snapshot_partition();
+        }
+        get_sender().send(snapshot_continue{});
+    }
+
+    void start_migration(rebalance const & msg)
+    {
+        if (snapshot_ and snapshot_part_ < accounts_.partitions())
+        {
+            // Shipping erases accounts under the snapshot's position; try
+            // again behind it.
+            get_sender().send(msg);
+            return;
+        }
+        migration_.reset(new migration{msg.version, msg.coordinator, 0, 0, {}, {}, {}});
+        begin_migration_partition();
+        get_sender().send(migration_continue{});
+    }
+
+    void begin_migration_partition()
+    {
+        auto & part = accounts_.partition(migration_->part);
+        part.reserve(part.size() + part.size() / 4 + snapshot_slice);
+        migration_->buckets = part.bucket_count();
+        migration_->at = part.begin();
+    }
+
+    // Ships the moving accounts among the next slice. Everything for them
+    // is already being forwarded, so they no longer change here.
+    void continue_migration()
+    {
+        // Applies commits queued before the table changed, so each account
+        // leaves with its final balance.
+        commit_pending();
+        auto const table = routes_->read();
+        auto & part = accounts_.partition(migration_->part);
+        if (part.bucket_count() != migration_->buckets)
+        {
+            // New accounts rehashed the partition. What was shipped is gone
+            // from it, so starting it over repeats nothing.
+            begin_migration_partition();
+        }
+        auto & at = migration_->at;
+        for (std::size_t n = 0; n < snapshot_slice and at != part.end(); ++n)
+        {
+            auto const & range = table->find(at->first);
+            if (range.from == shard_ and range.owner != shard_)
+            {
+                handoff_to(range.owner).accounts->emplace_back(at->first, std::move(at->second));
+                ++migration_->shipped[range.owner];
+                at = part.erase(at);
+            }
+            else
+            {
+                ++at;
+            }
+        }
+        if (at == part.end() and migration_->part + 1 == accounts_.partitions())
+        {
+            finish_migration(*table);
+            return;
+        }
+        ship_handoffs(*table);
+        if (at == part.end())
+        {
+            ++migration_->part;
+            begin_migration_partition();
+        }
+        get_sender().send(migration_continue{});
+    }
+
+    void finish_migration(routing_table const & table)
+    {
+        // Commits and cancels for these holds are forwarded too.
+        for (auto h = holds_.begin(); h != holds_.end();)
+        {
+            auto const & range = table.find(h->second.account);
+            if (range.from == shard_ and range.owner != shard_)
+            {
+                handoff_to(range.owner).holds.push_back(*h);
+                note_hold("release", h->first, h->second);
+                h = holds_.erase(h);
+            }
+            else
+            {
+                ++h;
+            }
+        }
+        for (auto const & range : table.points)
+        {
+            if (range.from == shard_)
+            {
+                auto & h = handoff_to(range.owner);
+                h.ranges.push_back(range.hash);
+                h.coordinator = migration_->coordinator;
+                h.source = shard_;
+                h.shipped = migration_->shipped[range.owner];
+            }
+        }
+        ship_handoffs(table);
+        migration_.reset();
+    }
+
+    shard_handoff & handoff_to(std::uint32_t shard)
+    {
+        auto & h = migration_->out[shard];
+        if (not h.accounts)
+        {
+            h.version = migration_->version;
+            h.accounts = std::make_shared<std::vector<std::pair<std::string, account> > >();
+        }
+        return h;
+    }
+
+    void ship_handoffs(routing_table const & table)
+    {
+        for (auto & out : migration_->out)
+        {
+            table.shards[out.first].send(out.second);
+        }
+        migration_->out.clear();
+    }
+
+    void accept_handoff(shard_handoff const & msg)
+    {
+        wal_buffer_.clear();
+        wal_buffer_.swap(wal_notes_);
+        for (auto & a : *msg.accounts)
+        {
+            if (wal_fd_ >= 0)
+            {
+                // Amount 0 and the balance carried over: on recovery this
+                // shard's WAL then restores the account on its own.
+                wal_buffer_ += "commit 0 ";
+                wal_buffer_ += a.first;
+                wal_buffer_ += " 0 ";
+                wal_buffer_ += std::to_string(a.second.balance);
+                wal_buffer_ += '\n';
+            }
+            accounts_[a.first] = std::move(a.second);
+        }
+        for (auto const & h : msg.holds)
+        {
+            note_hold("hold", h.first, h.second);
+        }
+        wal_buffer_ += wal_notes_;
+        wal_notes_.clear();
+        if (not wal_buffer_.empty())
+        {
+            write_wal(wal_buffer_);
+        }
+        holds_.insert(msg.holds.begin(), msg.holds.end());
+        for (auto const range : msg.ranges)
+        {
+            arrived_[range] = msg.version;
+            auto const held = inbound_.find(range);
+            if (held != inbound_.end())
+            {
+                get_sender().send_batch(held->second);
+                inbound_.erase(held);
+            }
+        }
+        if (not msg.ranges.empty())
+        {
+            msg.coordinator.send(rebalance_done{msg.source, msg.shipped});
+        }
+    }
+
+    // Sends the next chunk of a statement. The rest is queued back to this
+    // bank as a continuation behind whatever else is waiting, so a long
+    // statement never holds up other requests.
+    void send_statement(statement_cursor const & cursor)
+    {
+        statement_chunk chunk;
+        std::size_t const count = std::min(cursor.end - cursor.next, statement_chunk::capacity);
+        account const * a = accounts_.find(cursor.account);
+        if (a and count != 0)
+        {
+            a->history.read(cursor.next, cursor.next + count, chunk.entries);
+        }
+        chunk.count = static_cast<unsigned>(count);
+        chunk.last = cursor.next + count == cursor.end;
+        if (not chunk.last
+            and not get_sender().send(statement_cursor{
+                cursor.account, cursor.next + count, cursor.end, cursor.atm_queue, cursor.route_version}))
+        {
+            // A stopping bank takes no continuations; the statement ends
+            // short rather than leave the atm waiting for the rest.
+            chunk.last = true;
+        }
+        cursor.atm_queue.send(chunk);
+    }
+
+    std::int64_t now_ms()
+    {
+        return incoming_.get_queue().now_ms();
+    }
+
+    // Writes and syncs one group. Throws std::system_error if the log
+    // cannot be written.
+    // Syncs unless `sync` is false, for lines that need not survive a crash.
+    void write_wal(std::string const & data, bool sync = true)
+    {
+        char const * p = data.data();
+        std::size_t left = data.size();
+        while (left != 0)
+        {
+            ssize_t const n = ::write(wal_fd_, p, left);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::system_error{errno, std::generic_category(), "write bank WAL"};
+            }
+            p += n;
+            left -= static_cast<std::size_t>(n);
+        }
+        if (sync and ::fdatasync(wal_fd_) != 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "fdatasync bank WAL"};
+        }
+        wal_offset_ += data.size();
+    }
+
+    // Logs a hold, or its release, for read replicas to follow. The line
+    // goes out with the next commit group, or when the queue runs dry.
+    void note_hold(char const * kind, std::uint64_t id, hold const & h)
+    {
+        if (wal_fd_ < 0)
+        {
+            return;
+        }
+        wal_notes_ += kind;
+        wal_notes_ += ' ';
+        wal_notes_ += std::to_string(id);
+        wal_notes_ += ' ';
+        wal_notes_ += h.account;
+        wal_notes_ += ' ';
+        wal_notes_ += std::to_string(h.amount);
+        wal_notes_ += '\n';
+    }
+
+    static void reply_withdraw(withdraw const & msg, bool ok)
+    {
+        if (ok)
+        {
+            msg.atm_queue.send(withdraw_ok{});
+        }
+        else
+        {
+            msg.atm_queue.send(withdraw_denied{});
+        }
+    }
+
+    receiver incoming_;
+    account_table<account> accounts_;
+    bool known_accounts_only_ = false;
+    // Uncommitted holds by request ID.
+    std::unordered_map<std::uint64_t, hold> holds_;
+    // Request IDs whose holds are waiting to be committed, in arrival order.
+    std::vector<std::uint64_t> commits_;
+    int wal_fd_ = -1;
+    std::string wal_buffer_;
+    // Hold and release lines not yet written.
+    std::string wal_notes_;
+    // End of the WAL, as an offset from its start.
+    std::uint64_t wal_offset_ = 0;
+    // Latest snapshot; in progress while snapshot_part_ < partitions().
+    std::unique_ptr<snapshot_writer> snapshot_;
+    std::size_t snapshot_part_ = 0;
+    std::size_t snapshot_buckets_ = 0;
+    account_table<account>::partition_type::const_iterator snapshot_at_;
+    // Outcomes of recent withdrawals by request ID. Each bank actor owns its
+    // own table, so lookups take no locks.
+    dedup_table<bool> withdrawals_;
+    std::chrono::steady_clock::duration hold_timeout_ = std::chrono::minutes{10};
+    std::chrono::steady_clock::time_point next_expiry_;
+    // Holds released by expiry, for a commit that arrives late; marked
+    // committing once that commit is queued.
+    dedup_table<hold> expired_;
+    bool failed_ = false;
+    // Registration with the live PIN table, if there is one.
+    std::unique_ptr<rcu_cell<pin_table>::reader> pins_;
+    // Registration with the routing tables, if this bank is a shard.
+    std::unique_ptr<rcu_cell<routing_table>::reader> routes_;
+    std::uint32_t shard_ = 0;
+    std::uint64_t forwarded_ = 0;
+    // Messages waiting for their range to arrive, by range.
+    std::unordered_map<std::uint64_t, message_batch> inbound_;
+    // Table version in which each range arrived here.
+    std::unordered_map<std::uint64_t, std::uint32_t> arrived_;
+    std::unique_ptr<migration> migration_;
+    // Active queue management, if enabled.
+    std::unique_ptr<sojourn_controller> aqm_;
+    actor_probe probe_;
+};
+
+
+// Renders display_commands into a batch of pre-encoded byte strings, which is
+// then written with a single writev. Fixed prompts are static; amounts are
+// formatted into a scratch buffer owned by the renderer, so rendering does no
+// allocation and takes no stream locks.
+class display_renderer
+{
+public:
+    // Commands that fit in one batch.
+    static std::size_t constexpr max_batch = 64;
+
+    display_renderer() = default;
+
+    display_renderer(display_renderer const &) = delete;
+    display_renderer & operator=(display_renderer const &) = delete;
+
+    // Appends a command. Callers write the batch at least every max_batch
+    // commands; any beyond that are dropped.
+    void add(display_command const & cmd)
+    {
+        auto const index = static_cast<std::size_t>(cmd.op);
+        if (index >= display_op_count or commands_ == max_batch)
+        {
+            return;
+        }
+        auto const & text = texts()[index];
+        push(text.data, text.size);
+        char * const line = numbers_ + commands_ * number_width;
+        switch (text.argument)
+        {
+            case argument_format::none:
+                break;
+
+            case argument_format::number:
+                push(line, format_line(cmd.argument, line));
+                break;
+
+            case argument_format::statement_entry:
+                push(line, format_statement_entry(cmd.argument, line));
+                break;
+        }
+        ++commands_;
+    }
+
+    // Writes the batch with writev, resuming after partial writes, and
+    // clears it. Throws std::system_error if the descriptor fails.
+    void write_to(int fd)
+    {
+        iovec * iov = iov_;
+        std::size_t count = iov_count_;
+        while (count != 0)
+        {
+            ssize_t written = ::writev(fd, iov, static_cast<int>(count));
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                clear();
+                throw std::system_error{errno, std::generic_category(), "writev display"};
+            }
+            while (count != 0 and static_cast<std::size_t>(written) >= iov->iov_len)
+            {
+                written -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count != 0)
+            {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+        clear();
+    }
+
+    // Writes the batch to a stream, then flushes it, and clears the batch.
+    void write_to(std::ostream & out)
+    {
+        for (std::size_t i = 0; i < iov_count_; ++i)
+        {
+            out.write(static_cast<char const *>(iov_[i].iov_base), iov_[i].iov_len);
+        }
+        out.flush();
+        clear();
+    }
+
+    void clear()
+    {
+        iov_count_ = 0;
+        commands_ = 0;
+    }
+
+    // Commands in the batch.
+    std::size_t size() const
+    {
+        return commands_;
+    }
+
+private:
+    // What follows the fixed text: nothing, or the command's argument.
+    enum class argument_format
+    {
+          none
+        // The argument as a number, then a newline.
+        , number
+        // "<amount> at terminal <id>", then a newline.
+        , statement_entry
+    };
+
+    struct display_text
+    {
+        char const * data;
+        std::size_t size;
+        argument_format argument;
+    };
+
+    template <std::size_t N>
+    static constexpr display_text text(char const (&s)[N], argument_format argument = argument_format::none)
+    {
+        return display_text{s, N - 1, argument};
+    }
+
+    static display_text const * texts()
+    {
+        static display_text const table[display_op_count] = {
+              text("Please enter your card (i)\n")
+            , text("Please enter your PIN (0-9)\n")
+            , text("Withdraw 50? (w) \nDisplay Balance? (b) \nMini statement? (s) \nCancel? (c) \n")
+            , text("The balance of your account is ", argument_format::number)
+            , text("Insufficient funds\n")
+            , text("Withdrawal cancelled\n")
+            , text("PIN incorrect\n")
+            , text("Issuing ", argument_format::number)
+            , text("Ejecting card\n")
+            , text("Statement: ", argument_format::statement_entry)
+            , text("Bank busy, please try again\n")
+            };
+        return table;
+    }
+
+    // Writes the decimal digits of value; returns the length.
+    static std::size_t format_number(std::uint64_t value, char * out)
+    {
+        char digits[20];
+        std::size_t n = 0;
+        do
+        {
+            digits[n++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        }
+        while (value != 0);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            out[i] = digits[n - 1 - i];
+        }
+        return n;
+    }
 
-struct balance
-{
-    unsigned amount;
-};
+    // Writes value and a newline; returns the length.
+    static std::size_t format_line(std::uint64_t value, char * out)
+    {
+        std::size_t const n = format_number(value, out);
+        out[n] = '\n';
+        return n + 1;
+    }
 
-struct display_balance
-{
-    unsigned amount;
-};
+    static std::size_t format_statement_entry(std::uint64_t argument, char * out)
+    {
+        auto const amount = static_cast<std::int32_t>(static_cast<std::uint32_t>(argument >> 32));
+        auto const terminal = static_cast<std::uint32_t>(argument);
+        std::size_t n = 0;
+        std::uint64_t magnitude = static_cast<std::uint64_t>(amount < 0 ? -static_cast<std::int64_t>(amount) : amount);
+        if (amount < 0)
+        {
+            out[n++] = '-';
+        }
+        n += format_number(magnitude, out + n);
+        static char const at[] = " at terminal ";
+        static char const unknown[] = "unknown";
+        std::memcpy(out + n, at, sizeof(at) - 1);
+        n += sizeof(at) - 1;
+        if (terminal == account_history::unknown_terminal)
+        {
+            std::memcpy(out + n, unknown, sizeof(unknown) - 1);
+            n += sizeof(unknown) - 1;
+        }
+        else
+        {
+            n += format_number(terminal, out + n);
+        }
+        out[n] = '\n';
+        return n + 1;
+    }
 
-struct balance_pressed
-{
+    void push(char const * data, std::size_t size)
+    {
+        iov_[iov_count_].iov_base = const_cast<char *>(data);
+        iov_[iov_count_].iov_len = size;
+        ++iov_count_;
+    }
+
+    // Longest formatted argument: a statement entry, i.e. a signed 32-bit
+    // amount, " at terminal ", a 32-bit ID and a newline.
+    static std::size_t constexpr number_width = 11 + 13 + 10 + 1;
+
+    iovec iov_[2 * max_batch];
+    std::size_t iov_count_ = 0;
+    std::size_t commands_ = 0;
+    char numbers_[max_batch * number_width];
 };
 
 
-// ATM state machine
-class atm
+// User interface state machine
+class interface_machine
 {
 public:
-    atm(sender bank, sender interface_hardware)
-        : bank_{bank}
-        , interface_hardware_{interface_hardware}
+    explicit interface_machine(std::ostream & out = std::cout)
+        : out_{&out}
+        , probe_{"interface", &incoming_.get_queue()}
+    {
+    }
+
+    // Renders straight to a file descriptor with one writev per batch.
+    explicit interface_machine(int fd)
+        : fd_{fd}
+        , probe_{"interface", &incoming_.get_queue()}
     {
     }
 
     void done()
     {
         get_sender().send(close_queue{});
+        display_.close();
+    }
+
+    // Closing the display channel always drains it: it is bounded, and
+    // dropping prompts would leave the display inconsistent.
+    void stop(stop_mode mode, queue::clock::duration timeout = queue::clock::duration::max())
+    {
+        incoming_.get_queue().stop(mode, deadline_after(timeout));
+        display_.close();
+    }
+
+    // Valid once run() has returned after stop().
+    stop_report get_stop_report() const
+    {
+        return incoming_.get_queue().get_stop_report();
     }
 
     void run()
     {
-        state_ = &atm::waiting_for_card;
+        probe_.state.store("running", std::memory_order_relaxed);
         try
         {
             while (true)
             {
-                // Call next function to handle state.
-                (this->*state_)();
+                handle_next();
+            }
+        }
+        catch (close_queue const &)
+        {
+            flush();
+        }
+        probe_.state.store("stopped", std::memory_order_relaxed);
+    }
+
+    // Serves the display channel instead of the queue, rendering each drained
+    // batch with one write. Returns after done() or stop().
+    void run_display()
+    {
+        probe_.state.store("running", std::memory_order_relaxed);
+        display_command batch[display_renderer::max_batch];
+        while (std::size_t const n = display_.pop(batch, display_renderer::max_batch))
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                renderer_.add(batch[i]);
             }
+            flush();
+        }
+        probe_.state.store("stopped", std::memory_order_relaxed);
+    }
+
+    // Handles at most one message without blocking; requires a scheduled queue.
+    // Returns true if a message was consumed.
+    bool step()
+    {
+        auto const dequeued = incoming_.get_queue().dequeued();
+        try
+        {
+            handle_next();
         }
         catch (close_queue const &)
         {
+            flush();
+            probe_.state.store("stopped", std::memory_order_relaxed);
+            return false;
         }
+        return incoming_.get_queue().dequeued() != dequeued;
     }
 
     sender get_sender()
     {
-        // Converts receiver to sender.
         return incoming_;
     }
 
-protected:
-    void process_withdrawal()
+    queue & get_queue()
     {
-        incoming_.wait()
-            .handle<withdraw_ok>(
-                [&](withdraw_ok const & msg)
-                {
-                    interface_hardware_.send(issue_money{withdrawal_amount_});
-                    bank_.send(withdrawal_processed{account_, withdrawal_amount_});
-                    state_ = &atm::done_processing;
-                })
-            .handle<withdraw_denied>(
-                [&](withdraw_denied const & msg)
-                {
-                    interface_hardware_.send(display_insufficient_funds{});
-                    state_ = &atm::done_processing;
-                })
-            .handle<cancel_pressed>(
-                [&](cancel_pressed const & msg)
-                {
-                    bank_.send(cancel_withdrawal{account_, withdrawal_amount_});
-                    interface_hardware_.send(display_withdrawal_cancelled{});
-                    state_ = &atm::done_processing;
-                })
-            ;
+        return incoming_.get_queue();
     }
 
-    void process_balance()
+    // Single-producer link for one atm; see run_display().
+    display_channel & get_display_channel()
     {
-        incoming_.wait()
-            .handle<balance>(
-                [&](balance const & msg)
-                {
-                    interface_hardware_.send(display_balance{msg.amount});
-                    state_ = &atm::wait_for_action;
-                })
-            .handle<cancel_pressed>(
-                [&](cancel_pressed const & msg)
-                {
-                    state_ = &atm::done_processing;
-                })
-            ;
+        return display_;
     }
 
-    void wait_for_action()
+private:
+    void handle_next()
     {
-        interface_hardware_.send(display_withdrawal_options{});
         incoming_.wait()
-            .handle<withdraw_pressed>(
-                [&](withdraw_pressed const & msg)
+            .handle<issue_money>(
+                [&](issue_money const & msg)
                 {
-                    withdrawal_amount_ = msg.amount;
-                    bank_.send(withdraw{account_, msg.amount, incoming_});
-                    state_ = &atm::process_withdrawal;
+                    show(encode(msg));
                 })
-            .handle<balance_pressed>(
-                [&](balance_pressed const & msg)
+            .handle<display_insufficient_funds>(
+                [&](display_insufficient_funds const & msg)
                 {
-                    bank_.send(get_balance{account_, incoming_});
-                    state_ = &atm::process_balance;
+                    show(encode(msg));
                 })
-            .handle<cancel_pressed>(
-                [&](cancel_pressed const & msg)
+            .handle<display_enter_pin>(
+                [&](display_enter_pin const & msg)
                 {
-                    state_ = &atm::done_processing;
+                    show(encode(msg));
                 })
-            ;
-    }
-
-    void verifying_pin()
-    {
-        incoming_.wait()
-            .handle<pin_verified>(
-                [&](pin_verified const & msg)
+            .handle<display_enter_card>(
+                [&](display_enter_card const & msg)
                 {
-                    state_ = &atm::wait_for_action;
+                    show(encode(msg));
                 })
-            .handle<pin_incorrect>(
-                [&](pin_incorrect const & msg)
+            .handle<display_balance>(
+                [&](display_balance const & msg)
                 {
-                    interface_hardware_.send(display_pin_incorrect_message{});
-                    state_ = &atm::done_processing;
+                    show(encode(msg));
                 })
-            .handle<cancel_pressed>(
-                [&](cancel_pressed const & msg)
+            .handle<display_withdrawal_options>(
+                [&](display_withdrawal_options const & msg)
                 {
-                    state_ = &atm::done_processing;
+                    show(encode(msg));
                 })
-            ;
-    }
-
-    void getting_pin()
-    {
-        incoming_.wait()
-            .handle<digit_pressed>(
-                [&](digit_pressed const & msg)
+            .handle<display_withdrawal_cancelled>(
+                [&](display_withdrawal_cancelled const & msg)
                 {
-                    unsigned const pin_length = 4;
-                    pin_ += msg.digit;
-                    if (pin_.length() == pin_length)
-                    {
-                        bank_.send(verify_pin{account_, pin_, incoming_});
-                        state_ = &atm::verifying_pin;
-                    }
+                    show(encode(msg));
                 })
-            .handle<clear_last_pressed>(
-                [&](clear_last_pressed const & msg)
+            .handle<display_pin_incorrect_message>(
+                [&](display_pin_incorrect_message const & msg)
                 {
-                    if (not pin_.empty())
-                    {
-                        pin_.pop_back();
-                    }
+                    show(encode(msg));
                 })
-            .handle<cancel_pressed>(
-                [&](cancel_pressed const & msg)
+            .handle<eject_card>(
+                [&](eject_card const & msg)
                 {
-                    state_ = &atm::done_processing;
+                    show(encode(msg));
                 })
-            ;
-    }
-
-    void waiting_for_card()
-    {
-        interface_hardware_.send(display_enter_card{});
-        incoming_.wait()
-            .handle<card_inserted>(
-                [&](card_inserted const & msg)
+            .handle<display_statement_entry>(
+                [&](display_statement_entry const & msg)
                 {
-                    account_ = msg.account;
-                    pin_ = "";
-                    interface_hardware_.send(display_enter_pin{});
-                    state_ = &atm::getting_pin;
+                    show(encode(msg));
+                })
+            .handle<display_bank_busy>(
+                [&](display_bank_busy const & msg)
+                {
+                    show(encode(msg));
                 })
             ;
     }
 
-    void done_processing()
-    {
-        interface_hardware_.send(eject_card{});
-        state_ = &atm::waiting_for_card;
-    }
-
-    atm(atm const &) = delete;
-    atm & operator=(atm const &) = delete;
-
-private:
-    receiver incoming_;
-
-    // Bank to send messages as represents authority/backend storage of account data.
-    sender bank_;
-
-    // Hardware device that handles the display and mechanical actions.
-    sender interface_hardware_;
-
-    // Function pointer to track state, called by run() and changed in message handlers.
-    void (atm::*state_)();
-
-    std::string account_;
-    unsigned withdrawal_amount_ = 0;
-
-    // Currently entered PIN.
-    std::string pin_;
-};
-
-
-class bank_machine
-{
-public:
-    bank_machine()
-        : balance_{199} // Default to random amount.
-    {
-    }
-
-    void done()
+    // Renders into the batch, which is written once the queue is drained,
+    // as run_display() writes each drained batch from the channel.
+    void show(display_command const & cmd)
     {
-        get_sender().send(close_queue{});
+        renderer_.add(cmd);
+        if (renderer_.size() == display_renderer::max_batch or incoming_.get_queue().size() == 0)
+        {
+            flush();
+        }
     }
 
-    void run()
+    // A display that fails loses the batch; the interface keeps serving, as
+    // with a stream that has gone bad. Only the first failure in a row is
+    // reported.
+    void flush()
     {
-        try
+        if (out_)
         {
-            while (true)
-            {
-                incoming_.wait()
-                    .handle<verify_pin>(
-                        [&](verify_pin const & msg)
-                        {
-                            if (msg.pin == "1937")
-                            {
-                                msg.atm_queue.send(pin_verified{});
-                            }
-                            else
-                            {
-                                msg.atm_queue.send(pin_incorrect{});
-                            }
-                        })
-                    .handle<withdraw>(
-                        [&](withdraw const & msg)
-                        {
-                            if (balance_ >= msg.amount)
-                            {
-                                msg.atm_queue.send(withdraw_ok{});
-                                balance_ -= msg.amount;
-                            }
-                            else
-                            {
-                                msg.atm_queue.send(withdraw_denied{});
-                            }
-                        })
-                    .handle<get_balance>(
-                        [&](get_balance const & msg)
-                        {
-                            msg.atm_queue.send(balance{balance_});
-                        })
-                    .handle<withdrawal_processed>(
-                        [&](withdrawal_processed const & msg)
-                        {
-                        })
-                    .handle<cancel_withdrawal>(
-                        [&](cancel_withdrawal const & msg)
-                        {
-                        })
-                    ;
-            }
+            renderer_.write_to(*out_);
+            return;
         }
-        catch (close_queue const &)
+        try
         {
+            renderer_.write_to(fd_);
+            display_failing_ = false;
         }
-    }
-
-    sender get_sender()
-    {
-        return incoming_;
-    }
-
-private:
-    receiver incoming_;
-    unsigned balance_;
-};
-
-
-// User interface state machine
-class interface_machine
-{
-public:
-    void done()
-    {
-        get_sender().send(close_queue{});
-    }
-
-    void run()
-    {
-        try
+        catch (std::system_error const & e)
         {
-            while (true)
+            if (not display_failing_)
             {
-                incoming_.wait()
-                    .handle<issue_money>(
-                        [&](issue_money const & msg)
-                        {
-                            std::lock_guard<std::mutex> lock{iom_};
-                            std::cout << "Issuing " << msg.amount << std::endl;
-                        })
-                    .handle<display_insufficient_funds>(
-                        [&](display_insufficient_funds const &)
-                        {
-                            std::lock_guard<std::mutex> lock{iom_};
-                            std::cout << "Insufficient funds" << std::endl;
-                        })
-                    .handle<display_enter_pin>(
-                        [&](display_enter_pin const &)
-                        {
-                            std::lock_guard<std::mutex> lock{iom_};
-                            std::cout << "Please enter your PIN (0-9)" << std::endl;
-                        })
-                    .handle<display_enter_card>(
-                        [&](display_enter_card const &)
-                        {
-                            std::lock_guard<std::mutex> lock{iom_};
-                            std::cout << "Please enter your card (i)" << std::endl;
-                        })
-                    .handle<display_balance>(
-                        [&](display_balance const & msg)
-                        {
-                            std::lock_guard<std::mutex> lock{iom_};
-                            std::cout << "The balance of your account is " << msg.amount << std::endl;
-                        })
-                    .handle<display_withdrawal_options>(
-                        [&](display_withdrawal_options const &)
-                        {
-                            std::lock_guard<std::mutex> lock{iom_};
-                            std::cout << "Withdraw 50? (w) " << std::endl;
-                            std::cout << "Display Balance? (b) " << std::endl;
-                            std::cout << "Cancel? (c) " << std::endl;
-                        })
-                    .handle<display_withdrawal_cancelled>(
-                        [&](display_withdrawal_cancelled const &)
-                        {
-                            std::lock_guard<std::mutex> lock{iom_};
-                            std::cout << "Withdrawal cancelled" << std::endl;
-                        })
-                    .handle<display_pin_incorrect_message>(
-                        [&](display_pin_incorrect_message const &)
-                        {
-                            std::lock_guard<std::mutex> lock{iom_};
-                            std::cout << "PIN incorrect" << std::endl;
-                        })
-                    .handle<eject_card>(
-                        [&](eject_card const &)
-                        {
-                            std::lock_guard<std::mutex> lock{iom_};
-                            std::cout << "Ejecting card" << std::endl;
-                        })
-                    ;
+                std::cerr << "interface: " << e.what() << std::endl;
             }
+            display_failing_ = true;
         }
-        catch (close_queue const &)
-        {
-        }
-    }
-
-    sender get_sender()
-    {
-        return incoming_;
     }
 
-private:
     receiver incoming_;
 
-    // Lock for I/O.
-    std::mutex iom_;
+    // Compact link from an atm, served by run_display().
+    display_channel display_;
+
+    // Where the display is rendered: a stream, or else a file descriptor.
+    std::ostream * out_ = nullptr;
+    int fd_ = -1;
+
+    // Only the thread running the interface renders, so no lock is needed.
+    display_renderer renderer_;
+    bool display_failing_ = false;
+
+    actor_probe probe_;
 };
 
 }
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace messaging {
+
+// Holds the current version of an immutable T, which a writer replaces as a
+// whole while readers go on using whichever version they started with.
+//
+// Readers register once and then bracket each use with read(): entering
+// records the current epoch in the reader's slot, leaving marks the slot
+// idle. publish() swaps the pointer, advances the epoch and retires the old
+// version; a retired version is freed once every reader is idle or has
+// entered since it was retired. Readers never block or allocate, and a
+// reader that stays idle holds nothing back.
+//
+//   rcu_cell<table> cell{std::move(first)};
+//   rcu_cell<table>::reader r{cell};
+//   { auto t = r.read(); use(*t); }       // reader
+//   cell.publish(std::move(next));        // writer, any thread
+template <typename T>
+class rcu_cell
+{
+    static std::uint64_t constexpr idle = std::numeric_limits<std::uint64_t>::max();
+
+    struct slot
+    {
+        std::atomic<std::uint64_t> epoch{idle};
+        // Slots are written by different threads; keep them apart.
+        char pad[64 - sizeof(std::atomic<std::uint64_t>)];
+    };
+
+public:
+    class reader;
+
+    // Valid while the guard lives; the version it points to stays alive
+    // even if a newer one is published meanwhile.
+    class guard
+    {
+    public:
+        guard(guard && other)
+            : slot_{other.slot_}
+            , value_{other.value_}
+        {
+            other.slot_ = nullptr;
+        }
+
+        ~guard()
+        {
+            if (slot_)
+            {
+                slot_->epoch.store(idle, std::memory_order_release);
+            }
+        }
+
+        guard(guard const &) = delete;
+        guard & operator=(guard const &) = delete;
+
+        // nullptr if nothing was ever published.
+        T const * get() const
+        {
+            return value_;
+        }
+
+        T const & operator*() const
+        {
+            return *value_;
+        }
+
+        T const * operator->() const
+        {
+            return value_;
+        }
+
+    private:
+        friend class reader;
+
+        guard(slot * s, T const * value)
+            : slot_{s}
+            , value_{value}
+        {
+        }
+
+        slot * slot_;
+        T const * value_;
+    };
+
+    // One per reading context, e.g. per actor; not shared between threads
+    // running at the same time. Guards from one reader must not nest.
+    class reader
+    {
+    public:
+        explicit reader(rcu_cell & cell)
+            : cell_{cell}
+            , slot_{new slot}
+        {
+            std::lock_guard<std::mutex> lock{cell_.m_};
+            cell_.slots_.push_back(slot_.get());
+        }
+
+        ~reader()
+        {
+            std::lock_guard<std::mutex> lock{cell_.m_};
+            cell_.slots_.erase(std::find(cell_.slots_.begin(), cell_.slots_.end(), slot_.get()));
+        }
+
+        reader(reader const &) = delete;
+        reader & operator=(reader const &) = delete;
+
+        guard read()
+        {
+            slot_->epoch.store(cell_.epoch_.load(std::memory_order_acquire), std::memory_order_relaxed);
+            // Either publish() sees this slot's epoch, or the load below
+            // sees the version published after it.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return guard{slot_.get(), cell_.current_.load(std::memory_order_acquire)};
+        }
+
+    private:
+        rcu_cell & cell_;
+        std::unique_ptr<slot> slot_;
+    };
+
+    rcu_cell() = default;
+
+    explicit rcu_cell(std::unique_ptr<T const> first)
+        : current_{first.release()}
+    {
+    }
+
+    // Readers must be gone.
+    ~rcu_cell()
+    {
+        delete current_.load(std::memory_order_relaxed);
+        for (auto const & r : retired_)
+        {
+            delete r.value;
+        }
+    }
+
+    rcu_cell(rcu_cell const &) = delete;
+    rcu_cell & operator=(rcu_cell const &) = delete;
+
+    // Makes `next` the version new reads see, then frees what it can.
+    void publish(std::unique_ptr<T const> next)
+    {
+        T const * const old = current_.exchange(next.release(), std::memory_order_seq_cst);
+        std::uint64_t const epoch = epoch_.fetch_add(1, std::memory_order_acq_rel) + 1;
+        std::lock_guard<std::mutex> lock{m_};
+        if (old)
+        {
+            retired_.push_back(retired{old, epoch});
+        }
+        reclaim_locked();
+    }
+
+    // Frees retired versions no reader can still be using; returns how many
+    // remain. publish() calls it; call it again later to free versions that
+    // were in use then.
+    std::size_t reclaim()
+    {
+        std::lock_guard<std::mutex> lock{m_};
+        reclaim_locked();
+        return retired_.size();
+    }
+
+private:
+    struct retired
+    {
+        T const * value;
+        // Readers entering at this epoch or later cannot see the value.
+        std::uint64_t epoch;
+    };
+
+    void reclaim_locked()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::uint64_t oldest = idle;
+        for (slot const * s : slots_)
+        {
+            oldest = std::min(oldest, s->epoch.load(std::memory_order_acquire));
+        }
+        auto const keep = std::partition(
+              retired_.begin(), retired_.end()
+            , [oldest](retired const & r) { return r.epoch > oldest; });
+        for (auto i = keep; i != retired_.end(); ++i)
+        {
+            delete i->value;
+        }
+        retired_.erase(keep, retired_.end());
+    }
+
+    std::atomic<T const *> current_{nullptr};
+    std::atomic<std::uint64_t> epoch_{0};
+
+    // Guards registration and the retired list, i.e. writers only.
+    std::mutex m_;
+    std::vector<slot *> slots_;
+    std::vector<retired> retired_;
+};
+
+}
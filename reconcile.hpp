@@ -0,0 +1,232 @@
+#pragma once
+
+#include "history.hpp"
+#include "journal.hpp"
+#include "queue.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+namespace messaging {
+
+// Cash totals of one terminal over the reconciled period.
+struct terminal_totals
+{
+    std::uint32_t terminal;
+    // Sum of the withdrawals committed at the terminal (withdrawal_processed).
+    std::int64_t debited;
+    // Sum of the issue_money sent to the terminal's interface.
+    std::int64_t dispensed;
+};
+
+struct reconciliation
+{
+    // Every terminal seen debiting or dispensing, by terminal ID.
+    std::vector<terminal_totals> terminals;
+    // The subset whose debits and dispenses differ.
+    std::vector<terminal_totals> mismatches;
+    std::uint64_t debits = 0;
+    std::uint64_t dispenses = 0;
+    // Records the journal dropped with its ring full. If not zero, totals
+    // can differ without any cash going astray.
+    std::uint64_t dropped = 0;
+    // Segments that could not be read, e.g. left unfinished by a crash,
+    // with the reason. Their records are missing from the totals.
+    std::vector<std::string> skipped;
+};
+
+inline std::ostream & operator<<(std::ostream & out, reconciliation const & r)
+{
+    out << "reconciled " << r.terminals.size() << " terminals, "
+        << r.debits << " debits, " << r.dispenses << " dispenses, "
+        << r.mismatches.size() << " mismatches\n";
+    if (r.dropped != 0)
+    {
+        out << "the journal dropped " << r.dropped << " records\n";
+    }
+    for (auto const & s : r.skipped)
+    {
+        out << "skipped " << s << '\n';
+    }
+    for (auto const & t : r.mismatches)
+    {
+        out << "terminal ";
+        if (t.terminal == account_history::unknown_terminal)
+        {
+            out << "unknown";
+        }
+        else
+        {
+            out << t.terminal;
+        }
+        out << ": debited " << t.debited << ", dispensed " << t.dispensed << '\n';
+    }
+    return out;
+}
+
+// Compares, per terminal, the cash committed at the banks against the cash
+// dispensed, from the journal segments <prefix>.<n> (see journal_writer),
+// counting the records in [from_ns, to_ns). Segments from earlier runs are
+// included, so a day's journals reconcile across restarts.
+//
+// A withdrawal_processed is journaled again each time a shard forwards it
+// or holds it back during a handoff, so debits are counted once per request
+// ID. The segments are scanned in parallel on the pool, and each one splits
+// its commits into partitions by account. The partitions are then
+// deduplicated and summed by terminal in parallel, one map per partition,
+// and the maps are merged.
+inline reconciliation reconcile(std::string const & prefix, std::int64_t from_ns, std::int64_t to_ns, thread_pool & pool)
+{
+    using sums = std::unordered_map<std::uint32_t, std::int64_t>;
+
+    struct commit
+    {
+        std::uint64_t request;
+        std::uint32_t terminal;
+        std::int64_t amount;
+    };
+
+    std::string const issue_money_type = type_name(typeid(issue_money));
+    std::string const processed_type = type_name(typeid(withdrawal_processed));
+
+    std::vector<std::string> const paths = journal_segments(prefix);
+    std::size_t const partitions = pool.size() * 4;
+    // By segment, then by partition.
+    std::vector<std::vector<std::vector<commit> > > commits(paths.size());
+    std::vector<sums> dispensed(paths.size());
+    std::vector<std::uint64_t> dispenses(paths.size());
+    std::vector<std::uint64_t> dropped(paths.size());
+    std::vector<std::string> errors(paths.size());
+    pool.parallel_for(
+          paths.size()
+        , [&](std::size_t segment)
+        {
+            auto & parts = commits[segment];
+            parts.resize(partitions);
+            try
+            {
+                journal_reader reader{paths[segment]};
+                dropped[segment] = reader.dropped();
+                auto const type_number = [&reader](std::string const & name)
+                {
+                    auto const & types = reader.types();
+                    return static_cast<std::uint32_t>(std::find(types.begin(), types.end(), name) - types.begin());
+                };
+                std::uint32_t const issue_money_number = type_number(issue_money_type);
+                std::uint32_t const processed_number = type_number(processed_type);
+                std::vector<std::size_t> partition_of;
+                for (auto const & account : reader.accounts())
+                {
+                    partition_of.push_back(std::hash<std::string>{}(account) % partitions);
+                }
+
+                reader.scan_from(
+                      from_ns
+                    , [&](journal_record const & r)
+                    {
+                        if (r.time_ns >= to_ns)
+                        {
+                            return;
+                        }
+                        std::uint32_t const terminal = r.flags & journal_record::has_terminal
+                            ? r.terminal : account_history::unknown_terminal;
+                        if (r.type == issue_money_number)
+                        {
+                            dispensed[segment][terminal] += r.amount;
+                            ++dispenses[segment];
+                        }
+                        else if (r.type == processed_number and r.account != journal_record::no_account)
+                        {
+                            parts[partition_of[r.account]].push_back(commit{r.request, terminal, r.amount});
+                        }
+                    });
+            }
+            catch (std::runtime_error const & e)
+            {
+                // Also std::system_error.
+                errors[segment] = e.what();
+            }
+        });
+
+    std::vector<sums> debited(partitions);
+    std::vector<std::uint64_t> debits(partitions);
+    pool.parallel_for(
+          partitions
+        , [&](std::size_t part)
+        {
+            std::vector<commit> all;
+            for (auto & segment : commits)
+            {
+                all.insert(all.end(), segment[part].begin(), segment[part].end());
+                std::vector<commit>{}.swap(segment[part]);
+            }
+            std::sort(
+                  all.begin(), all.end()
+                , [](commit const & a, commit const & b) { return a.request < b.request; });
+            for (std::size_t i = 0; i < all.size(); ++i)
+            {
+                // Request ID 0 opts out of deduplication, so every one counts.
+                if (i != 0 and all[i].request != 0 and all[i].request == all[i - 1].request)
+                {
+                    continue;
+                }
+                debited[part][all[i].terminal] += all[i].amount;
+                ++debits[part];
+            }
+        });
+
+    std::unordered_map<std::uint32_t, terminal_totals> totals;
+    auto total = [&totals](std::uint32_t terminal) -> terminal_totals &
+    {
+        return totals.emplace(terminal, terminal_totals{terminal, 0, 0}).first->second;
+    };
+    reconciliation result;
+    for (std::size_t part = 0; part < partitions; ++part)
+    {
+        for (auto const & d : debited[part])
+        {
+            total(d.first).debited += d.second;
+        }
+        result.debits += debits[part];
+    }
+    for (std::size_t segment = 0; segment < paths.size(); ++segment)
+    {
+        for (auto const & d : dispensed[segment])
+        {
+            total(d.first).dispensed += d.second;
+        }
+        result.dispenses += dispenses[segment];
+        result.dropped += dropped[segment];
+        if (not errors[segment].empty())
+        {
+            result.skipped.push_back(errors[segment]);
+        }
+    }
+    for (auto const & t : totals)
+    {
+        result.terminals.push_back(t.second);
+    }
+    std::sort(
+          result.terminals.begin(), result.terminals.end()
+        , [](terminal_totals const & a, terminal_totals const & b) { return a.terminal < b.terminal; });
+    for (auto const & t : result.terminals)
+    {
+        if (t.debited != t.dispensed)
+        {
+            result.mismatches.push_back(t);
+        }
+    }
+    return result;
+}
+
+}
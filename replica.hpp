@@ -0,0 +1,352 @@
+#pragma once
+
+#include "account_table.hpp"
+#include "queue.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace messaging {
+
+// One line of a bank WAL; see bank_machine.
+struct wal_record
+{
+    enum class kind { commit, hold, release };
+    kind what;
+    std::uint64_t request_id;
+    std::string account;
+    unsigned amount;
+    // After the commit; unused for holds.
+    unsigned balance;
+};
+
+// The lines a wal_shipper read, in log order.
+struct wal_shipment
+{
+    std::shared_ptr<std::vector<wal_record> > records;
+    // Everything the primary had logged by this time is in this shipment
+    // or an earlier one.
+    std::chrono::steady_clock::time_point caught_up;
+};
+
+
+// Ships a bank's WAL to a replica: a thread that, every `interval`, reads
+// whatever has been appended since it last looked and sends the complete
+// lines as one wal_shipment. It sends one even when nothing was
+// appended, since that too tells the replica how current it is.
+class wal_shipper
+{
+public:
+    // Starts reading at byte `offset`, e.g. where the replica's copy was
+    // loaded up to. Throws std::system_error if the log cannot be opened.
+    wal_shipper(std::string path, std::uint64_t offset, sender replica, std::chrono::milliseconds interval)
+        : path_{std::move(path)}
+        , offset_{offset}
+        , replica_{replica}
+        , interval_{interval}
+    {
+        fd_ = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "open " + path_};
+        }
+        thread_ = std::thread{&wal_shipper::work, this};
+    }
+
+    ~wal_shipper()
+    {
+        stop();
+        ::close(fd_);
+    }
+
+    wal_shipper(wal_shipper const &) = delete;
+    wal_shipper & operator=(wal_shipper const &) = delete;
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock{m_};
+            stopping_ = true;
+        }
+        c_.notify_one();
+        if (thread_.joinable())
+        {
+            thread_.join();
+        }
+    }
+
+private:
+    void work()
+    {
+        std::unique_lock<std::mutex> lock{m_};
+        while (not c_.wait_for(lock, interval_, [this]() { return stopping_; }))
+        {
+            lock.unlock();
+            ship();
+            lock.lock();
+        }
+    }
+
+    void ship()
+    {
+        // Taken before reading, so nothing logged until now is missed.
+        auto const now = std::chrono::steady_clock::now();
+        auto records = std::make_shared<std::vector<wal_record> >();
+        char buffer[1 << 16];
+        while (true)
+        {
+            ssize_t const n = ::pread(fd_, buffer, sizeof buffer, static_cast<off_t>(offset_));
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                // Ships what it has; the replica's copy just ages.
+                std::cerr << "replica: read " << path_ << ": " << std::system_category().message(errno) << std::endl;
+                return;
+            }
+            if (n == 0)
+            {
+                break;
+            }
+            offset_ += static_cast<std::uint64_t>(n);
+            partial_.append(buffer, static_cast<std::size_t>(n));
+            parse(*records);
+        }
+        replica_.send(wal_shipment{std::move(records), now});
+    }
+
+    // Takes the complete lines off partial_.
+    void parse(std::vector<wal_record> & records)
+    {
+        std::size_t start = 0;
+        for (std::size_t end; (end = partial_.find('\n', start)) != std::string::npos; start = end + 1)
+        {
+            std::istringstream fields{partial_.substr(start, end - start)};
+            std::string kind;
+            wal_record r{wal_record::kind::commit, 0, {}, 0, 0};
+            bool parsed = static_cast<bool>(fields >> kind >> r.request_id >> r.account >> r.amount);
+            if (kind == "commit")
+            {
+                parsed = parsed and fields >> r.balance;
+            }
+            else if (kind == "hold")
+            {
+                r.what = wal_record::kind::hold;
+            }
+            else if (kind == "release")
+            {
+                r.what = wal_record::kind::release;
+            }
+            else
+            {
+                parsed = false;
+            }
+            if (not parsed)
+            {
+                std::cerr << "replica: " << path_ << ": bad WAL line: " << partial_.substr(start, end - start) << std::endl;
+                continue;
+            }
+            records.push_back(std::move(r));
+        }
+        partial_.erase(0, start);
+    }
+
+    std::string const path_;
+    int fd_ = -1;
+    std::uint64_t offset_;
+    // Bytes after the last complete line.
+    std::string partial_;
+    sender replica_;
+    std::chrono::milliseconds const interval_;
+
+    std::mutex m_;
+    std::condition_variable c_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+
+// A read-only copy of one bank shard's balances, kept up to date by a
+// wal_shipper. It answers get_balance itself while the last shipment is no
+// older than `staleness`; queries arriving when it has fallen further
+// behind, or for accounts it has never seen, go on to the primary. Like the
+// primary it answers the available balance: the WAL also logs holds and
+// their release, and the replica subtracts the ones still open.
+class replica_machine
+{
+public:
+    // `balances` is the copy as of now, e.g. the primary's table as loaded.
+    replica_machine(sender primary, account_table<unsigned> balances, std::chrono::steady_clock::duration staleness)
+        : primary_{primary}
+        , balances_{std::move(balances)}
+        , staleness_{staleness}
+        , caught_up_{std::chrono::steady_clock::now()}
+        , probe_{"replica", &incoming_.get_queue()}
+    {
+    }
+
+    void done()
+    {
+        get_sender().send(close_queue{});
+    }
+
+    void stop(stop_mode mode, queue::clock::duration timeout = queue::clock::duration::max())
+    {
+        incoming_.get_queue().stop(mode, deadline_after(timeout));
+    }
+
+    // Valid once run() has returned after stop().
+    stop_report get_stop_report() const
+    {
+        return incoming_.get_queue().get_stop_report();
+    }
+
+    void run()
+    {
+        probe_.state.store("running", std::memory_order_relaxed);
+        try
+        {
+            while (true)
+            {
+                handle_next();
+            }
+        }
+        catch (close_queue const &)
+        {
+        }
+        probe_.state.store("stopped", std::memory_order_relaxed);
+    }
+
+    // Handles at most one message without blocking; requires a scheduled queue.
+    // Returns true if a message was consumed.
+    bool step()
+    {
+        auto const dequeued = incoming_.get_queue().dequeued();
+        try
+        {
+            handle_next();
+        }
+        catch (close_queue const &)
+        {
+            probe_.state.store("stopped", std::memory_order_relaxed);
+            return false;
+        }
+        return incoming_.get_queue().dequeued() != dequeued;
+    }
+
+    sender get_sender()
+    {
+        return incoming_;
+    }
+
+    queue & get_queue()
+    {
+        return incoming_.get_queue();
+    }
+
+    // Queries answered here and passed to the primary. Only valid while the
+    // replica is not running.
+    std::uint64_t answered() const
+    {
+        return answered_;
+    }
+
+    std::uint64_t forwarded() const
+    {
+        return forwarded_;
+    }
+
+private:
+    void handle_next()
+    {
+        incoming_.wait()
+            .handle<get_balance>(
+                [&](get_balance const & msg)
+                {
+                    unsigned const * b = balances_.find(msg.account);
+                    if (b and std::chrono::steady_clock::now() - caught_up_ <= staleness_)
+                    {
+                        auto const h = held_.find(msg.account);
+                        unsigned const held = h == held_.end() ? 0 : h->second;
+                        msg.atm_queue.send(balance{*b > held ? *b - held : 0});
+                        ++answered_;
+                    }
+                    else
+                    {
+                        primary_.send(msg);
+                        ++forwarded_;
+                    }
+                })
+            .handle<wal_shipment>(
+                [&](wal_shipment const & msg)
+                {
+                    for (auto const & r : *msg.records)
+                    {
+                        apply(r);
+                    }
+                    caught_up_ = msg.caught_up;
+                })
+            ;
+    }
+
+    void apply(wal_record const & r)
+    {
+        if (r.what == wal_record::kind::hold)
+        {
+            // A second line for a hold already open changes nothing.
+            if (holds_.emplace(r.request_id, r.amount).second)
+            {
+                held_[r.account] += r.amount;
+            }
+            return;
+        }
+        // A commit settles its hold, if the replica saw one.
+        auto const h = holds_.find(r.request_id);
+        if (h != holds_.end())
+        {
+            auto const held = held_.find(r.account);
+            if (held != held_.end() and (held->second -= std::min(held->second, h->second)) == 0)
+            {
+                held_.erase(held);
+            }
+            holds_.erase(h);
+        }
+        if (r.what == wal_record::kind::commit)
+        {
+            balances_[r.account] = r.balance;
+        }
+    }
+
+    receiver incoming_;
+    sender primary_;
+    account_table<unsigned> balances_;
+    // Amount of each open hold by request ID, and their sum by account.
+    std::unordered_map<std::uint64_t, unsigned> holds_;
+    std::unordered_map<std::string, unsigned> held_;
+    std::chrono::steady_clock::duration const staleness_;
+    // Time as of which balances_ holds everything the primary logged.
+    std::chrono::steady_clock::time_point caught_up_;
+    std::uint64_t answered_ = 0;
+    std::uint64_t forwarded_ = 0;
+    actor_probe probe_;
+};
+
+}
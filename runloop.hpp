@@ -0,0 +1,90 @@
+#pragma once
+
+#include "queue.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace messaging {
+
+// Runs every attached actor's handlers on the calling thread.
+//
+// sender::send on an attached queue appends straight to the destination queue
+// and marks its actor ready; run() then steps ready actors in FIFO order until
+// nothing is left to do. No locks or condition variables are involved, so the
+// cost measured is that of the actors' own logic. Everything, including the
+// code that sends the initial messages, must run on the loop's thread.
+//
+// Actors must provide step() and get_queue(), like atm, bank_machine and
+// interface_machine.
+class run_loop
+    : public scheduler
+{
+public:
+    run_loop() = default;
+
+    run_loop(run_loop const &) = delete;
+    run_loop & operator=(run_loop const &) = delete;
+
+    template <typename Actor>
+    void add(Actor & actor)
+    {
+        std::size_t const id = actors_.size();
+        actors_.push_back(entry{&actor.get_queue(), [&actor]() { return actor.step(); }, false});
+        actor.get_queue().attach(this, id);
+        // Let the actor run its initial entry actions.
+        make_ready(id);
+    }
+
+    void schedule(queue & q, std::shared_ptr<message_base> msg) override
+    {
+        q.deliver(std::move(msg));
+        make_ready(q.slot());
+    }
+
+    // Runs until every actor is idle. Returns the number of step() calls that
+    // made progress.
+    std::uint64_t run()
+    {
+        std::uint64_t steps = 0;
+        while (not ready_.empty())
+        {
+            std::size_t const id = ready_.front();
+            ready_.pop_front();
+
+            auto & a = actors_[id];
+            a.ready = false;
+            while (a.step())
+            {
+                ++steps;
+            }
+        }
+        return steps;
+    }
+
+private:
+    struct entry
+    {
+        queue * q;
+        std::function<bool()> step;
+        bool ready;
+    };
+
+    void make_ready(std::size_t id)
+    {
+        if (not actors_[id].ready)
+        {
+            actors_[id].ready = true;
+            ready_.push_back(id);
+        }
+    }
+
+    std::vector<entry> actors_;
+    std::deque<std::size_t> ready_;
+};
+
+}
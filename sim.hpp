@@ -0,0 +1,429 @@
+#pragma once
+
+#include "queue.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace messaging {
+
+// Virtual time in nanoseconds.
+using sim_time = std::uint64_t;
+
+sim_time constexpr sim_us = 1000;
+sim_time constexpr sim_ms = 1000 * sim_us;
+sim_time constexpr sim_s = 1000 * sim_ms;
+
+
+// Deterministic pseudo-random source (splitmix64). Unlike the standard
+// distributions its output is identical across library implementations.
+class sim_random
+{
+public:
+    explicit sim_random(std::uint64_t seed)
+        : state_{seed}
+    {
+    }
+
+    std::uint64_t next()
+    {
+        std::uint64_t z = (state_ += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [lo, hi].
+    std::uint64_t uniform(std::uint64_t lo, std::uint64_t hi)
+    {
+        return lo + next() % (hi - lo + 1);
+    }
+
+    // Uniform in (0, 1].
+    double unit()
+    {
+        return static_cast<double>((next() >> 11) + 1) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    std::uint64_t state_;
+};
+
+
+// Delay applied to messages on a link, or service time of an actor.
+class latency_model
+{
+public:
+    // Zero delay.
+    latency_model() = default;
+
+    static latency_model fixed(sim_time delay)
+    {
+        return latency_model{kind::fixed, delay, delay};
+    }
+
+    static latency_model uniform(sim_time lo, sim_time hi)
+    {
+        return latency_model{kind::uniform, lo, hi};
+    }
+
+    // Exponentially distributed with the given mean, added to a fixed floor.
+    static latency_model exponential(sim_time floor, sim_time mean)
+    {
+        return latency_model{kind::exponential, floor, mean};
+    }
+
+    sim_time sample(sim_random & rng) const
+    {
+        switch (kind_)
+        {
+            case kind::fixed:
+                return a_;
+            case kind::uniform:
+                return rng.uniform(a_, b_);
+            case kind::exponential:
+                return a_ + static_cast<sim_time>(-std::log(rng.unit()) * static_cast<double>(b_));
+        }
+        return 0;
+    }
+
+private:
+    enum class kind
+    {
+          fixed
+        , uniform
+        , exponential
+    };
+
+    latency_model(kind k, sim_time a, sim_time b)
+        : kind_{k}
+        , a_{a}
+        , b_{b}
+    {
+    }
+
+    kind kind_ = kind::fixed;
+    sim_time a_ = 0;
+    sim_time b_ = 0;
+};
+
+
+// Runs actors on the calling thread against a virtual clock.
+//
+// Every push to an attached queue becomes a delivery event scheduled after the
+// latency of the link it travels on. Events are ordered by (time, sequence
+// number) and all randomness comes from one seeded generator, so a run with
+// the same inputs is reproducible bit-for-bit.
+//
+// Actors must provide step() and get_queue(), like atm, bank_machine and
+// interface_machine. A link is identified by the actor that was running when
+// the message was sent (or `external` for callbacks) and the receiving actor.
+class simulation
+    : public scheduler
+{
+public:
+    using actor_id = std::size_t;
+
+    // Source of messages sent from at() callbacks rather than from an actor.
+    static actor_id constexpr external = std::numeric_limits<actor_id>::max();
+
+    struct actor_stats
+    {
+        std::uint64_t processed = 0;
+        std::size_t max_depth = 0;
+        sim_time busy = 0;
+        // Sum over processed messages of time spent queued after delivery.
+        sim_time queued = 0;
+    };
+
+    explicit simulation(std::uint64_t seed = 1)
+        : rng_{seed}
+    {
+    }
+
+    simulation(simulation const &) = delete;
+    simulation & operator=(simulation const &) = delete;
+
+    template <typename Actor>
+    actor_id add(std::string name, Actor & actor)
+    {
+        actor_id const id = actors_.size();
+        entry e;
+        e.name = std::move(name);
+        e.q = &actor.get_queue();
+        e.step = [&actor]() { return actor.step(); };
+        actors_.push_back(std::move(e));
+        actor.get_queue().attach(this, id);
+        // Let the actor run its initial entry actions.
+        wake_at(id, now_);
+        return id;
+    }
+
+    void set_default_latency(latency_model model)
+    {
+        default_latency_ = model;
+    }
+
+    // Latency of messages sent by `from` to `to`.
+    void set_latency(actor_id from, actor_id to, latency_model model)
+    {
+        links_[std::make_pair(from, to)] = model;
+    }
+
+    // Virtual processing time per message consumed by an actor.
+    void set_service_time(actor_id id, latency_model model)
+    {
+        actors_[id].service = model;
+    }
+
+    // Runs f at virtual time t, e.g. to inject traffic.
+    void at(sim_time t, std::function<void()> f)
+    {
+        std::size_t index = callbacks_.size();
+        if (free_callbacks_.empty())
+        {
+            callbacks_.push_back(std::move(f));
+        }
+        else
+        {
+            index = free_callbacks_.back();
+            free_callbacks_.pop_back();
+            callbacks_[index] = std::move(f);
+        }
+        push_event(event{t, 0, event_kind::callback, 0, index, nullptr});
+    }
+
+    sim_time now() const
+    {
+        return now_;
+    }
+
+    sim_random & random()
+    {
+        return rng_;
+    }
+
+    // Processes events up to and including virtual time `end`.
+    // Returns the number of events processed.
+    std::uint64_t run_until(sim_time end)
+    {
+        std::uint64_t processed = 0;
+        while (not events_.empty() and events_.top().time <= end)
+        {
+            // The top is about to be popped, so its message can be moved out.
+            event ev = std::move(const_cast<event &>(events_.top()));
+            events_.pop();
+            now_ = ev.time;
+            ++processed;
+
+            switch (ev.kind)
+            {
+                case event_kind::delivery:
+                    deliver(ev.actor, std::move(ev.msg));
+                    break;
+
+                case event_kind::wake:
+                    actors_[ev.actor].wake_pending = false;
+                    run_actor(ev.actor);
+                    break;
+
+                case event_kind::callback:
+                {
+                    auto f = std::move(callbacks_[ev.index]);
+                    callbacks_[ev.index] = nullptr;
+                    free_callbacks_.push_back(ev.index);
+                    current_ = external;
+                    depart_ = now_;
+                    f();
+                    break;
+                }
+            }
+        }
+        events_processed_ += processed;
+        return processed;
+    }
+
+    std::uint64_t run()
+    {
+        return run_until(std::numeric_limits<sim_time>::max());
+    }
+
+    actor_stats const & stats(actor_id id) const
+    {
+        return actors_[id].stats;
+    }
+
+    void report(std::ostream & out) const
+    {
+        out << "virtual time " << now_ / sim_ms << " ms, " << events_processed_ << " events\n";
+        for (auto const & a : actors_)
+        {
+            out << a.name
+                << " processed=" << a.stats.processed
+                << " max_depth=" << a.stats.max_depth
+                << " utilisation=" << (now_ ? 100.0 * static_cast<double>(a.stats.busy) / static_cast<double>(now_) : 0.0) << '%'
+                << " mean_wait_us=" << (a.stats.processed ? static_cast<double>(a.stats.queued) / static_cast<double>(a.stats.processed) / sim_us : 0.0)
+                << '\n';
+        }
+    }
+
+    void schedule(queue & q, std::shared_ptr<message_base> msg) override
+    {
+        actor_id const to = q.slot();
+        sim_time const delay = latency(current_, to).sample(rng_);
+        push_event(event{depart_ + delay, 0, event_kind::delivery, to, 0, std::move(msg)});
+    }
+
+    // Actors read the virtual clock, so hold expiry and dedup windows run
+    // in virtual time; the wall clock starts at the epoch.
+    std::chrono::steady_clock::time_point steady_now() const override
+    {
+        return std::chrono::steady_clock::time_point{std::chrono::nanoseconds{now_}};
+    }
+
+    std::int64_t wall_ms() const override
+    {
+        return static_cast<std::int64_t>(now_ / sim_ms);
+    }
+
+    // Numbered in order of issue, so that runs repeat.
+    std::uint64_t next_request_id() override
+    {
+        return ++request_ids_;
+    }
+
+private:
+    enum class event_kind
+    {
+          delivery
+        , wake
+        , callback
+    };
+
+    struct event
+    {
+        sim_time time;
+        std::uint64_t seq;
+        event_kind kind;
+        actor_id actor;
+        std::size_t index;
+        std::shared_ptr<message_base> msg;
+    };
+
+    struct later
+    {
+        bool operator()(event const & a, event const & b) const
+        {
+            return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+        }
+    };
+
+    struct entry
+    {
+        std::string name;
+        queue * q;
+        std::function<bool()> step;
+        latency_model service;
+        sim_time busy_until = 0;
+        bool wake_pending = false;
+        // Virtual delivery times of queued messages, oldest first.
+        std::queue<sim_time> delivered;
+        actor_stats stats;
+    };
+
+    latency_model const & latency(actor_id from, actor_id to) const
+    {
+        auto it = links_.find(std::make_pair(from, to));
+        return it != links_.end() ? it->second : default_latency_;
+    }
+
+    void push_event(event ev)
+    {
+        ev.seq = next_seq_++;
+        events_.push(std::move(ev));
+    }
+
+    void wake_at(actor_id id, sim_time t)
+    {
+        auto & a = actors_[id];
+        if (not a.wake_pending)
+        {
+            a.wake_pending = true;
+            push_event(event{t, 0, event_kind::wake, id, 0, nullptr});
+        }
+    }
+
+    void deliver(actor_id id, std::shared_ptr<message_base> msg)
+    {
+        auto & a = actors_[id];
+        a.q->deliver(std::move(msg));
+        a.delivered.push(now_);
+        a.stats.max_depth = std::max(a.stats.max_depth, a.q->size());
+        wake_at(id, std::max(now_, a.busy_until));
+    }
+
+    // Steps the actor until it is idle or busy with a message.
+    void run_actor(actor_id id)
+    {
+        auto & a = actors_[id];
+        current_ = id;
+        while (true)
+        {
+            sim_time const service = a.service.sample(rng_);
+            // Messages sent while handling leave once processing completes.
+            depart_ = now_ + service;
+
+            auto const dequeued = a.q->dequeued();
+            if (not a.step())
+            {
+                break;
+            }
+            if (a.q->dequeued() == dequeued)
+            {
+                // State change only: run the new state's entry actions.
+                continue;
+            }
+
+            ++a.stats.processed;
+            a.stats.busy += service;
+            a.stats.queued += now_ - a.delivered.front();
+            a.delivered.pop();
+            if (service != 0)
+            {
+                a.busy_until = depart_;
+                wake_at(id, a.busy_until);
+                break;
+            }
+        }
+        current_ = external;
+        depart_ = now_;
+    }
+
+    sim_random rng_;
+    sim_time now_ = 0;
+    sim_time depart_ = 0;
+    actor_id current_ = external;
+    std::uint64_t next_seq_ = 0;
+    std::uint64_t events_processed_ = 0;
+    std::uint64_t request_ids_ = 0;
+
+    std::vector<entry> actors_;
+    std::map<std::pair<actor_id, actor_id>, latency_model> links_;
+    latency_model default_latency_;
+    std::vector<std::function<void()> > callbacks_;
+    std::vector<std::size_t> free_callbacks_;
+    std::priority_queue<event, std::vector<event>, later> events_;
+};
+
+}
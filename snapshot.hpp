@@ -0,0 +1,272 @@
+#pragma once
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace messaging {
+
+// Writes one snapshot of a bank's committed balances to a file, on a
+// background thread, while the bank goes on serving. The bank encodes
+// accounts into chunks as it visits them; full chunks are handed to the
+// thread, which writes them to <path>.tmp and, once finish() has been
+// called, syncs the file, renames it to <path> and syncs the directory, so
+// that the rename itself survives a crash. A crash mid-snapshot leaves the
+// previous snapshot in place.
+//
+//   header   "MQS1", WAL offset (8 bytes, little-endian)
+//   records  varint account size, account, varint PIN size, PIN,
+//            varint balance
+//   trailer  record count (8 bytes), "MQSE"
+//
+// The bank visits accounts over time, so the snapshot is fuzzy: it holds
+// each account as of the moment it was visited. Every commit after the WAL
+// offset is replayed over it on recovery, and since WAL records carry the
+// balance after the commit, replaying one the snapshot already includes is
+// harmless.
+class snapshot_writer
+{
+public:
+    static std::size_t constexpr chunk_bytes = std::size_t{1} << 16;
+
+    // Throws std::system_error if <path>.tmp cannot be created.
+    snapshot_writer(std::string path, std::uint64_t wal_offset)
+        : path_{std::move(path)}
+        , tmp_{path_ + ".tmp"}
+    {
+        fd_ = ::open(tmp_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd_ < 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "open " + tmp_};
+        }
+        chunk_.append("MQS1", 4);
+        put_fixed(wal_offset, 8);
+        thread_ = std::thread{&snapshot_writer::work, this};
+    }
+
+    // Abandons the snapshot unless finish() was called.
+    ~snapshot_writer()
+    {
+        abort();
+        try
+        {
+            wait();
+        }
+        catch (std::exception const &)
+        {
+        }
+    }
+
+    snapshot_writer(snapshot_writer const &) = delete;
+    snapshot_writer & operator=(snapshot_writer const &) = delete;
+
+    // Bank thread only.
+    void add(std::string const & account, std::string const & pin, unsigned balance)
+    {
+        put_varint(account.size());
+        chunk_ += account;
+        put_varint(pin.size());
+        chunk_ += pin;
+        put_varint(balance);
+        ++count_;
+        if (chunk_.size() >= chunk_bytes)
+        {
+            hand_off(state::writing);
+        }
+    }
+
+    // Bank thread only. Completes the snapshot in the background.
+    void finish()
+    {
+        put_fixed(count_, 8);
+        chunk_.append("MQSE", 4);
+        hand_off(state::finishing);
+    }
+
+    // Bank thread only. Deletes the partial file in the background.
+    void abort()
+    {
+        std::lock_guard<std::mutex> lock{m_};
+        if (state_ == state::writing)
+        {
+            state_ = state::aborting;
+            c_.notify_one();
+        }
+    }
+
+    // Waits for the thread; rethrows a write error.
+    void wait()
+    {
+        if (thread_.joinable())
+        {
+            thread_.join();
+        }
+        if (error_)
+        {
+            auto error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    std::uint64_t accounts() const
+    {
+        return count_;
+    }
+
+private:
+    enum class state
+    {
+          writing
+        , finishing
+        , aborting
+    };
+
+    void hand_off(state next)
+    {
+        std::lock_guard<std::mutex> lock{m_};
+        if (state_ != state::writing)
+        {
+            return;
+        }
+        chunks_.push_back(std::move(chunk_));
+        chunk_.clear();
+        chunk_.reserve(chunk_bytes + 64);
+        state_ = next;
+        c_.notify_one();
+    }
+
+    void work()
+    {
+        try
+        {
+            while (true)
+            {
+                std::string chunk;
+                {
+                    std::unique_lock<std::mutex> lock{m_};
+                    c_.wait(lock, [this]() { return not chunks_.empty() or state_ != state::writing; });
+                    if (state_ == state::aborting)
+                    {
+                        break;
+                    }
+                    if (chunks_.empty())
+                    {
+                        // Finishing, and everything is written.
+                        if (::fsync(fd_) != 0)
+                        {
+                            throw std::system_error{errno, std::generic_category(), "fsync " + tmp_};
+                        }
+                        ::close(fd_);
+                        fd_ = -1;
+                        if (std::rename(tmp_.c_str(), path_.c_str()) != 0)
+                        {
+                            throw std::system_error{errno, std::generic_category(), "rename " + tmp_};
+                        }
+                        sync_directory();
+                        return;
+                    }
+                    chunk = std::move(chunks_.front());
+                    chunks_.pop_front();
+                }
+                write_all(chunk);
+            }
+        }
+        catch (std::exception const &)
+        {
+            error_ = std::current_exception();
+        }
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        ::unlink(tmp_.c_str());
+    }
+
+    void write_all(std::string const & data)
+    {
+        char const * p = data.data();
+        std::size_t left = data.size();
+        while (left != 0)
+        {
+            ssize_t const n = ::write(fd_, p, left);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::system_error{errno, std::generic_category(), "write " + tmp_};
+            }
+            p += n;
+            left -= static_cast<std::size_t>(n);
+        }
+    }
+
+    void sync_directory()
+    {
+        std::string::size_type const slash = path_.rfind('/');
+        std::string const dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path_.substr(0, slash);
+        int const fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "open " + dir};
+        }
+        if (::fsync(fd) != 0)
+        {
+            int const error = errno;
+            ::close(fd);
+            throw std::system_error{error, std::generic_category(), "fsync " + dir};
+        }
+        ::close(fd);
+    }
+
+    void put_varint(std::uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            chunk_ += static_cast<char>(v | 0x80);
+            v >>= 7;
+        }
+        chunk_ += static_cast<char>(v);
+    }
+
+    // Little-endian.
+    void put_fixed(std::uint64_t v, unsigned bytes)
+    {
+        for (unsigned i = 0; i < bytes; ++i)
+        {
+            chunk_ += static_cast<char>(v >> (8 * i));
+        }
+    }
+
+    std::string const path_;
+    std::string const tmp_;
+    int fd_ = -1;
+
+    // Bank thread only.
+    std::string chunk_;
+    std::uint64_t count_ = 0;
+
+    std::mutex m_;
+    std::condition_variable c_;
+    std::deque<std::string> chunks_;
+    state state_ = state::writing;
+
+    std::exception_ptr error_;
+    std::thread thread_;
+};
+
+}
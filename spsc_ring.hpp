@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+namespace messaging {
+
+// Bounded lock-free ring for exactly one producer thread and one consumer
+// thread. Each side caches the other's index and only re-reads it when the
+// cached value says the ring is full (producer) or empty (consumer), so in
+// steady state a push or pop touches one shared cache line.
+template <typename T, std::size_t Capacity>
+class spsc_ring
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    static_assert(std::is_trivially_copyable<T>::value, "spsc_ring elements must be trivially copyable");
+
+public:
+    spsc_ring() = default;
+
+    spsc_ring(spsc_ring const &) = delete;
+    spsc_ring & operator=(spsc_ring const &) = delete;
+
+    // Producer only. Returns false if the ring is full.
+    bool try_push(T const & value)
+    {
+        std::size_t const tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ == Capacity)
+        {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ == Capacity)
+            {
+                return false;
+            }
+        }
+        buf_[tail & mask] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Pops up to `max` elements into `out`; returns the count.
+    std::size_t try_pop(T * out, std::size_t max)
+    {
+        std::size_t const head = head_.load(std::memory_order_relaxed);
+        if (tail_cache_ == head)
+        {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (tail_cache_ == head)
+            {
+                return 0;
+            }
+        }
+        std::size_t const n = std::min(max, tail_cache_ - head);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            out[i] = buf_[(head + i) & mask];
+        }
+        head_.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    // Either side; exact only when the other side is idle.
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    std::size_t size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+private:
+    static std::size_t constexpr mask = Capacity - 1;
+    static std::size_t constexpr cache_line = 64;
+
+    // Consumer side, then producer side, each on its own cache line. Padding
+    // rather than alignas, since over-aligned new needs C++17.
+    char pad0_[cache_line];
+    std::atomic<std::size_t> head_{0};
+    std::size_t tail_cache_ = 0;
+    char pad1_[cache_line - 2 * sizeof(std::size_t)];
+    std::atomic<std::size_t> tail_{0};
+    std::size_t head_cache_ = 0;
+    char pad2_[cache_line - 2 * sizeof(std::size_t)];
+    T buf_[Capacity];
+};
+
+}
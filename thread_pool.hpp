@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace messaging {
+
+// Fixed set of worker threads for batch jobs outside the actors, such as
+// end-of-day reconciliation or bulk loading.
+//
+//   thread_pool pool{4};
+//   pool.parallel_for(parts, [&](std::size_t part) { ... });
+class thread_pool
+{
+public:
+    explicit thread_pool(unsigned workers = std::thread::hardware_concurrency())
+    {
+        for (unsigned i = 0; i < std::max(workers, 1u); ++i)
+        {
+            workers_.emplace_back(&thread_pool::work, this);
+        }
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{m_};
+            stopping_ = true;
+        }
+        c_.notify_all();
+        for (auto & w : workers_)
+        {
+            w.join();
+        }
+    }
+
+    thread_pool(thread_pool const &) = delete;
+    thread_pool & operator=(thread_pool const &) = delete;
+
+    std::size_t size() const
+    {
+        return workers_.size();
+    }
+
+    // Runs f(0) .. f(parts - 1) on the workers and waits for all of them.
+    // The first exception thrown by any part is rethrown here.
+    template <typename Func>
+    void parallel_for(std::size_t parts, Func const & f)
+    {
+        struct job
+        {
+            std::mutex m;
+            std::condition_variable done;
+            std::size_t left;
+            std::exception_ptr error;
+        } j;
+        j.left = parts;
+
+        {
+            std::lock_guard<std::mutex> lock{m_};
+            for (std::size_t part = 0; part < parts; ++part)
+            {
+                tasks_.push_back(
+                    [&j, &f, part]()
+                    {
+                        std::exception_ptr error;
+                        try
+                        {
+                            f(part);
+                        }
+                        catch (...)
+                        {
+                            error = std::current_exception();
+                        }
+                        std::lock_guard<std::mutex> lock{j.m};
+                        if (error and not j.error)
+                        {
+                            j.error = error;
+                        }
+                        if (--j.left == 0)
+                        {
+                            j.done.notify_one();
+                        }
+                    });
+            }
+        }
+        c_.notify_all();
+
+        std::unique_lock<std::mutex> lock{j.m};
+        j.done.wait(lock, [&j]() { return j.left == 0; });
+        if (j.error)
+        {
+            std::rethrow_exception(j.error);
+        }
+    }
+
+private:
+    void work()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock{m_};
+                c_.wait(lock, [this]() { return stopping_ or not tasks_.empty(); });
+                if (tasks_.empty())
+                {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex m_;
+    std::condition_variable c_;
+    std::deque<std::function<void()> > tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+}
@@ -0,0 +1,1032 @@
+#pragma once
+
+#include "input.hpp"
+#include "introspect.hpp"
+#include "journal.hpp"
+#include "loader.hpp"
+#include "queue.hpp"
+#include "reconcile.hpp"
+#include "replica.hpp"
+#include "thread_pool.hpp"
+
+#if defined(__x86_64__)
+#include "fiber.hpp"
+#endif
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace messaging {
+
+// How the actors are laid out over threads, and how they are linked.
+//
+// Read from a file of `key = value` lines; `#` starts a comment:
+//
+//   atms = 8                # atm actors, each with its own interface
+//   bank_shards = 2         # bank_machine actors; accounts are spread over
+//   grow_shards = 4         # them by consistent hashing, and after
+//   grow_after_s = 60       # grow_after_s shards are added up to grow_shards,
+//                           # moving accounts over while they keep serving
+//   replicas = 2            # per shard, fed from its WAL, answering balance
+//   replica_staleness_ms = 100 # queries while no further behind than this
+//   terminal_rate = 20      # requests per second each terminal may make of
+//   terminal_burst = 10     # the banks, and all terminals together; those
+//   bank_rate = 5000        # over the limit are answered busy at once
+//   bank_burst = 500        # instead of queueing. 0: unlimited
+//   aqm_target_ms = 5       # banks answer balance and statement queries
+//   aqm_interval_ms = 100   # busy while messages wait longer than the
+//                           # target for an interval. 0: off
+//   bank_workers = 1        # 0: a thread per shard; N: shards as fibers on N
+//   fibers = 0              # threads, or every actor as one (x86-64 only)
+//   display_link = channel  # atm -> interface: channel | queue
+//   display = null          # interface output: stdout | null
+//   input = fifo            # terminals besides stdin: none | fifo | pty
+//   input_dir = /tmp        # fifo i is <input_dir>/atm<i>
+//   cpus.bank = 0           # CPU lists, e.g. 0-3,6; threads of a kind are
+//   cpus.atm = 1-3          # assigned their list's CPUs round robin
+//   cpus.interface = 4
+//   cpus.input = 5
+//   cpus.fibers = 1-4
+//   wal = /tmp/bank.wal     # shard i logs commits to <wal>.<i>
+//   hold_timeout_s = 600    # funds held for a withdrawal that is neither
+//                           # committed nor cancelled are then released
+//   accounts = accounts.csv # account,pin,balance lines loaded at startup;
+//                           # other accounts are refused
+//   snapshot = /tmp/bank.snap # shard i snapshots to <snapshot>.<i> and, with
+//   snapshot_interval_s = 60  # a wal, restarts from it plus the WAL after it,
+//                             # on top of the accounts export
+//   load_workers = 0        # 0: one per CPU
+//   pins = accounts.csv     # account,pin,balance lines; PINs are reloaded
+//   pins_reload_s = 5       # when the file changes, without pausing banks;
+//                           # accounts missing from it have no valid PIN
+//   journal = /tmp/atm.jnl  # every message to an actor, in segments <journal>.<n>
+//   journal_segment_mb = 64
+//   introspect = /tmp/atm.sock
+//   report = true           # print message throughput on exit
+//   reconcile = true        # compare cash debited and dispensed in the
+//                           # journal's segments on exit; needs a journal
+//   reconcile_workers = 4   # 0: one per CPU
+//
+// Stdin always feeds atm 0, and q on any terminal shuts everything down.
+struct topology_config
+{
+    enum class link_backend
+    {
+          channel
+        , queue
+    };
+
+    enum class input_kind
+    {
+          none
+        , fifo
+        , pty
+    };
+
+    unsigned atms = 1;
+    unsigned bank_shards = 1;
+    unsigned grow_shards = 0;
+    unsigned grow_after_s = 60;
+    unsigned replicas = 0;
+    unsigned replica_staleness_ms = 100;
+    unsigned terminal_rate = 0;
+    unsigned terminal_burst = 10;
+    unsigned bank_rate = 0;
+    unsigned bank_burst = 500;
+    unsigned aqm_target_ms = 0;
+    unsigned aqm_interval_ms = 100;
+    unsigned bank_workers = 0;
+    unsigned fibers = 0;
+    link_backend display_link = link_backend::channel;
+    bool null_display = false;
+    input_kind input = input_kind::none;
+    std::string input_dir = "/tmp";
+    std::vector<int> bank_cpus;
+    std::vector<int> atm_cpus;
+    std::vector<int> interface_cpus;
+    std::vector<int> input_cpus;
+    std::vector<int> fiber_cpus;
+    std::string wal;
+    unsigned hold_timeout_s = 600;
+    std::string accounts;
+    std::string pins;
+    unsigned pins_reload_s = 5;
+    std::string snapshot;
+    unsigned snapshot_interval_s = 60;
+    unsigned load_workers = 0;
+    std::string journal;
+    unsigned journal_segment_mb = 64;
+    std::string introspect;
+    bool report = false;
+    bool reconcile = false;
+    unsigned reconcile_workers = 0;
+
+    // Throws std::invalid_argument for an unknown key or a bad value.
+    void set(std::string const & key, std::string const & value)
+    {
+        if (key == "atms") atms = count(key, value, 1);
+        else if (key == "bank_shards") bank_shards = count(key, value, 1);
+        else if (key == "grow_shards") grow_shards = count(key, value, 0);
+        else if (key == "grow_after_s") grow_after_s = count(key, value, 1);
+        else if (key == "replicas") replicas = count(key, value, 0);
+        else if (key == "replica_staleness_ms") replica_staleness_ms = count(key, value, 1);
+        else if (key == "terminal_rate") terminal_rate = count(key, value, 0);
+        else if (key == "terminal_burst") terminal_burst = count(key, value, 1);
+        else if (key == "bank_rate") bank_rate = count(key, value, 0);
+        else if (key == "bank_burst") bank_burst = count(key, value, 1);
+        else if (key == "aqm_target_ms") aqm_target_ms = count(key, value, 0);
+        else if (key == "aqm_interval_ms") aqm_interval_ms = count(key, value, 1);
+        else if (key == "bank_workers") bank_workers = count(key, value, 0);
+        else if (key == "fibers") fibers = count(key, value, 0);
+        else if (key == "display_link") display_link = choose(key, value, {"channel", "queue"}) == 0 ? link_backend::channel : link_backend::queue;
+        else if (key == "display") null_display = choose(key, value, {"stdout", "null"}) == 1;
+        else if (key == "input") input = static_cast<input_kind>(choose(key, value, {"none", "fifo", "pty"}));
+        else if (key == "input_dir") input_dir = value;
+        else if (key == "cpus.bank") bank_cpus = cpu_list(key, value);
+        else if (key == "cpus.atm") atm_cpus = cpu_list(key, value);
+        else if (key == "cpus.interface") interface_cpus = cpu_list(key, value);
+        else if (key == "cpus.input") input_cpus = cpu_list(key, value);
+        else if (key == "cpus.fibers") fiber_cpus = cpu_list(key, value);
+        else if (key == "wal") wal = value;
+        else if (key == "hold_timeout_s") hold_timeout_s = count(key, value, 1);
+        else if (key == "accounts") accounts = value;
+        else if (key == "pins") pins = value;
+        else if (key == "pins_reload_s") pins_reload_s = count(key, value, 1);
+        else if (key == "snapshot") snapshot = value;
+        else if (key == "snapshot_interval_s") snapshot_interval_s = count(key, value, 1);
+        else if (key == "load_workers") load_workers = count(key, value, 0);
+        else if (key == "journal") journal = value;
+        else if (key == "journal_segment_mb") journal_segment_mb = count(key, value, 1);
+        else if (key == "introspect") introspect = value;
+        else if (key == "report") report = choose(key, value, {"false", "true"}) == 1;
+        else if (key == "reconcile") reconcile = choose(key, value, {"false", "true"}) == 1;
+        else if (key == "reconcile_workers") reconcile_workers = count(key, value, 0);
+        else throw std::invalid_argument{"unknown key " + key};
+    }
+
+    // Throws std::runtime_error naming the file and line of any error.
+    static topology_config load(std::string const & path)
+    {
+        std::ifstream in{path};
+        if (not in)
+        {
+            throw std::runtime_error{"cannot open topology " + path};
+        }
+        topology_config config;
+        std::string line;
+        for (unsigned number = 1; std::getline(in, line); ++number)
+        {
+            line = trim(line.substr(0, line.find('#')));
+            if (line.empty())
+            {
+                continue;
+            }
+            auto const eq = line.find('=');
+            if (eq == std::string::npos)
+            {
+                throw std::runtime_error{path + ":" + std::to_string(number) + ": expected key = value"};
+            }
+            try
+            {
+                config.set(trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+            }
+            catch (std::invalid_argument const & e)
+            {
+                throw std::runtime_error{path + ":" + std::to_string(number) + ": " + e.what()};
+            }
+        }
+        return config;
+    }
+
+private:
+    static std::string trim(std::string const & s)
+    {
+        auto const first = s.find_first_not_of(" \t\r");
+        if (first == std::string::npos)
+        {
+            return "";
+        }
+        return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+    }
+
+    static unsigned count(std::string const & key, std::string const & value, unsigned min)
+    {
+        char * end = nullptr;
+        unsigned long const n = std::strtoul(value.c_str(), &end, 10);
+        if (value.empty() or *end != '\0' or n < min or n > 1000000)
+        {
+            throw std::invalid_argument{"bad value for " + key + ": " + value};
+        }
+        return static_cast<unsigned>(n);
+    }
+
+    static std::size_t choose(std::string const & key, std::string const & value, std::initializer_list<char const *> options)
+    {
+        std::size_t i = 0;
+        for (char const * option : options)
+        {
+            if (value == option)
+            {
+                return i;
+            }
+            ++i;
+        }
+        throw std::invalid_argument{"bad value for " + key + ": " + value};
+    }
+
+    // "0-3,6" -> 0 1 2 3 6
+    static std::vector<int> cpu_list(std::string const & key, std::string const & value)
+    {
+        std::vector<int> cpus;
+        std::istringstream in{value};
+        std::string range;
+        while (std::getline(in, range, ','))
+        {
+            int first = 0;
+            int last = 0;
+            char dash = 0;
+            std::istringstream r{trim(range)};
+            if (not (r >> first) or first < 0 or first >= CPU_SETSIZE)
+            {
+                throw std::invalid_argument{"bad CPU list for " + key + ": " + value};
+            }
+            last = first;
+            if (r >> dash and (dash != '-' or not (r >> last) or last < first or last >= CPU_SETSIZE))
+            {
+                throw std::invalid_argument{"bad CPU list for " + key + ": " + value};
+            }
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+};
+
+
+// Pins a thread to the index-th CPU of `cpus`, round robin; no-op if empty.
+inline void pin_thread(pthread_t thread, std::vector<int> const & cpus, std::size_t index)
+{
+    if (cpus.empty())
+    {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % cpus.size()], &set);
+    if (int const err = ::pthread_setaffinity_np(thread, sizeof(set), &set))
+    {
+        throw std::system_error{err, std::generic_category(), "pthread_setaffinity_np"};
+    }
+}
+
+
+// Throws std::runtime_error if a CPU list names a CPU this process may not
+// run on, before any thread has been started on it.
+inline void check_cpus(topology_config const & config)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (::sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        throw std::system_error{errno, std::generic_category(), "sched_getaffinity"};
+    }
+    std::pair<char const *, std::vector<int> const *> const lists[] = {
+          {"cpus.bank", &config.bank_cpus}
+        , {"cpus.atm", &config.atm_cpus}
+        , {"cpus.interface", &config.interface_cpus}
+        , {"cpus.input", &config.input_cpus}
+        , {"cpus.fibers", &config.fiber_cpus}
+        };
+    for (auto const & list : lists)
+    {
+        for (int cpu : *list.second)
+        {
+            if (not CPU_ISSET(cpu, &allowed))
+            {
+                throw std::runtime_error{std::string{list.first} + ": CPU " + std::to_string(cpu) + " is not available"};
+            }
+        }
+    }
+}
+
+
+// Builds the actors described by a topology_config, runs them until input
+// ends or q is pressed, then drains and joins them. Returns an exit status.
+inline int launch_topology(topology_config const & config)
+{
+#if not defined(__x86_64__)
+    if (config.fibers != 0 or config.bank_workers != 0)
+    {
+        throw std::runtime_error{"fibers and bank_workers need x86-64"};
+    }
+#endif
+    if (config.replicas != 0 and config.wal.empty())
+    {
+        throw std::runtime_error{"replicas need a wal to follow"};
+    }
+    if (config.reconcile and config.journal.empty())
+    {
+        throw std::runtime_error{"reconcile needs a journal to read"};
+    }
+    check_cpus(config);
+
+    std::unique_ptr<introspection_server> introspection;
+    if (not config.introspect.empty())
+    {
+        introspection.reset(new introspection_server{config.introspect});
+    }
+
+    // Closed however launch_topology returns, after the actors that use
+    // them are gone.
+    struct descriptors
+    {
+        int display = STDOUT_FILENO;
+        std::vector<int> wal;
+
+        ~descriptors()
+        {
+            if (display != STDOUT_FILENO)
+            {
+                ::close(display);
+            }
+            for (int fd : wal)
+            {
+                ::close(fd);
+            }
+        }
+    } fds;
+    if (config.null_display)
+    {
+        fds.display = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (fds.display < 0)
+        {
+            fds.display = STDOUT_FILENO;
+            throw std::system_error{errno, std::generic_category(), "open /dev/null"};
+        }
+    }
+
+    // Only queue waits park a fiber, so fibers always use the queue link.
+    bool const use_channel = config.display_link == topology_config::link_backend::channel and config.fibers == 0;
+
+    std::unique_ptr<journal_writer> journal;
+    if (not config.journal.empty())
+    {
+        journal.reset(new journal_writer{config.journal, std::size_t{config.journal_segment_mb} << 20});
+    }
+    auto attach_journal = [&journal](queue & q, std::string const & name)
+    {
+        if (journal)
+        {
+            q.journal_to(journal.get(), journal->add_queue(name));
+        }
+    };
+
+    // Outlives the banks, which read it.
+    std::unique_ptr<rcu_cell<pin_table> > pins;
+    struct timespec pins_mtime{};
+    if (not config.pins.empty())
+    {
+        struct stat st;
+        if (::stat(config.pins.c_str(), &st) != 0)
+        {
+            throw std::system_error{errno, std::generic_category(), "stat " + config.pins};
+        }
+        pins_mtime = st.st_mtim;
+        thread_pool pool{config.load_workers != 0 ? config.load_workers : std::thread::hardware_concurrency()};
+        pins.reset(new rcu_cell<pin_table>{load_pins(config.pins, pool)});
+    }
+
+    // Outlives the banks and atms, which read it. A single shard that never
+    // grows is sent to directly.
+    std::unique_ptr<shard_router> router;
+    std::vector<std::unique_ptr<bank_machine> > banks;
+    std::vector<std::unique_ptr<replica_machine> > replicas;
+    std::vector<std::unique_ptr<wal_shipper> > shippers;
+    std::vector<std::unique_ptr<interface_machine> > interfaces;
+    std::vector<std::unique_ptr<atm> > machines;
+    auto add_bank = [&](unsigned i)
+    {
+        int wal_fd = -1;
+        if (not config.wal.empty())
+        {
+            std::string const path = config.wal + "." + std::to_string(i);
+            wal_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+            if (wal_fd < 0)
+            {
+                throw std::system_error{errno, std::generic_category(), "open " + path};
+            }
+            fds.wal.push_back(wal_fd);
+        }
+        std::unique_ptr<bank_machine> bank{new bank_machine{wal_fd}};
+        bank->expire_holds_after(std::chrono::seconds{config.hold_timeout_s});
+        if (not config.accounts.empty())
+        {
+            bank->reject_unknown_accounts();
+        }
+        if (pins)
+        {
+            bank->use_pins(*pins);
+        }
+        if (config.aqm_target_ms != 0)
+        {
+            bank->manage_queue(std::chrono::milliseconds{config.aqm_target_ms}, std::chrono::milliseconds{config.aqm_interval_ms});
+        }
+        return bank;
+    };
+    // Creates shard i's replicas, each a copy of `balances` kept up to date
+    // from byte `offset` of the shard's WAL on.
+    auto add_replicas = [&](unsigned i, account_table<unsigned> const & balances, std::uint64_t offset)
+    {
+        std::chrono::milliseconds const staleness{config.replica_staleness_ms};
+        // Often enough that a replica falls behind only when it is slow.
+        auto const interval = std::max(std::chrono::milliseconds{1}, staleness / 4);
+        std::vector<replica_machine *> added;
+        for (unsigned n = 0; n < config.replicas; ++n)
+        {
+            replicas.emplace_back(new replica_machine{banks[i]->get_sender(), balances, staleness});
+            shippers.emplace_back(new wal_shipper{config.wal + "." + std::to_string(i), offset, replicas.back()->get_sender(), interval});
+            added.push_back(replicas.back().get());
+        }
+        return added;
+    };
+    for (unsigned i = 0; i < config.bank_shards; ++i)
+    {
+        banks.push_back(add_bank(i));
+        attach_journal(banks.back()->get_queue(), "bank" + std::to_string(i));
+    }
+    if (banks.size() > 1 or config.grow_shards > banks.size() or config.replicas != 0)
+    {
+        std::vector<sender> shards;
+        for (auto & b : banks)
+        {
+            shards.push_back(b->get_sender());
+        }
+        router.reset(new shard_router{shards});
+        for (unsigned i = 0; i < banks.size(); ++i)
+        {
+            banks[i]->join_shards(*router, i);
+        }
+    }
+    if (not config.accounts.empty() or not config.snapshot.empty() or not config.wal.empty())
+    {
+        // Each shard starts from its own part of the CSV accounts, loads its
+        // snapshot over them, replays its WAL and keeps the accounts it owns.
+        // Restart with bank_shards set to the grown count, so that accounts
+        // moved by a rebalance are found where it put them.
+        auto const load_start = std::chrono::steady_clock::now();
+        thread_pool pool{config.load_workers != 0 ? config.load_workers : std::thread::hardware_concurrency()};
+        account_table<bank_machine::account> accounts{pool.size()};
+        if (not config.accounts.empty())
+        {
+            accounts = load_accounts(config.accounts, pool);
+        }
+        std::size_t const loaded = accounts.size();
+        std::vector<account_table<bank_machine::account> > tables;
+        if (router)
+        {
+            // Partition p of every shard's table is filled from partition p
+            // of the loaded one, so the partitions split in parallel.
+            auto const routes = router->current();
+            tables.assign(banks.size(), account_table<bank_machine::account>{accounts.partitions()});
+            pool.parallel_for(
+                  accounts.partitions()
+                , [&](std::size_t p)
+                {
+                    auto & part = accounts.partition(p);
+                    for (auto & table : tables)
+                    {
+                        table.partition(p).reserve(part.size() / banks.size() + part.size() / 8);
+                    }
+                    for (auto & a : part)
+                    {
+                        tables[routes.find(a.first).owner].partition(p).emplace(a.first, std::move(a.second));
+                    }
+                    part = account_table<bank_machine::account>::partition_type{};
+                });
+        }
+        else
+        {
+            tables.push_back(std::move(accounts));
+        }
+        std::size_t replayed = 0;
+        for (unsigned i = 0; i < banks.size(); ++i)
+        {
+            auto & table = tables[i];
+            std::uint64_t wal_offset = 0;
+            // The CSV part is already this shard's own; a snapshot or WAL
+            // can still hold accounts that a rebalance has moved away since.
+            bool restored = false;
+            std::string const snapshot = config.snapshot + "." + std::to_string(i);
+            if (not config.snapshot.empty() and ::access(snapshot.c_str(), F_OK) == 0)
+            {
+                wal_offset = load_snapshot(snapshot, table);
+                restored = true;
+            }
+            if (not config.wal.empty())
+            {
+                std::size_t const commits = replay_wal(config.wal + "." + std::to_string(i), wal_offset, table);
+                replayed += commits;
+                restored = restored or commits != 0;
+            }
+            if (router and restored)
+            {
+                auto const routes = router->current();
+                for (std::size_t p = 0; p < table.partitions(); ++p)
+                {
+                    auto & part = table.partition(p);
+                    for (auto a = part.begin(); a != part.end();)
+                    {
+                        a = routes.find(a->first).owner == i ? std::next(a) : part.erase(a);
+                    }
+                }
+            }
+            if (config.replicas != 0)
+            {
+                account_table<unsigned> balances{table.partitions()};
+                table.for_each(
+                    [&balances](std::string const & id, bank_machine::account const & a)
+                    {
+                        balances[id] = a.balance;
+                    });
+                off_t const end = ::lseek(fds.wal[i], 0, SEEK_END);
+                for (auto const & r : add_replicas(i, balances, end > 0 ? static_cast<std::uint64_t>(end) : 0))
+                {
+                    attach_journal(r->get_queue(), "replica" + std::to_string(i));
+                    router->add_replica(i, r->get_sender());
+                }
+            }
+            banks[i]->load(std::move(table));
+        }
+        if (config.report)
+        {
+            std::cerr << "loaded " << loaded << " accounts, replayed " << replayed << " commits in "
+                      << std::chrono::duration<double>(std::chrono::steady_clock::now() - load_start).count()
+                      << " s" << std::endl;
+        }
+    }
+    // Outlives the atms, which check it; terminal i is atm i.
+    std::unique_ptr<admission_control> admission;
+    if (config.terminal_rate != 0 or config.bank_rate != 0)
+    {
+        admission.reset(new admission_control{
+            config.atms, static_cast<double>(config.terminal_rate), config.terminal_burst
+            , static_cast<double>(config.bank_rate), config.bank_burst});
+    }
+    for (unsigned i = 0; i < config.atms; ++i)
+    {
+        interfaces.emplace_back(new interface_machine{fds.display});
+        auto & ui = *interfaces.back();
+        bank_link link = router ? bank_link{*router} : bank_link{banks[0]->get_sender()};
+        if (admission)
+        {
+            link.limit(*admission, i);
+        }
+        display_link display = use_channel ? display_link{ui.get_display_channel()} : display_link{ui.get_sender()};
+        if (journal)
+        {
+            std::uint32_t const id = journal->add_queue("interface" + std::to_string(i));
+            ui.get_queue().journal_to(journal.get(), id);
+            display.journal_to(journal.get(), id);
+        }
+        machines.emplace_back(new atm{std::move(link), std::move(display), i});
+        attach_journal(machines.back()->get_queue(), "atm" + std::to_string(i));
+    }
+
+    // Terminals are opened before any actor starts, so that one failing to
+    // open has nothing to stop.
+    input_multiplexer input;
+    input.add(STDIN_FILENO, machines[0]->get_sender());
+    for (unsigned i = 0; i < config.atms; ++i)
+    {
+        if (config.input == topology_config::input_kind::fifo)
+        {
+            input.add_fifo(config.input_dir + "/atm" + std::to_string(i), machines[i]->get_sender());
+        }
+        else if (config.input == topology_config::input_kind::pty)
+        {
+            std::cerr << "atm " << i << ": " << input.add_pty(machines[i]->get_sender()) << std::endl;
+        }
+    }
+
+#if defined(__x86_64__)
+    // Fiber workers cannot throw to the caller, so a failed pin only warns.
+    auto pin_worker = [](char const * kind, std::vector<int> const & cpus)
+    {
+        return [kind, &cpus](unsigned i)
+        {
+            try
+            {
+                pin_thread(::pthread_self(), cpus, i);
+            }
+            catch (std::system_error const & e)
+            {
+                std::cerr << kind << " worker " << i << ": " << e.what() << std::endl;
+            }
+        };
+    };
+
+    std::unique_ptr<fiber_scheduler> fibers;
+    std::unique_ptr<fiber_scheduler> bank_fibers;
+    if (config.fibers != 0)
+    {
+        fibers.reset(new fiber_scheduler{config.fibers, pin_worker("fiber", config.fiber_cpus)});
+    }
+    else if (config.bank_workers != 0)
+    {
+        bank_fibers.reset(new fiber_scheduler{config.bank_workers, pin_worker("bank", config.bank_cpus)});
+    }
+#endif
+
+    std::vector<std::thread> bank_threads;
+    std::vector<std::thread> interface_threads;
+    std::vector<std::thread> atm_threads;
+    // Background jobs, each run every so many seconds until input ends.
+    std::mutex periodic_m;
+    std::condition_variable periodic_c;
+    bool input_done = false;
+    std::vector<std::thread> periodic;
+    auto every = [&](unsigned seconds, std::function<void()> job)
+    {
+        periodic.emplace_back(
+            [&, seconds, job]()
+            {
+                std::unique_lock<std::mutex> lock{periodic_m};
+                while (not periodic_c.wait_for(lock, std::chrono::seconds{seconds}, [&]() { return input_done; }))
+                {
+                    lock.unlock();
+                    job();
+                    lock.lock();
+                }
+            });
+    };
+    // Guards banks while shards are added.
+    std::mutex banks_m;
+    // Stops and joins everything started so far: once input ends or, if
+    // launching fails part way, on the way out, since a joinable thread
+    // left behind would terminate the process.
+    bool shut = false;
+    auto shut_down = [&]()
+    {
+        if (shut)
+        {
+            return;
+        }
+        shut = true;
+        {
+            std::lock_guard<std::mutex> lock{periodic_m};
+            input_done = true;
+        }
+        periodic_c.notify_all();
+        for (auto & t : periodic)
+        {
+            t.join();
+        }
+        for (auto & s : shippers)
+        {
+            s->stop();
+        }
+
+        // Let each actor finish what is already queued, for at most a second.
+        // atms stop first: input read in one go may still be queued for them,
+        // and each is its display channel's only producer.
+        auto const drain_timeout = std::chrono::seconds{1};
+        for (auto & m : machines)
+        {
+            m->stop(stop_mode::drain, drain_timeout);
+        }
+        for (auto & t : atm_threads)
+        {
+            t.join();
+        }
+        for (auto & b : banks)
+        {
+            b->stop(stop_mode::drain, drain_timeout);
+        }
+        for (auto & r : replicas)
+        {
+            r->stop(stop_mode::drain, drain_timeout);
+        }
+        for (auto & ui : interfaces)
+        {
+            ui->stop(stop_mode::drain, drain_timeout);
+        }
+        for (auto & t : bank_threads)
+        {
+            t.join();
+        }
+        for (auto & t : interface_threads)
+        {
+            t.join();
+        }
+#if defined(__x86_64__)
+        if (bank_fibers)
+        {
+            bank_fibers->join();
+        }
+        if (fibers)
+        {
+            fibers->join();
+        }
+#endif
+    };
+    struct shut_down_on_exit
+    {
+        std::function<void()> f;
+
+        ~shut_down_on_exit()
+        {
+            f();
+        }
+    } shut_down_guard{shut_down};
+
+    auto const start = std::chrono::steady_clock::now();
+
+    // Banks and their replicas, including those added while running.
+    auto start_bank_side = [&](std::function<void()> run)
+    {
+#if defined(__x86_64__)
+        if (fibers)
+        {
+            fibers->spawn(std::move(run));
+            return;
+        }
+        if (bank_fibers)
+        {
+            bank_fibers->spawn(std::move(run));
+            return;
+        }
+#endif
+        bank_threads.emplace_back(std::move(run));
+        pin_thread(bank_threads.back().native_handle(), config.bank_cpus, bank_threads.size() - 1);
+    };
+    for (auto & b : banks)
+    {
+        bank_machine * const bank = b.get();
+        start_bank_side([bank]() { bank->run(); });
+    }
+    for (auto & r : replicas)
+    {
+        replica_machine * const replica = r.get();
+        start_bank_side([replica]() { replica->run(); });
+    }
+#if defined(__x86_64__)
+    if (fibers)
+    {
+        for (auto & ui : interfaces)
+        {
+            fibers->spawn([&ui]() { ui->run(); });
+        }
+        for (auto & m : machines)
+        {
+            fibers->spawn([&m]() { m->run(); });
+        }
+    }
+    else
+#endif
+    {
+        for (auto & ui : interfaces)
+        {
+            interface_threads.emplace_back(use_channel ? &interface_machine::run_display : &interface_machine::run, ui.get());
+            pin_thread(interface_threads.back().native_handle(), config.interface_cpus, interface_threads.size() - 1);
+        }
+        for (auto & m : machines)
+        {
+            atm_threads.emplace_back(&atm::run, m.get());
+            pin_thread(atm_threads.back().native_handle(), config.atm_cpus, atm_threads.size() - 1);
+        }
+    }
+
+    if (not config.snapshot.empty())
+    {
+        every(
+              config.snapshot_interval_s
+            , [&]()
+            {
+                std::lock_guard<std::mutex> lock{banks_m};
+                for (unsigned i = 0; i < banks.size(); ++i)
+                {
+                    banks[i]->get_sender().send(take_snapshot{config.snapshot + "." + std::to_string(i)});
+                }
+            });
+    }
+    if (pins)
+    {
+        // Rebuilt off the banks' threads whenever the file changes; the
+        // banks pick the new version up on their next PIN check.
+        every(
+              config.pins_reload_s
+            , [&]()
+            {
+                struct stat st;
+                if (::stat(config.pins.c_str(), &st) != 0
+                    or (st.st_mtim.tv_sec == pins_mtime.tv_sec and st.st_mtim.tv_nsec == pins_mtime.tv_nsec))
+                {
+                    pins->reclaim();
+                    return;
+                }
+                try
+                {
+                    thread_pool pool{config.load_workers != 0 ? config.load_workers : std::thread::hardware_concurrency()};
+                    auto next = load_pins(config.pins, pool);
+                    auto const size = next->size();
+                    pins->publish(std::move(next));
+                    pins_mtime = st.st_mtim;
+                    std::cerr << "reloaded " << size << " PINs from " << config.pins << std::endl;
+                }
+                catch (std::exception const & e)
+                {
+                    // Keeps the current version; retried on the next change.
+                    std::cerr << e.what() << std::endl;
+                    pins_mtime = st.st_mtim;
+                }
+            });
+    }
+
+    if (router and config.grow_shards > banks.size())
+    {
+        periodic.emplace_back(
+            [&]()
+            {
+                std::unique_lock<std::mutex> lock{periodic_m};
+                if (periodic_c.wait_for(lock, std::chrono::seconds{config.grow_after_s}, [&]() { return input_done; }))
+                {
+                    return;
+                }
+                lock.unlock();
+                for (unsigned i = banks.size(); i < config.grow_shards; ++i)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock{periodic_m};
+                        if (input_done)
+                        {
+                            return;
+                        }
+                    }
+                    auto const rebalance_start = std::chrono::steady_clock::now();
+                    // Not journaled: the journal's queues are fixed once
+                    // it is being written.
+                    auto bank = add_bank(i);
+                    bank->join_shards(*router, i);
+                    bank_machine * const b = bank.get();
+                    {
+                        std::lock_guard<std::mutex> lock{banks_m};
+                        banks.push_back(std::move(bank));
+                    }
+                    try
+                    {
+                        start_bank_side([b]() { b->run(); });
+                    }
+                    catch (std::system_error const & e)
+                    {
+                        // add_shard() waits for the new bank to take its
+                        // ranges, so give up on one that may not be running.
+                        std::cerr << "bank shard " << i << ": " << e.what() << "; not growing further" << std::endl;
+                        return;
+                    }
+                    auto const moved = router->add_shard(b->get_sender());
+                    std::cerr << "added bank shard " << i << ", moved " << moved << " accounts in "
+                              << std::chrono::duration<double>(std::chrono::steady_clock::now() - rebalance_start).count()
+                              << " s" << std::endl;
+                    // Its replicas start empty, and so read its WAL from
+                    // the beginning, which holds every account moved in.
+                    for (auto const & r : add_replicas(i, account_table<unsigned>{}, 0))
+                    {
+                        try
+                        {
+                            start_bank_side([r]() { r->run(); });
+                        }
+                        catch (std::system_error const & e)
+                        {
+                            std::cerr << "bank shard " << i << " replica: " << e.what() << std::endl;
+                        }
+                        router->add_replica(i, r->get_sender());
+                    }
+                }
+            });
+    }
+
+    pin_thread(::pthread_self(), config.input_cpus, 0);
+    input.run();
+    shut_down();
+    auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (journal)
+    {
+        journal->close();
+    }
+
+    std::uint64_t messages = 0;
+    auto report = [&messages](char const * name, unsigned index, queue const & q, stop_report const & r)
+    {
+        messages += q.dequeued();
+        if (r.discarded != 0)
+        {
+            std::cerr << name << ' ' << index << ": processed " << r.processed << ", discarded " << r.discarded << " on shutdown" << std::endl;
+        }
+    };
+    for (unsigned i = 0; i < banks.size(); ++i)
+    {
+        report("bank", i, banks[i]->get_queue(), banks[i]->get_stop_report());
+    }
+    for (unsigned i = 0; i < replicas.size(); ++i)
+    {
+        report("replica", i, replicas[i]->get_queue(), replicas[i]->get_stop_report());
+    }
+    for (unsigned i = 0; i < machines.size(); ++i)
+    {
+        report("atm", i, machines[i]->get_queue(), machines[i]->get_stop_report());
+    }
+    for (unsigned i = 0; i < interfaces.size(); ++i)
+    {
+        report("interface", i, interfaces[i]->get_queue(), interfaces[i]->get_stop_report());
+    }
+    if (config.report)
+    {
+        // Queue messages only; display channel commands are not counted.
+        std::cerr << "atms=" << config.atms
+                  << " bank_shards=" << banks.size()
+                  << " elapsed_s=" << elapsed
+                  << " messages=" << messages
+                  << " messages_per_s=" << static_cast<double>(messages) / elapsed;
+        if (journal)
+        {
+            std::cerr << " journaled=" << journal->records() << " journal_dropped=" << journal->dropped()
+                      << " segments=" << journal->segments();
+        }
+        if (router)
+        {
+            std::uint64_t forwarded = 0;
+            for (auto const & b : banks)
+            {
+                forwarded += b->forwarded();
+            }
+            std::cerr << " forwarded=" << forwarded;
+        }
+        if (admission)
+        {
+            std::cerr << " busy=" << admission->rejected();
+        }
+        if (config.aqm_target_ms != 0)
+        {
+            std::uint64_t shed = 0;
+            for (auto const & b : banks)
+            {
+                shed += b->shed();
+            }
+            std::cerr << " shed=" << shed;
+        }
+        if (not replicas.empty())
+        {
+            std::uint64_t answered = 0;
+            std::uint64_t passed_on = 0;
+            for (auto const & r : replicas)
+            {
+                answered += r->answered();
+                passed_on += r->forwarded();
+            }
+            std::cerr << " replica_answered=" << answered << " replica_forwarded=" << passed_on;
+        }
+        std::cerr << std::endl;
+    }
+    if (config.reconcile)
+    {
+        thread_pool pool{config.reconcile_workers != 0 ? config.reconcile_workers : std::thread::hardware_concurrency()};
+        std::cerr << reconcile(config.journal, std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max(), pool)
+                  << std::flush;
+    }
+
+    for (auto const & b : banks)
+    {
+        if (b->failed())
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+}